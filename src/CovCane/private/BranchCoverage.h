@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+namespace CovCane::BranchCoverage {
+
+// Upper bound of conditional branch sites that get a state.
+constexpr uint32_t MaxSites = 1 << 20;
+
+// Two bits per site, four sites share a byte.
+enum Direction : uint8_t
+{
+    NotTaken = 1 << 0,
+    Taken = 1 << 1,
+};
+
+struct Site
+{
+    uint32_t id;
+    uintptr_t sourceVA;
+    uintptr_t takenVA;
+    uintptr_t fallthroughVA;
+    // Combination of the directions seen so far.
+    uint8_t state;
+};
+
+bool Initialize();
+
+bool IsEnabled();
+
+// Returns the site of the conditional branch at sourceVA, the same site is
+// returned for every block that contains the branch. Returns
+// Coverage::InvalidId once all sites are used.
+uint32_t AddSite(
+    uintptr_t sourceVA, uintptr_t takenVA, uintptr_t fallthroughVA);
+
+// Returns the site of the branch at sourceVA or Coverage::InvalidId.
+uint32_t FindSite(uintptr_t sourceVA);
+
+// Forgets the addresses of the sites within an unloaded range, a module
+// loaded there later gets new sites. The sites stay in the report.
+void RemoveSites(uintptr_t startVA, uintptr_t endVA);
+
+// Byte holding the state of the site and the mask of the direction in it.
+uint8_t* GetStateByte(uint32_t id);
+uint8_t GetStateMask(uint32_t id, Direction direction);
+
+uint8_t GetState(uint32_t id);
+
+std::vector<Site> GetSites();
+
+// Clears the directions of all sites.
+void Reset();
+
+// Writes every site with the directions it took.
+bool WriteReport(const char* outputFile);
+
+} // namespace CovCane::BranchCoverage
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "CoverageMap.h"
+
+namespace CovCane::Config {
+
+enum class CounterMode
+{
+    // Plain increments, counts may be lost when threads race.
+    Racy,
+    // Lock prefixed increments on the shared counters.
+    Atomic,
+    // Each thread increments its own counters, merged on snapshot.
+    PerThread,
+};
+
+struct Options
+{
+    // Runtime log, opened before the other options are read.
+    std::string logFile = "CovCane.log";
+
+    // Emits a 64-bit hit counter at the entry of every translated block.
+    bool profile = false;
+
+    // Hot block report written at shutdown when profiling is enabled.
+    std::string profileOutput = "CovCane.profile.txt";
+
+    CounterMode counterMode = CounterMode::Racy;
+
+    // Maintains a byte hit map per thread, merged on snapshot.
+    bool coverageMap = false;
+
+    // Size of the hit map in bytes, always a power of two.
+    size_t mapSize = 64 * 1024;
+
+    CoverageMap::MergeOp mapMerge = CoverageMap::MergeOp::SaturatingAdd;
+
+    // Threads write their own map, off when the map is shared with a fuzzer
+    // which reads it directly.
+    bool threadMaps = true;
+
+    // Records the directions every conditional branch took.
+    bool branchCoverage = false;
+
+    // Branch report written at shutdown.
+    std::string branchOutput = "CovCane.branches.txt";
+
+    // Derives which instructions of every block ran.
+    bool instructionCoverage = false;
+
+    // Instruction coverage report written at shutdown.
+    std::string instructionOutput = "CovCane.instructions.txt";
+
+    // XORs the coverage map index with a hash of the calling context.
+    bool callContext = false;
+
+    // Innermost call sites that form the context hash, a power of two up to
+    // 16.
+    size_t contextDepth = 4;
+
+    // Number of recent blocks hashed into the coverage map index, 2 to 8,
+    // zero indexes by the block alone.
+    size_t pathLength = 0;
+
+    // Glob patterns of the modules to instrument, matched against the file
+    // name or, when they contain a separator, the full path. Empty selects
+    // the main executable only.
+    std::vector<std::string> moduleInclude;
+
+    // Glob patterns of modules that stay native even when included.
+    std::vector<std::string> moduleExclude;
+
+    // File listing the address ranges and functions to instrument, all
+    // other code of the selected modules runs natively.
+    std::string regionList;
+
+    // Name of the local channel that detaches and re-attaches the
+    // instrumentation of the running process.
+    std::string controlChannel;
+
+    // Signal that toggles between detached and attached, Linux only.
+    size_t controlSignal = 0;
+
+    // Instruments anonymous executable memory the program maps or makes
+    // executable, such as JIT compiled code. Linux only.
+    bool jitCode = false;
+
+    // Starts the fork server once the runtime is initialized.
+    bool forkServer = false;
+
+    // Blocks translated before the fork server starts, one module+offset
+    // per line. A profile report can be used as is.
+    std::string warmList;
+
+    // Comma separated coverage formats written at shutdown: drcov, sancov
+    // and cov.
+    std::string exportFormats;
+
+    // Directory the exported coverage files are written to.
+    std::string exportDir = ".";
+
+    // Binary coverage file written at shutdown.
+    std::string coverageFile;
+
+    // Name of the shared memory segment that all processes publish their
+    // discovered blocks to.
+    std::string sharedMap;
+
+    // Bits of the shared map, only used by the process creating it.
+    size_t sharedMapBits = 16 * 1024 * 1024;
+
+    // Name of the event ring that receives every newly translated block.
+    std::string eventQueue;
+
+    // Events the ring holds before new ones are counted as lost.
+    size_t eventQueueSize = 64 * 1024;
+};
+
+// Reads COVCANE_LOG only, the other options log while they are read.
+void InitializeLog();
+
+// Reads the options from the COVCANE_* environment variables.
+void Initialize();
+
+const Options& Get();
+
+} // namespace CovCane::Config
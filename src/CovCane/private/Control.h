@@ -0,0 +1,14 @@
+#pragma once
+
+#include <string>
+
+namespace CovCane::Control {
+
+// Serves the COVCANE_CONTROL channel and on Linux COVCANE_CONTROL_SIGNAL
+// from a background thread, nothing is started without either.
+bool Initialize();
+
+// Runs one command of the control protocol and returns the reply line.
+std::string Execute(const char* command);
+
+} // namespace CovCane::Control
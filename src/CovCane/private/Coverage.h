@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace CovCane::Coverage {
+
+constexpr uint32_t InvalidId = 0xFFFFFFFF;
+
+// Upper bound of blocks that get a dedicated hit counter.
+constexpr uint32_t MaxBlocks = 1 << 20;
+
+struct Module
+{
+    uint32_t id;
+    uintptr_t base;
+    uintptr_t end;
+    std::string path;
+    // Hash of the file name, the same in every process.
+    uint64_t nameHash;
+    // Cleared on unload, the blocks of the module stay in the reports.
+    bool loaded;
+};
+
+struct Block
+{
+    uint32_t id;
+    uint32_t moduleId;
+    uintptr_t sourceVA;
+    uintptr_t targetVA;
+    uint32_t sourceSize;
+    uint32_t targetSize;
+    // Derived from the module name and offset, stable across processes and
+    // load addresses. Zero for blocks outside of a registered module.
+    uint64_t key;
+};
+
+bool Initialize();
+
+uint32_t RegisterModule(uintptr_t base, uintptr_t end, const char* path);
+
+// Marks the module at base as unloaded, a module loaded at the same address
+// later gets a new id.
+void UnregisterModule(uintptr_t base);
+
+// Assigns the id for a block that is about to be translated, the block is
+// only reported once CommitBlock was called with the translated address.
+// Code translated again after it was invalidated gets its previous id back.
+uint32_t AddBlock(uintptr_t sourceVA, uint32_t sourceSize);
+void CommitBlock(uint32_t id, uintptr_t targetVA, uint32_t targetSize);
+
+uint64_t GetBlockKey(uint32_t id);
+
+bool GetBlock(uint32_t id, Block& out);
+bool GetModule(uint32_t id, Module& out);
+
+// Returns the counter slot of the block or nullptr if the id has none.
+uint64_t* GetCounter(uint32_t id);
+
+// Hit counts including the counters of the live threads.
+uint64_t GetHitCount(uint32_t id);
+std::vector<uint64_t> GetHitCounts();
+
+// Adds the first count entries of a per-thread counter array to the shared
+// counters.
+void FoldCounters(const uint64_t* counters, uint32_t count);
+
+// Shared hit map, threads without a context write to it directly.
+uint8_t* GetMap();
+
+// Map the calling thread writes to, either its own or the shared one.
+uint8_t* GetThreadMap();
+size_t GetMapSize();
+
+// Identifies the block across processes and runs, derived from its module
+// and offset. Blocks outside of a registered module fall back to their id.
+uint32_t GetStableId(uint32_t id);
+uint32_t GetMapIndex(uint32_t id);
+
+// Merges the shared map and the maps of all live threads into out.
+bool SnapshotMap(uint8_t* out, size_t len);
+
+// Merges a per-thread map into the shared map.
+void FoldMap(const uint8_t* map);
+
+// Clears the entries touched since the last reset in all maps.
+void ResetMap();
+
+std::vector<Module> GetModules();
+std::vector<Block> GetBlocks();
+
+} // namespace CovCane::Coverage
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Byte coverage map kernels, free of runtime dependencies so the benchmarks
+// in TestTarget can use them directly.
+namespace CovCane::CoverageMap {
+
+enum class MergeOp
+{
+    // Only keeps track of which entries were hit.
+    Or,
+    // Adds the hit counts, clamped at 255.
+    SaturatingAdd,
+};
+
+// A map allocation is laid out as the hit map followed by one dirty flag per
+// map cache line and one dirty flag per map page, the instrumentation sets
+// both flags so a reset only clears what was touched.
+constexpr size_t LineSize = 64;
+constexpr size_t PageSize = 4096;
+
+constexpr size_t GetLineFlagsOffset(size_t mapSize)
+{
+    return mapSize;
+}
+
+constexpr size_t GetPageFlagsOffset(size_t mapSize)
+{
+    return mapSize + mapSize / LineSize;
+}
+
+constexpr size_t GetAllocationSize(size_t mapSize)
+{
+    return GetPageFlagsOffset(mapSize) + mapSize / PageSize;
+}
+
+void MarkDirty(uint8_t* map, size_t mapSize, size_t index);
+
+// Zeroes the dirty lines of the map and clears the dirty flags.
+void Reset(uint8_t* map, size_t mapSize);
+
+// Like Reset but first records the bucketed hit counts of the dirty lines in
+// virgin, a plain map of mapSize bytes. Returns the number of entries that
+// reached a new bucket.
+size_t Collect(uint8_t* map, size_t mapSize, uint8_t* virgin);
+
+bool HasAvx2();
+
+// Merges src into dst, picks the AVX2 kernel when the CPU supports it.
+void Merge(uint8_t* dst, const uint8_t* src, size_t len, MergeOp op);
+
+void MergeScalar(uint8_t* dst, const uint8_t* src, size_t len, MergeOp op);
+void MergeAvx2(uint8_t* dst, const uint8_t* src, size_t len, MergeOp op);
+
+// Merges a whole map allocation including the dirty flags.
+void MergeAllocation(
+    uint8_t* dst, const uint8_t* src, size_t mapSize, MergeOp op);
+
+} // namespace CovCane::CoverageMap
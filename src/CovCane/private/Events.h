@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace CovCane::Events {
+
+// Creates the event ring named by COVCANE_EVENTS, this process becomes its
+// only producer.
+bool Initialize();
+
+bool IsEnabled();
+
+// Pushes a newly translated block, called with the translation lock held.
+// Never blocks, a full ring counts the event as lost.
+void AddBlock(uint32_t blockId, bool sharedNew);
+
+} // namespace CovCane::Events
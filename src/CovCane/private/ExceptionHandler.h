@@ -1,5 +1,63 @@
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+#ifndef _WIN32
+#include <signal.h>
+#endif
+
 namespace CovCane { namespace ExceptionHandler {
     bool Initialize();
-}} // namespace CovCane::ExceptionHandler
\ No newline at end of file
+
+    // Removes execute rights from every loaded module the filters select
+    // that was not seen before.
+    void ScanModules();
+
+    // Discards the translations and code cache of every module that is no
+    // longer loaded.
+    void RemoveUnloadedModules();
+
+    // Gives the protected pages their execute rights back. Translated code
+    // stays cached, threads inside it return to the original code at the
+    // end of their current block.
+    bool Detach();
+
+    // Removes the execute rights again, blocks translated before detaching
+    // are reused.
+    bool Reattach();
+
+    bool IsDetached();
+
+#ifndef _WIN32
+    // Changes the protection of memory for the program. Protected code stays
+    // without execute rights, writable code has its translations discarded.
+    int ProtectMemory(void* addr, size_t len, int prot);
+
+    // Called after the program mapped memory, anonymous executable memory
+    // is protected when JIT code is enabled.
+    void OnMapMemory(void* addr, size_t len, int prot, int flags);
+
+    // Called before the program unmaps memory, drops the protected code and
+    // translations of the range.
+    void OnUnmapMemory(void* addr, size_t len);
+
+    // Called before dlclose with an address inside the library. Gives its
+    // pages their protection back and discards its translations while it is
+    // still mapped, returns its base or zero if it was not instrumented.
+    uintptr_t ReleaseModule(const void* addr);
+
+    // Called after dlclose with the base ReleaseModule returned. A library
+    // other references keep loaded is protected again, otherwise its
+    // coverage entry is marked unloaded.
+    void FinishRelease(uintptr_t base);
+
+    // Installs a signal handler for the program. Handlers of SIGSEGV,
+    // SIGBUS, SIGFPE, SIGILL and SIGTRAP are chained behind the runtime's
+    // and get the signals it does not take.
+    int SetSignalAction(
+        int sig, const struct sigaction* act, struct sigaction* oldact);
+
+    // Every block exit faults, a thread with SIGSEGV blocked is killed.
+    void UnblockFaults();
+#endif
+}} // namespace CovCane::ExceptionHandler
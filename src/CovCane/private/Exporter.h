@@ -0,0 +1,24 @@
+#pragma once
+
+namespace CovCane::Exporter {
+
+enum class Format
+{
+    // drcov module table followed by the binary basic block table.
+    DrCov,
+    // Module relative offsets in the raw 64-bit sancov format.
+    SanCov,
+    // Memory mappable CovCane coverage file, see CovCane/CoverageFile.h.
+    Binary,
+};
+
+bool ParseFormat(const char* name, Format& format);
+
+// Writes the covered blocks in the given format. SanCov writes one file per
+// module, output then names the directory.
+bool Write(Format format, const char* output);
+
+// Writes every format listed in COVCANE_EXPORT into COVCANE_EXPORT_DIR.
+void WriteConfigured();
+
+} // namespace CovCane::Exporter
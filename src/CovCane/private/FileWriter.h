@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <memory>
+
+namespace CovCane {
+
+// Buffered output for the coverage files, records are formatted straight
+// into the buffer which is written out in large chunks.
+class FileWriter
+{
+    static constexpr size_t BufferSize = 64 * 1024;
+
+    FILE* _file = nullptr;
+    std::unique_ptr<char[]> _buffer;
+    size_t _used = 0;
+    bool _failed = false;
+
+public:
+    FileWriter() = default;
+    FileWriter(const FileWriter&) = delete;
+    FileWriter& operator=(const FileWriter&) = delete;
+    ~FileWriter();
+
+    bool Open(const char* path);
+
+    // Flushes the buffer and closes the file, returns false if any write
+    // failed.
+    bool Close();
+
+    void Write(const void* data, size_t len);
+
+    template<typename T> void WriteValue(const T& val)
+    {
+        Write(&val, sizeof(T));
+    }
+
+    // Formats up to 1 KiB into the buffer.
+    void Print(const char* fmt, ...);
+
+private:
+    void Flush();
+};
+
+} // namespace CovCane
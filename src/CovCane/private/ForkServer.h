@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stddef.h>
+
+namespace CovCane::ForkServer {
+
+// Translates the blocks listed in listFile ahead of time so forked children
+// start with a populated code cache. Returns the number of blocks translated.
+size_t WarmUp(const char* listFile);
+
+// Maps the shared memory of an AFL compatible driver over the coverage map,
+// does nothing when the process was not started by one.
+bool AttachSharedMap();
+
+// Speaks the AFL fork server protocol on the control and status descriptors.
+// Only returns in the forked children, or with false when no driver is
+// listening. Has to run before the target creates threads.
+bool Run();
+
+} // namespace CovCane::ForkServer
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+namespace CovCane::InstructionCoverage {
+
+// Boundary of a source instruction inside a translated block.
+struct Instruction
+{
+    // Start of the translated instruction relative to the block's code.
+    uint32_t targetOffset;
+    uint8_t length;
+    // Conditional branches can leave the block early.
+    bool conditional;
+};
+
+struct BlockCoverage
+{
+    uint32_t blockId;
+    uint32_t instructionCount;
+    uint32_t executedCount;
+    // Run lengths of the instruction bitmap, alternating between executed
+    // and not executed and starting with executed.
+    std::vector<uint32_t> runs;
+};
+
+bool Initialize();
+
+bool IsEnabled();
+
+// Records the instructions of a translated block in source order.
+void AddBlock(
+    uint32_t blockId,
+    uintptr_t targetVA,
+    uint32_t targetSize,
+    std::vector<Instruction> instructions);
+
+// Forgets the translated address of a block whose code was released, the
+// block keeps its instructions for the report.
+void RemoveBlock(uintptr_t targetVA);
+
+// Records an exception raised by translated code, the instruction at
+// targetVA started but the rest of its block did not run. Returns false if
+// the address is not inside a translated block.
+bool RecordExit(uintptr_t targetVA);
+
+// Instruction coverage of every covered block, derived from the block
+// coverage, the recorded exits and the branch directions if available.
+std::vector<BlockCoverage> GetCoverage();
+
+bool WriteReport(const char* outputFile);
+
+} // namespace CovCane::InstructionCoverage
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+#include <asmjit/asmjit.h>
+
+#include "BranchCoverage.h"
+
+namespace CovCane::Instrumentation {
+
+// Emits the probe that runs at the entry of the translated block, the probe
+// preserves all registers, flags and the red zone. Returns false if the
+// current configuration requires no probe.
+bool EmitBlockProbe(asmjit::x86::Assembler& cb, uint32_t blockId);
+
+// True if calls and returns maintain the call stack hash.
+bool HasCallContext();
+
+// Emits the context update in front of a translated call, returnVA is the
+// original return address.
+void EmitCallContext(asmjit::x86::Assembler& cb, uintptr_t returnVA);
+
+// Emits the context update in front of a translated return.
+void EmitReturnContext(asmjit::x86::Assembler& cb);
+
+// Emits the probe on one exit of a conditional branch that records the
+// direction. The flags are only preserved with saveFlags, callers pass false
+// when the code at the exit overwrites them before reading any.
+void EmitBranchProbe(
+    asmjit::x86::Assembler& cb,
+    uint32_t siteId,
+    BranchCoverage::Direction direction,
+    bool saveFlags);
+
+} // namespace CovCane::Instrumentation
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "Coverage.h"
+
+namespace CovCane::Location {
+
+// Returns the part of path after the last separator.
+const char* GetFileName(const char* path);
+
+// Formats addr as module+offset as the reports print it, "?" without a
+// module.
+void Format(
+    char* buf, size_t size, const Coverage::Module* mod, uintptr_t addr);
+
+} // namespace CovCane::Location
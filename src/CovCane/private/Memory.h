@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stddef.h>
 
 namespace CovCane::Memory {
 
@@ -16,4 +17,13 @@ template<typename T> bool SafeWrite(uintptr_t addr, const T& buf)
     return SafeWrite(addr, &buf, sizeof(T));
 }
 
+// Reserves and commits zero initialized read/write pages.
+void* AllocatePages(size_t len);
+void FreePages(void* addr, size_t len);
+
+// Reserves inaccessible address space, CommitPages makes a part of it
+// read/write. Both are released by FreePages.
+void* ReservePages(size_t len);
+bool CommitPages(void* addr, size_t len);
+
 } // namespace CovCane::Memory
\ No newline at end of file
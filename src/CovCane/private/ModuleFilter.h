@@ -0,0 +1,21 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace CovCane::ModuleFilter {
+
+// Matches '*' against any run of characters and '?' against a single one,
+// case insensitive on Windows.
+bool MatchGlob(const char* pattern, const char* str);
+
+// Patterns with a path separator match the full path, the others only the
+// file name.
+bool MatchAny(const std::vector<std::string>& patterns, const char* path);
+
+// Decides whether a module is instrumented. Without include patterns only
+// the main executable is, exclude patterns and the libraries the runtime
+// depends on always stay native.
+bool IsIncluded(const char* path, bool mainModule);
+
+} // namespace CovCane::ModuleFilter
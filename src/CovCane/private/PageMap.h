@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+namespace CovCane {
+
+// Set of 4K pages over the 47 bit user address space as a two level bitmap,
+// one leaf pointer per 4GB and a 128KB leaf with one bit per page. A lookup
+// is two loads regardless of how many ranges were added. Free of runtime
+// dependencies so the benchmarks in TestTarget can use it directly. 32-bit
+// builds have a single leaf.
+//
+// Leaves are never released and are published with release stores, lookups
+// may run concurrently with Add and Remove and only ever see a stale bit.
+class PageMap
+{
+public:
+    static constexpr unsigned PageShift = 12;
+    static constexpr unsigned LeafShift = 32;
+    static constexpr unsigned AddressBits = sizeof(uintptr_t) == 8 ? 47 : 32;
+
+    static constexpr size_t LeafCount = size_t(1) << (AddressBits - LeafShift);
+    static constexpr size_t LeafPages = size_t(1) << (LeafShift - PageShift);
+    static constexpr size_t LeafWords = LeafPages / 64;
+
+private:
+    using Leaf = std::atomic<uint64_t*>;
+
+    std::atomic<Leaf*> _leaves{ nullptr };
+
+public:
+    PageMap() = default;
+    PageMap(const PageMap&) = delete;
+    PageMap& operator=(const PageMap&) = delete;
+    ~PageMap();
+
+    // Marks every page overlapping [start, end), returns false if the range
+    // is outside of the user address space or a leaf can not be allocated.
+    bool Add(uintptr_t start, uintptr_t end);
+
+    // Clears every page overlapping [start, end).
+    void Remove(uintptr_t start, uintptr_t end);
+
+    bool Contains(uintptr_t addr) const
+    {
+        // Shifted as 64-bit, a shift by the width of a 32-bit address is
+        // undefined.
+        const uint64_t leafIndex = uint64_t(addr) >> LeafShift;
+        const Leaf* leaves = _leaves.load(std::memory_order_acquire);
+        if (leaves == nullptr || leafIndex >= LeafCount)
+            return false;
+
+        const uint64_t* leaf = leaves[leafIndex].load(
+            std::memory_order_acquire);
+        if (leaf == nullptr)
+            return false;
+
+        const uintptr_t page = (addr >> PageShift) & (LeafPages - 1);
+        return ((leaf[page / 64] >> (page % 64)) & 1) != 0;
+    }
+};
+
+} // namespace CovCane
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "CovCane.h"
+
+namespace CovCane::Persistent {
+
+void SetTarget(CovCane_PersistentTarget target);
+
+bool Run(
+    CovCane_InputCallback nextInput,
+    CovCane_ResultCallback onResult,
+    void* user,
+    uint64_t maxIterations,
+    CovCane_PersistentStats* stats);
+
+} // namespace CovCane::Persistent
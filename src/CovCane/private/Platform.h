@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace CovCane::Platform {
+
+// fopen_s is only available with the Microsoft runtime.
+inline FILE* OpenFile(const char* path, const char* mode)
+{
+#ifdef _WIN32
+    FILE* fp = nullptr;
+    if (fopen_s(&fp, path, mode) != 0)
+        return nullptr;
+    return fp;
+#else
+    return fopen(path, mode);
+#endif
+}
+
+#ifndef _WIN32
+
+// The runtime interposes mmap, munmap and mprotect to follow code the program
+// generates, its own mappings go straight to the kernel.
+inline void* MapPages(void* addr, size_t len, int prot, int flags)
+{
+    return reinterpret_cast<void*>(
+        syscall(SYS_mmap, addr, len, prot, flags, -1, 0));
+}
+
+inline int UnmapPages(void* addr, size_t len)
+{
+    return static_cast<int>(syscall(SYS_munmap, addr, len));
+}
+
+inline int ProtectPages(void* addr, size_t len, int prot)
+{
+    return static_cast<int>(syscall(SYS_mprotect, addr, len, prot));
+}
+
+#endif
+
+} // namespace CovCane::Platform
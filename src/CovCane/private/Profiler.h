@@ -0,0 +1,8 @@
+#pragma once
+
+namespace CovCane::Profiler {
+
+// Writes all translated blocks sorted by their hit count.
+bool WriteReport(const char* outputFile);
+
+} // namespace CovCane::Profiler
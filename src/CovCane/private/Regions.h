@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+namespace CovCane::Regions {
+
+struct Range
+{
+    uintptr_t start;
+    uintptr_t end;
+};
+
+// Loads the region list named by COVCANE_REGIONS. Without a list every
+// executable page of the selected modules is instrumented.
+bool Initialize();
+
+bool IsEnabled();
+
+// Resolves the entries of the list that fall into the module, the result is
+// page aligned, sorted and free of overlaps.
+std::vector<Range> Resolve(const char* path, uintptr_t base, uintptr_t end);
+
+// Pages of [startVA, endVA) that lose their execute rights, the whole range
+// when no list is loaded.
+std::vector<Range> SelectPages(
+    const std::vector<Range>& selected, uintptr_t startVA, uintptr_t endVA);
+
+} // namespace CovCane::Regions
@@ -1,12 +1,32 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 namespace CovCane::Rewriter {
 
 void Initialize();
 
-bool CreateSectionBuffer(uintptr_t startVA, uintptr_t endVA);
+// Reserves the code cache of a module up front, translations of
+// [startVA, endVA) are allocated from it. Ranges inside an already reserved
+// one share its cache.
+bool ReserveCodeCache(uintptr_t startVA, uintptr_t endVA, size_t codeSize);
+
+// Translations of [startVA, endVA) go to the cache shared by all code outside
+// of modules, unless the range lies in a reserved one.
+bool ShareCodeCache(uintptr_t startVA, uintptr_t endVA);
+
+// Discards every translation whose source lies in [startVA, endVA) along
+// with the code cache of the range, returns the number of translations.
+size_t RemoveModule(uintptr_t startVA, uintptr_t endVA);
+
+// Discards every translation whose original instructions overlap
+// [startVA, endVA), they are translated again on their next execution.
+size_t Invalidate(uintptr_t startVA, uintptr_t endVA);
+
+// End of the original instructions translated from source VA, zero when it
+// is not translated.
+uintptr_t GetSourceEnd(uintptr_t sourceVA);
 
 // Rewrites the branch from source VA and results the new address
 // with the rewritten code.
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <map>
 #include <vector>
 #include <asmjit/asmjit.h>
 
@@ -7,14 +8,43 @@ namespace CovCane {
 
 class Runtime final : public asmjit::Target
 {
-    struct Buffer
+    // Address space reserved near the code it holds, committed as the
+    // cursor advances.
+    struct Reservation
     {
         uintptr_t base;
         uintptr_t end;
         uintptr_t cur;
+        uintptr_t committed;
+        // Regions allocating from a shared reservation.
+        size_t users;
     };
 
-    std::vector<Buffer> _buffers;
+    // Code cache of one module or code range, its translations are
+    // allocated from the latest reservation and released with it when the
+    // module is unloaded. Code outside of modules allocates from the shared
+    // reservations instead and only records which ones it uses.
+    struct Region
+    {
+        uintptr_t ownerStart;
+        uintptr_t ownerEnd;
+        std::vector<Reservation> reservations;
+        bool shared;
+        std::vector<uintptr_t> sharedBases;
+    };
+
+    // Ordered by owner start, owners do not overlap.
+    std::map<uintptr_t, Region> _regions;
+
+    // Cache of generated code and of code outside of every range, each new
+    // reservation twice the size of the one before.
+    std::vector<Reservation> _shared;
+
+    // Owner of the code outside of every range, never released.
+    Region _unowned{ 0, 0, {}, true, {} };
+
+    // Consecutive translations mostly come from the same module.
+    Region* _lastRegion = nullptr;
 
 public:
     Runtime() noexcept;
@@ -39,9 +69,24 @@ public:
 
     void flush(const void* p, size_t size) noexcept;
 
-    void* createBuffer(uintptr_t startVA, uintptr_t endVA);
+    // Reserves the code cache for the translations of [startVA, endVA),
+    // sized after the code that will be translated.
+    bool reserveRegion(uintptr_t startVA, uintptr_t endVA, size_t codeSize);
+
+    // Sends the translations of [startVA, endVA) to the shared code cache
+    // unless the range already belongs to a region.
+    bool shareRegion(uintptr_t startVA, uintptr_t endVA);
+
+    // Frees the code cache of every region inside [startVA, endVA), returns
+    // the number of bytes released.
+    size_t releaseRegions(uintptr_t startVA, uintptr_t endVA);
 
 private:
+    Region* findRegion(uintptr_t sourceVA);
+    bool addReservation(Region& region, uintptr_t va, size_t len);
+    Reservation* findShared(uintptr_t sourceVA, size_t len);
+    void* take(Reservation& res, size_t len);
+    void* allocShared(Region& region, size_t len, uintptr_t sourceVA);
     void* alloc(size_t len, uintptr_t sourceVA);
 };
 
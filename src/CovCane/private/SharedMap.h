@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace CovCane::SharedMap {
+
+// Attaches to the shared coverage segment named by COVCANE_SHM, creating
+// it if this is the first process.
+bool Initialize();
+
+bool IsAttached();
+
+// Publishes a translated block to the other processes, returns true if no
+// process had it before.
+bool AddBlock(uint32_t blockId);
+
+} // namespace CovCane::SharedMap
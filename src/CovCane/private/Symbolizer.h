@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace CovCane::Symbolizer {
+
+// Loads the debug information of the process, returns false if symbols can
+// not be resolved on this platform.
+bool Initialize();
+void Shutdown();
+
+} // namespace CovCane::Symbolizer
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <asmjit/asmjit.h>
+
+namespace CovCane::ThreadContext {
+
+// Calls tracked by the call stack hash before the oldest frames are reused.
+constexpr uint32_t CallStackSize = 64;
+
+// Longest block sequence hashed into the map index.
+constexpr uint32_t MaxPathLength = 8;
+
+struct CallFrame
+{
+    // Hash of the caller, restored on return.
+    uint32_t hash;
+    uint32_t site;
+};
+
+// Per-thread state addressed by the translated code through a TLS slot.
+struct Context
+{
+    uint64_t* counters;
+    uint8_t* map;
+    // Blocks the counter pages are committed for.
+    uint32_t counterCount;
+    // Rolling hash of the innermost call sites, see COVCANE_CONTEXT.
+    uint32_t callHash;
+    uint32_t callDepth;
+    CallFrame callStack[CallStackSize];
+    // Hash of the last blocks and the values that remove them from it again,
+    // see COVCANE_NGRAM.
+    uint32_t pathHash;
+    uint32_t pathPos;
+    uint32_t pathRing[MaxPathLength];
+};
+
+bool Initialize();
+
+// Returns false if the translated code can not address the TLS slot.
+bool IsAvailable();
+
+// Creates the context of the calling thread, threads that existed before
+// the runtime was loaded have none and use the shared state instead.
+void Attach();
+
+// Folds the thread state into the shared state and releases it.
+void Detach();
+
+Context* Current();
+
+// Commits the per-thread counters of every context for the first count
+// blocks, before code incrementing them is emitted. Returns false if they
+// could not be committed.
+bool CommitCounters(uint32_t count);
+
+// Emits a load of the current context pointer into reg, the result is zero
+// for threads without a context.
+void EmitLoad(asmjit::x86::Assembler& cb, const asmjit::x86::Gp& reg);
+
+// Invokes fn for every live context while holding the context list lock.
+void ForEach(void (*fn)(const Context& ctx, void* user), void* user);
+
+} // namespace CovCane::ThreadContext
@@ -8,4 +8,11 @@ namespace CovCane::Translation {
 bool convertInstruction(
     const ZydisDecodedInstruction& instr, asmjit::x86::Assembler& cb);
 
+// Emits the conditional branch with target as its destination instead of
+// the original one.
+bool convertConditionalBranch(
+    const ZydisDecodedInstruction& instr,
+    asmjit::x86::Assembler& cb,
+    const asmjit::Label& target);
+
 }
\ No newline at end of file
@@ -0,0 +1,68 @@
+#include "CovCane.h"
+#include "Config.h"
+#include "Coverage.h"
+#include "Exporter.h"
+#include "ForkServer.h"
+#include "Persistent.h"
+#include "Profiler.h"
+
+using namespace CovCane;
+
+COVCANE_API int CovCane_WriteProfile(const char* outputFile)
+{
+    const Config::Options& opts = Config::Get();
+    if (!opts.profile)
+        return 0;
+
+    if (outputFile == nullptr)
+        outputFile = opts.profileOutput.c_str();
+
+    return Profiler::WriteReport(outputFile) ? 1 : 0;
+}
+
+COVCANE_API int CovCane_ExportCoverage(const char* format, const char* output)
+{
+    Exporter::Format fmt;
+    if (format == nullptr || output == nullptr
+        || !Exporter::ParseFormat(format, fmt))
+        return 0;
+
+    return Exporter::Write(fmt, output) ? 1 : 0;
+}
+
+COVCANE_API size_t CovCane_GetCoverageMapSize(void)
+{
+    return Coverage::GetMapSize();
+}
+
+COVCANE_API int CovCane_SnapshotCoverageMap(uint8_t* out, size_t len)
+{
+    return Coverage::SnapshotMap(out, len) ? 1 : 0;
+}
+
+COVCANE_API void CovCane_ResetCoverageMap(void)
+{
+    Coverage::ResetMap();
+}
+
+COVCANE_API void CovCane_SetPersistentTarget(CovCane_PersistentTarget target)
+{
+    Persistent::SetTarget(target);
+}
+
+COVCANE_API int CovCane_RunPersistent(
+    CovCane_InputCallback nextInput,
+    CovCane_ResultCallback onResult,
+    void* user,
+    uint64_t maxIterations,
+    CovCane_PersistentStats* stats)
+{
+    return Persistent::Run(nextInput, onResult, user, maxIterations, stats)
+               ? 1
+               : 0;
+}
+
+COVCANE_API int CovCane_StartForkServer(void)
+{
+    return ForkServer::Run() ? 1 : 0;
+}
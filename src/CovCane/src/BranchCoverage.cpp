@@ -0,0 +1,196 @@
+#include "BranchCoverage.h"
+#include "Config.h"
+#include "Coverage.h"
+#include "Location.h"
+#include "Logging.h"
+#include "Memory.h"
+#include "Platform.h"
+
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+namespace CovCane {
+
+static std::vector<BranchCoverage::Site> _sites;
+static std::unordered_map<uintptr_t, uint32_t> _sitesByVA;
+static uint8_t* _states = nullptr;
+static std::mutex _lock;
+
+constexpr size_t StateBytes = BranchCoverage::MaxSites / 4;
+
+bool BranchCoverage::Initialize()
+{
+    if (!Config::Get().branchCoverage)
+        return true;
+
+    _states = static_cast<uint8_t*>(Memory::AllocatePages(StateBytes));
+    if (_states == nullptr)
+    {
+        Logging::Msg("Unable to allocate branch states");
+        return false;
+    }
+
+    return true;
+}
+
+bool BranchCoverage::IsEnabled()
+{
+    return _states != nullptr;
+}
+
+uint32_t BranchCoverage::AddSite(
+    uintptr_t sourceVA, uintptr_t takenVA, uintptr_t fallthroughVA)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+
+    auto it = _sitesByVA.find(sourceVA);
+    if (it != _sitesByVA.end())
+        return it->second;
+
+    if (_states == nullptr || _sites.size() >= MaxSites)
+        return Coverage::InvalidId;
+
+    Site& site = _sites.emplace_back();
+    site.id = static_cast<uint32_t>(_sites.size() - 1);
+    site.sourceVA = sourceVA;
+    site.takenVA = takenVA;
+    site.fallthroughVA = fallthroughVA;
+    site.state = 0;
+
+    _sitesByVA.emplace(sourceVA, site.id);
+
+    return site.id;
+}
+
+uint32_t BranchCoverage::FindSite(uintptr_t sourceVA)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+
+    auto it = _sitesByVA.find(sourceVA);
+    if (it == _sitesByVA.end())
+        return Coverage::InvalidId;
+    return it->second;
+}
+
+void BranchCoverage::RemoveSites(uintptr_t startVA, uintptr_t endVA)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+
+    for (auto it = _sitesByVA.begin(); it != _sitesByVA.end();)
+    {
+        if (it->first >= startVA && it->first < endVA)
+            it = _sitesByVA.erase(it);
+        else
+            ++it;
+    }
+}
+
+uint8_t* BranchCoverage::GetStateByte(uint32_t id)
+{
+    if (_states == nullptr || id >= MaxSites)
+        return nullptr;
+    return &_states[id / 4];
+}
+
+uint8_t BranchCoverage::GetStateMask(uint32_t id, Direction direction)
+{
+    return static_cast<uint8_t>(direction << ((id % 4) * 2));
+}
+
+uint8_t BranchCoverage::GetState(uint32_t id)
+{
+    const uint8_t* state = GetStateByte(id);
+    if (state == nullptr)
+        return 0;
+    return (*state >> ((id % 4) * 2)) & (NotTaken | Taken);
+}
+
+std::vector<BranchCoverage::Site> BranchCoverage::GetSites()
+{
+    std::lock_guard<std::mutex> lock(_lock);
+
+    std::vector<Site> res = _sites;
+    for (auto& site : res)
+        site.state = GetState(site.id);
+    return res;
+}
+
+void BranchCoverage::Reset()
+{
+    if (_states != nullptr)
+        memset(_states, 0, StateBytes);
+}
+
+static const char* GetStateName(uint8_t state)
+{
+    switch (state)
+    {
+        case BranchCoverage::NotTaken:
+            return "not-taken";
+        case BranchCoverage::Taken:
+            return "taken";
+        case BranchCoverage::NotTaken | BranchCoverage::Taken:
+            return "both";
+    }
+    return "none";
+}
+
+bool BranchCoverage::WriteReport(const char* outputFile)
+{
+    const auto modules = Coverage::GetModules();
+    const auto sites = GetSites();
+
+    FILE* fp = Platform::OpenFile(outputFile, "wt");
+    if (fp == nullptr)
+    {
+        Logging::Msg("Unable to open branch output: %s", outputFile);
+        return false;
+    }
+
+    size_t both = 0;
+    for (auto& site : sites)
+    {
+        if (site.state == (NotTaken | Taken))
+            both++;
+    }
+
+    fprintf(fp, "# Sites: %zu, both directions: %zu\n", sites.size(), both);
+    fprintf(
+        fp, "# %-16s %-40s %-16s %-16s %s\n", "va", "module+offset", "taken",
+        "fallthrough", "seen");
+
+    for (auto& site : sites)
+    {
+        const Coverage::Module* siteModule = nullptr;
+        for (auto& mod : modules)
+        {
+            if (site.sourceVA >= mod.base && site.sourceVA < mod.end)
+            {
+                siteModule = &mod;
+                break;
+            }
+        }
+
+        char location[64];
+        Location::Format(
+            location, sizeof(location), siteModule, site.sourceVA);
+
+        fprintf(
+            fp, "  %016llx %-40s %016llx %016llx %s\n",
+            (unsigned long long)site.sourceVA, location,
+            (unsigned long long)site.takenVA,
+            (unsigned long long)site.fallthroughVA, GetStateName(site.state));
+    }
+
+    fclose(fp);
+
+    Logging::Msg(
+        "Wrote %zu branch sites, %zu with both directions, to %s",
+        sites.size(), both, outputFile);
+
+    return true;
+}
+
+} // namespace CovCane
@@ -0,0 +1,250 @@
+#include "Config.h"
+#include "Logging.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+namespace CovCane::Config {
+
+static Options _options;
+
+static bool ReadEnv(const char* name, std::string& value)
+{
+#ifdef _WIN32
+    char* buf = nullptr;
+    size_t len = 0;
+    if (_dupenv_s(&buf, &len, name) != 0 || buf == nullptr)
+        return false;
+    value = buf;
+    free(buf);
+#else
+    const char* buf = getenv(name);
+    if (buf == nullptr)
+        return false;
+    value = buf;
+#endif
+    return true;
+}
+
+static void ReadBool(const char* name, bool& value)
+{
+    std::string str;
+    if (!ReadEnv(name, str))
+        return;
+    value = !(str.empty() || str == "0" || str == "false" || str == "off");
+}
+
+static void ReadString(const char* name, std::string& value)
+{
+    std::string str;
+    if (ReadEnv(name, str) && !str.empty())
+        value = str;
+}
+
+static void ReadList(const char* name, std::vector<std::string>& value)
+{
+    std::string str;
+    if (!ReadEnv(name, str))
+        return;
+
+    size_t pos = 0;
+    while (pos <= str.size())
+    {
+        size_t next = str.find(',', pos);
+        if (next == std::string::npos)
+            next = str.size();
+        if (next != pos)
+            value.push_back(str.substr(pos, next - pos));
+        pos = next + 1;
+    }
+}
+
+static void ReadSize(const char* name, size_t& value)
+{
+    std::string str;
+    if (!ReadEnv(name, str) || str.empty())
+        return;
+
+    char* end = nullptr;
+    unsigned long long res = strtoull(str.c_str(), &end, 0);
+    switch (*end)
+    {
+        case 'k':
+        case 'K':
+            res <<= 10;
+            break;
+        case 'm':
+        case 'M':
+            res <<= 20;
+            break;
+    }
+    value = static_cast<size_t>(res);
+}
+
+static void ReadMergeOp(const char* name, CoverageMap::MergeOp& value)
+{
+    std::string str;
+    if (!ReadEnv(name, str))
+        return;
+
+    if (str == "or")
+        value = CoverageMap::MergeOp::Or;
+    else if (str == "add")
+        value = CoverageMap::MergeOp::SaturatingAdd;
+    else
+        Logging::Msg("Unknown map merge operation: %s", str.c_str());
+}
+
+static void ReadCounterMode(const char* name, CounterMode& value)
+{
+    std::string str;
+    if (!ReadEnv(name, str))
+        return;
+
+    if (str == "racy")
+        value = CounterMode::Racy;
+    else if (str == "atomic")
+        value = CounterMode::Atomic;
+    else if (str == "thread")
+        value = CounterMode::PerThread;
+    else
+        Logging::Msg("Unknown counter mode: %s", str.c_str());
+}
+
+static const char* CounterModeName(CounterMode mode)
+{
+    switch (mode)
+    {
+        case CounterMode::Racy:
+            return "racy";
+        case CounterMode::Atomic:
+            return "atomic";
+        case CounterMode::PerThread:
+            return "thread";
+    }
+    return "unknown";
+}
+
+void InitializeLog()
+{
+    ReadString("COVCANE_LOG", _options.logFile);
+}
+
+void Initialize()
+{
+    ReadBool("COVCANE_PROFILE", _options.profile);
+    ReadString("COVCANE_PROFILE_OUTPUT", _options.profileOutput);
+    ReadCounterMode("COVCANE_COUNTER_MODE", _options.counterMode);
+    ReadBool("COVCANE_MAP", _options.coverageMap);
+    ReadSize("COVCANE_MAP_SIZE", _options.mapSize);
+    ReadMergeOp("COVCANE_MAP_MERGE", _options.mapMerge);
+    ReadBool("COVCANE_BRANCH_COVERAGE", _options.branchCoverage);
+    ReadString("COVCANE_BRANCH_OUTPUT", _options.branchOutput);
+    ReadBool("COVCANE_INSTRUCTION_COVERAGE", _options.instructionCoverage);
+    ReadString("COVCANE_INSTRUCTION_OUTPUT", _options.instructionOutput);
+    ReadBool("COVCANE_CONTEXT", _options.callContext);
+    ReadSize("COVCANE_CONTEXT_DEPTH", _options.contextDepth);
+    ReadSize("COVCANE_NGRAM", _options.pathLength);
+    ReadList("COVCANE_INCLUDE", _options.moduleInclude);
+    ReadList("COVCANE_EXCLUDE", _options.moduleExclude);
+    ReadString("COVCANE_REGIONS", _options.regionList);
+    ReadString("COVCANE_CONTROL", _options.controlChannel);
+    ReadSize("COVCANE_CONTROL_SIGNAL", _options.controlSignal);
+    ReadBool("COVCANE_JIT", _options.jitCode);
+    ReadBool("COVCANE_FORKSERVER", _options.forkServer);
+    ReadString("COVCANE_WARM_LIST", _options.warmList);
+    ReadString("COVCANE_EXPORT", _options.exportFormats);
+    ReadString("COVCANE_EXPORT_DIR", _options.exportDir);
+    ReadString("COVCANE_COVERAGE_FILE", _options.coverageFile);
+    ReadString("COVCANE_SHM", _options.sharedMap);
+    ReadSize("COVCANE_SHM_BITS", _options.sharedMapBits);
+    ReadString("COVCANE_EVENTS", _options.eventQueue);
+    ReadSize("COVCANE_EVENTS_SIZE", _options.eventQueueSize);
+
+    // An AFL compatible driver shares its map, the size has to match and
+    // all threads have to write to it directly.
+    std::string shmId;
+    if (ReadEnv("__AFL_SHM_ID", shmId))
+    {
+        _options.coverageMap = true;
+        _options.threadMaps = false;
+        _options.mapSize = 64 * 1024;
+        ReadSize("AFL_MAP_SIZE", _options.mapSize);
+    }
+
+    // The context and path are only folded into the map index.
+    if (_options.callContext || _options.pathLength != 0)
+        _options.coverageMap = true;
+
+    const size_t pathLength = _options.pathLength;
+    if (pathLength == 1 || pathLength > 8)
+    {
+        Logging::Msg("Invalid n-gram length %zu, using 2", pathLength);
+        _options.pathLength = 2;
+    }
+
+    const size_t depth = _options.contextDepth;
+    if (depth == 0 || depth > 16 || (depth & (depth - 1)))
+    {
+        Logging::Msg("Invalid context depth %zu, using 4", depth);
+        _options.contextDepth = 4;
+    }
+
+    const size_t mapSize = _options.mapSize;
+    if (mapSize < 4096 || mapSize > (256u << 20) || (mapSize & (mapSize - 1)))
+    {
+        Logging::Msg("Invalid map size %zu, using 64 KiB", mapSize);
+        _options.mapSize = 64 * 1024;
+    }
+
+    const size_t mapBits = _options.sharedMapBits;
+    if (mapBits < 64 || (mapBits & (mapBits - 1)))
+    {
+        Logging::Msg("Invalid shared map size %zu, using 16M bits", mapBits);
+        _options.sharedMapBits = 16 * 1024 * 1024;
+    }
+
+    const size_t queueSize = _options.eventQueueSize;
+    if (queueSize < 64 || queueSize > (16u << 20)
+        || (queueSize & (queueSize - 1)))
+    {
+        Logging::Msg("Invalid event queue size %zu, using 64K", queueSize);
+        _options.eventQueueSize = 64 * 1024;
+    }
+
+    Logging::Msg(
+        "Profiling: %s, counters: %s", _options.profile ? "on" : "off",
+        CounterModeName(_options.counterMode));
+    Logging::Msg(
+        "Coverage map: %s, %zu bytes", _options.coverageMap ? "on" : "off",
+        _options.mapSize);
+    if (_options.branchCoverage)
+        Logging::Msg("Branch coverage: on");
+    if (_options.instructionCoverage)
+        Logging::Msg("Instruction coverage: on");
+    if (_options.callContext)
+        Logging::Msg("Call context: depth %zu", _options.contextDepth);
+    if (_options.pathLength != 0)
+        Logging::Msg("N-gram coverage: %zu blocks", _options.pathLength);
+    for (auto& pattern : _options.moduleInclude)
+        Logging::Msg("Include: %s", pattern.c_str());
+    for (auto& pattern : _options.moduleExclude)
+        Logging::Msg("Exclude: %s", pattern.c_str());
+    if (_options.jitCode)
+        Logging::Msg("JIT code: on");
+    if (_options.forkServer)
+        Logging::Msg("Fork server: on");
+    if (!_options.exportFormats.empty())
+    {
+        Logging::Msg(
+            "Export: %s to %s", _options.exportFormats.c_str(),
+            _options.exportDir.c_str());
+    }
+}
+
+const Options& Get()
+{
+    return _options;
+}
+
+} // namespace CovCane::Config
@@ -0,0 +1,299 @@
+#include "Control.h"
+#include "Config.h"
+#include "ExceptionHandler.h"
+#include "Logging.h"
+#include "CovCane/ControlChannel.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace CovCane {
+
+std::string Control::Execute(const char* command)
+{
+    std::string cmd = command;
+    while (!cmd.empty() && (cmd.back() == '\n' || cmd.back() == '\r'))
+        cmd.pop_back();
+
+    if (cmd == "detach")
+    {
+        if (!ExceptionHandler::Detach())
+            return "error some ranges are still protected";
+        return "ok detached";
+    }
+    if (cmd == "attach")
+    {
+        if (!ExceptionHandler::Reattach())
+            return "error some ranges are still executable";
+        return "ok attached";
+    }
+    if (cmd == "status")
+        return ExceptionHandler::IsDetached() ? "detached" : "attached";
+
+    return "error unknown command";
+}
+
+#ifdef _WIN32
+
+static std::string _pipeName;
+
+static DWORD WINAPI ServerMain(LPVOID)
+{
+    for (;;)
+    {
+        // One instance at a time, commands are short and run in order.
+        HANDLE pipe = CreateNamedPipeA(
+            _pipeName.c_str(), PIPE_ACCESS_DUPLEX,
+            PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT
+                | PIPE_REJECT_REMOTE_CLIENTS,
+            1,
+            ControlChannel::MaxLine, ControlChannel::MaxLine, 0, nullptr);
+        if (pipe == INVALID_HANDLE_VALUE)
+        {
+            Logging::Msg("CreateNamedPipe failed: 0x%08X", GetLastError());
+            return 1;
+        }
+
+        if (ConnectNamedPipe(pipe, nullptr) != FALSE
+            || GetLastError() == ERROR_PIPE_CONNECTED)
+        {
+            char buf[ControlChannel::MaxLine]{};
+            DWORD len = 0;
+            if (ReadFile(pipe, buf, sizeof(buf) - 1, &len, nullptr) != FALSE)
+            {
+                const std::string reply = Control::Execute(buf) + "\n";
+
+                DWORD written = 0;
+                WriteFile(
+                    pipe, reply.data(), static_cast<DWORD>(reply.size()),
+                    &written, nullptr);
+                FlushFileBuffers(pipe);
+            }
+        }
+
+        DisconnectNamedPipe(pipe);
+        CloseHandle(pipe);
+    }
+}
+
+bool Control::Initialize()
+{
+    const Config::Options& opts = Config::Get();
+    if (opts.controlSignal != 0)
+        Logging::Msg("Control signals are not available on this platform");
+    if (opts.controlChannel.empty())
+        return true;
+
+    _pipeName = ControlChannel::GetPipeName(opts.controlChannel.c_str());
+
+    HANDLE thread = CreateThread(
+        nullptr, 0, ServerMain, nullptr, 0, nullptr);
+    if (thread == nullptr)
+    {
+        Logging::Msg(
+            "Unable to start the control thread: 0x%08X", GetLastError());
+        return false;
+    }
+    CloseHandle(thread);
+
+    Logging::Msg("Control channel: %s", _pipeName.c_str());
+    return true;
+}
+
+#else
+
+static int _listenFd = -1;
+
+// The signal handler only wakes the control thread, detaching takes locks.
+static int _signalPipe[2] = { -1, -1 };
+
+static void OnControlSignal(int)
+{
+    const int savedErrno = errno;
+    const char toggle = 't';
+    // A full pipe already has a toggle pending.
+    [[maybe_unused]] const ssize_t res = write(_signalPipe[1], &toggle, 1);
+    errno = savedErrno;
+}
+
+// Abstract sockets have no file permissions, any process in the network
+// namespace can connect. Only processes of the same user are served, like
+// the shared memory segments which are created 0600.
+static bool IsSameUser(int fd)
+{
+    ucred cred{};
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+    {
+        Logging::Msg("Unable to query the control client: %d", errno);
+        return false;
+    }
+
+    if (cred.uid != geteuid())
+    {
+        Logging::Msg(
+            "Rejected control client %d of uid %u", (int)cred.pid,
+            (unsigned)cred.uid);
+        return false;
+    }
+
+    return true;
+}
+
+static void HandleClient(int fd)
+{
+    if (!IsSameUser(fd))
+    {
+        close(fd);
+        return;
+    }
+
+    char buf[ControlChannel::MaxLine]{};
+    size_t len = 0;
+    while (len < sizeof(buf) - 1)
+    {
+        const ssize_t res = recv(fd, buf + len, sizeof(buf) - 1 - len, 0);
+        if (res <= 0)
+            break;
+        len += static_cast<size_t>(res);
+        if (buf[len - 1] == '\n')
+            break;
+    }
+
+    if (len != 0)
+    {
+        const std::string reply = Control::Execute(buf) + "\n";
+        send(fd, reply.data(), reply.size(), MSG_NOSIGNAL);
+    }
+    close(fd);
+}
+
+static void* ServerMain(void*)
+{
+    pollfd fds[2] = {
+        { _listenFd, POLLIN, 0 },
+        { _signalPipe[0], POLLIN, 0 },
+    };
+
+    for (;;)
+    {
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            Logging::Msg("Control channel poll failed: %d", errno);
+            return nullptr;
+        }
+
+        if ((fds[1].revents & POLLIN) != 0)
+        {
+            char toggle;
+            while (read(_signalPipe[0], &toggle, 1) == 1)
+            {
+                Control::Execute(
+                    ExceptionHandler::IsDetached() ? "attach" : "detach");
+            }
+        }
+
+        if ((fds[0].revents & POLLIN) != 0)
+        {
+            const int fd = accept4(_listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd != -1)
+                HandleClient(fd);
+        }
+    }
+}
+
+static bool Listen(const char* name)
+{
+    _listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (_listenFd == -1)
+    {
+        Logging::Msg("Unable to create the control socket: %d", errno);
+        return false;
+    }
+
+    sockaddr_un addr;
+    const socklen_t addrLen = ControlChannel::GetAddress(name, addr);
+    if (bind(_listenFd, reinterpret_cast<sockaddr*>(&addr), addrLen) != 0
+        || listen(_listenFd, 4) != 0)
+    {
+        Logging::Msg("Unable to bind the control socket %s: %d", name, errno);
+        close(_listenFd);
+        _listenFd = -1;
+        return false;
+    }
+
+    return true;
+}
+
+static bool InstallSignal(int sig)
+{
+    if (pipe2(_signalPipe, O_CLOEXEC | O_NONBLOCK) != 0)
+    {
+        Logging::Msg("Unable to create the control pipe: %d", errno);
+        return false;
+    }
+
+    struct sigaction action = {};
+    action.sa_handler = OnControlSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(sig, &action, nullptr) != 0)
+    {
+        Logging::Msg("sigaction(%d) failed: %d", sig, errno);
+        return false;
+    }
+
+    return true;
+}
+
+bool Control::Initialize()
+{
+    const Config::Options& opts = Config::Get();
+    if (opts.controlChannel.empty() && opts.controlSignal == 0)
+        return true;
+
+    // Children of the fork server would all serve the same name, and the
+    // server must not have other threads.
+    if (opts.forkServer)
+    {
+        Logging::Msg("The control channel is not used with the fork server");
+        return false;
+    }
+
+    if (!opts.controlChannel.empty() && !Listen(opts.controlChannel.c_str()))
+        return false;
+
+    const int sig = static_cast<int>(opts.controlSignal);
+    if (sig != 0 && !InstallSignal(sig))
+        return false;
+
+    pthread_t thread;
+    if (pthread_create(&thread, nullptr, ServerMain, nullptr) != 0)
+    {
+        Logging::Msg("Unable to start the control thread");
+        return false;
+    }
+    pthread_detach(thread);
+
+    if (!opts.controlChannel.empty())
+        Logging::Msg("Control channel: %s", opts.controlChannel.c_str());
+    if (sig != 0)
+        Logging::Msg("Control signal: %d", sig);
+    return true;
+}
+
+#endif
+
+} // namespace CovCane
@@ -0,0 +1,374 @@
+#include "Coverage.h"
+#include "Config.h"
+#include "CoverageMap.h"
+#include "Logging.h"
+#include "Memory.h"
+#include "ThreadContext.h"
+#include "CovCane/SharedCoverage.h"
+
+#include <algorithm>
+#include <mutex>
+#include <string.h>
+#include <unordered_map>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace CovCane {
+
+static std::vector<Coverage::Module> _modules;
+static std::vector<Coverage::Block> _blocks;
+
+// Blocks translated again after their code was modified keep their id, found
+// by module and offset or by address outside of modules.
+static std::unordered_map<uint64_t, uint32_t> _blockIds;
+static uint64_t* _counters = nullptr;
+static uint8_t* _map = nullptr;
+static size_t _mapSize = 0;
+static std::mutex _lock;
+
+static void AtomicAdd(uint64_t* dst, uint64_t val)
+{
+#ifdef _MSC_VER
+    _InterlockedExchangeAdd64(reinterpret_cast<volatile int64_t*>(dst), val);
+#else
+    __atomic_fetch_add(dst, val, __ATOMIC_RELAXED);
+#endif
+}
+
+static uint32_t GetCounterCount()
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    return std::min(
+        static_cast<uint32_t>(_blocks.size()), Coverage::MaxBlocks);
+}
+
+bool Coverage::Initialize()
+{
+    _counters = static_cast<uint64_t*>(
+        Memory::AllocatePages(MaxBlocks * sizeof(uint64_t)));
+    if (_counters == nullptr)
+    {
+        Logging::Msg("Unable to allocate block counters");
+        return false;
+    }
+
+    const Config::Options& opts = Config::Get();
+    if (opts.coverageMap)
+    {
+        _map = static_cast<uint8_t*>(Memory::AllocatePages(
+            CoverageMap::GetAllocationSize(opts.mapSize)));
+        if (_map == nullptr)
+        {
+            Logging::Msg("Unable to allocate coverage map");
+            return false;
+        }
+        _mapSize = opts.mapSize;
+    }
+
+    return true;
+}
+
+uint32_t Coverage::RegisterModule(
+    uintptr_t base, uintptr_t end, const char* path)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+
+    for (auto& mod : _modules)
+    {
+        if (mod.base == base && mod.loaded)
+            return mod.id;
+    }
+
+    Module& mod = _modules.emplace_back();
+    mod.id = static_cast<uint32_t>(_modules.size() - 1);
+    mod.base = base;
+    mod.end = end;
+    mod.path = path != nullptr ? path : "";
+    mod.nameHash = SharedCoverage::HashModuleName(mod.path);
+    mod.loaded = true;
+
+    Logging::Msg(
+        "Module %u: %p - %p %s", mod.id, (void*)base, (void*)end,
+        mod.path.c_str());
+
+    return mod.id;
+}
+
+void Coverage::UnregisterModule(uintptr_t base)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+
+    for (auto& mod : _modules)
+    {
+        if (mod.base == base && mod.loaded)
+        {
+            mod.loaded = false;
+            Logging::Msg("Module %u unloaded", mod.id);
+        }
+    }
+}
+
+uint32_t Coverage::AddBlock(uintptr_t sourceVA, uint32_t sourceSize)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+
+    uint32_t moduleId = InvalidId;
+    uint64_t key = 0;
+    // User space addresses stay below bit 48, module offsets go above it.
+    uint64_t idKey = sourceVA;
+    for (auto& mod : _modules)
+    {
+        if (mod.loaded && sourceVA >= mod.base && sourceVA < mod.end)
+        {
+            moduleId = mod.id;
+            key = SharedCoverage::GetBlockKey(
+                mod.nameHash, sourceVA - mod.base);
+            idKey = (uint64_t(mod.id + 1) << 48) | (sourceVA - mod.base);
+            break;
+        }
+    }
+
+    auto it = _blockIds.find(idKey);
+    if (it != _blockIds.end())
+    {
+        Block& block = _blocks[it->second];
+        block.sourceSize = sourceSize;
+        block.targetVA = 0;
+        block.targetSize = 0;
+        return block.id;
+    }
+
+    Block& block = _blocks.emplace_back();
+    block.id = static_cast<uint32_t>(_blocks.size() - 1);
+    block.moduleId = moduleId;
+    block.sourceVA = sourceVA;
+    block.targetVA = 0;
+    block.sourceSize = sourceSize;
+    block.targetSize = 0;
+    block.key = key;
+
+    _blockIds.emplace(idKey, block.id);
+
+    return block.id;
+}
+
+void Coverage::CommitBlock(uint32_t id, uintptr_t targetVA, uint32_t targetSize)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+
+    if (id >= _blocks.size())
+        return;
+
+    Block& block = _blocks[id];
+    block.targetVA = targetVA;
+    block.targetSize = targetSize;
+}
+
+uint64_t Coverage::GetBlockKey(uint32_t id)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+
+    if (id >= _blocks.size())
+        return 0;
+    return _blocks[id].key;
+}
+
+bool Coverage::GetBlock(uint32_t id, Block& out)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+
+    if (id >= _blocks.size())
+        return false;
+    out = _blocks[id];
+    return true;
+}
+
+bool Coverage::GetModule(uint32_t id, Module& out)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+
+    if (id >= _modules.size())
+        return false;
+    out = _modules[id];
+    return true;
+}
+
+uint64_t* Coverage::GetCounter(uint32_t id)
+{
+    if (_counters == nullptr || id >= MaxBlocks)
+        return nullptr;
+    return &_counters[id];
+}
+
+uint64_t Coverage::GetHitCount(uint32_t id)
+{
+    const uint64_t* counter = GetCounter(id);
+    if (counter == nullptr)
+        return 0;
+
+    struct Sum
+    {
+        uint32_t id;
+        uint64_t hits;
+    } sum{ id, *reinterpret_cast<const volatile uint64_t*>(counter) };
+
+    ThreadContext::ForEach(
+        [](const ThreadContext::Context& ctx, void* user) {
+            auto* sum = static_cast<Sum*>(user);
+            if (ctx.counters != nullptr && sum->id < ctx.counterCount)
+                sum->hits += ctx.counters[sum->id];
+        },
+        &sum);
+
+    return sum.hits;
+}
+
+std::vector<uint64_t> Coverage::GetHitCounts()
+{
+    std::vector<uint64_t> res(GetCounterCount());
+    if (_counters == nullptr)
+        return res;
+
+    for (size_t i = 0; i < res.size(); i++)
+    {
+        res[i] = reinterpret_cast<const volatile uint64_t*>(_counters)[i];
+    }
+
+    ThreadContext::ForEach(
+        [](const ThreadContext::Context& ctx, void* user) {
+            auto& res = *static_cast<std::vector<uint64_t>*>(user);
+            if (ctx.counters == nullptr)
+                return;
+            const size_t count = std::min<size_t>(
+                res.size(), ctx.counterCount);
+            for (size_t i = 0; i < count; i++)
+            {
+                res[i] += ctx.counters[i];
+            }
+        },
+        &res);
+
+    return res;
+}
+
+void Coverage::FoldCounters(const uint64_t* counters, uint32_t count)
+{
+    if (_counters == nullptr)
+        return;
+
+    count = std::min(count, GetCounterCount());
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (counters[i] != 0)
+            AtomicAdd(&_counters[i], counters[i]);
+    }
+}
+
+uint8_t* Coverage::GetMap()
+{
+    return _map;
+}
+
+uint8_t* Coverage::GetThreadMap()
+{
+    ThreadContext::Context* ctx = ThreadContext::Current();
+    if (ctx != nullptr && ctx->map != nullptr)
+        return ctx->map;
+    return _map;
+}
+
+size_t Coverage::GetMapSize()
+{
+    return _mapSize;
+}
+
+uint32_t Coverage::GetStableId(uint32_t id)
+{
+    // Ids follow the discovery order, which differs between forked children
+    // and runs, the key does not.
+    const uint64_t key = GetBlockKey(id);
+    if (key == 0)
+        return id;
+    return static_cast<uint32_t>(key ^ (key >> 32));
+}
+
+uint32_t Coverage::GetMapIndex(uint32_t id)
+{
+    return static_cast<uint32_t>(GetStableId(id) & (_mapSize - 1));
+}
+
+bool Coverage::SnapshotMap(uint8_t* out, size_t len)
+{
+    if (_map == nullptr || len != _mapSize)
+        return false;
+
+    memcpy(out, _map, len);
+
+    struct Snapshot
+    {
+        uint8_t* out;
+        size_t len;
+        CoverageMap::MergeOp op;
+    } snapshot{ out, len, Config::Get().mapMerge };
+
+    ThreadContext::ForEach(
+        [](const ThreadContext::Context& ctx, void* user) {
+            auto* snapshot = static_cast<Snapshot*>(user);
+            if (ctx.map != nullptr)
+            {
+                CoverageMap::Merge(
+                    snapshot->out, ctx.map, snapshot->len, snapshot->op);
+            }
+        },
+        &snapshot);
+
+    return true;
+}
+
+void Coverage::FoldMap(const uint8_t* map)
+{
+    if (_map == nullptr)
+        return;
+
+    CoverageMap::MergeAllocation(_map, map, _mapSize, Config::Get().mapMerge);
+}
+
+void Coverage::ResetMap()
+{
+    if (_map == nullptr)
+        return;
+
+    CoverageMap::Reset(_map, _mapSize);
+
+    ThreadContext::ForEach(
+        [](const ThreadContext::Context& ctx, void*) {
+            if (ctx.map != nullptr)
+                CoverageMap::Reset(ctx.map, _mapSize);
+        },
+        nullptr);
+}
+
+std::vector<Coverage::Module> Coverage::GetModules()
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    return _modules;
+}
+
+std::vector<Coverage::Block> Coverage::GetBlocks()
+{
+    std::lock_guard<std::mutex> lock(_lock);
+
+    std::vector<Block> res;
+    res.reserve(_blocks.size());
+    for (auto& block : _blocks)
+    {
+        // Skip blocks that failed to translate.
+        if (block.targetVA == 0)
+            continue;
+        res.push_back(block);
+    }
+    return res;
+}
+
+} // namespace CovCane
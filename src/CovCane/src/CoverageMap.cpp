@@ -0,0 +1,281 @@
+#include "CoverageMap.h"
+
+#include <string.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define COVCANE_TARGET_AVX2
+#else
+#include <cpuid.h>
+#define COVCANE_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+namespace CovCane {
+
+static bool DetectAvx2()
+{
+#ifdef _MSC_VER
+    int regs[4]{};
+    __cpuid(regs, 0);
+    if (regs[0] < 7)
+        return false;
+
+    __cpuid(regs, 1);
+    const bool osxsave = (regs[2] & (1 << 27)) != 0;
+    const bool avx = (regs[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx)
+        return false;
+
+    // The OS has to save the upper halves of the ymm registers.
+    if ((_xgetbv(0) & 0x6) != 0x6)
+        return false;
+
+    __cpuidex(regs, 7, 0);
+    return (regs[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+bool CoverageMap::HasAvx2()
+{
+    static const bool hasAvx2 = DetectAvx2();
+    return hasAvx2;
+}
+
+void CoverageMap::MarkDirty(uint8_t* map, size_t mapSize, size_t index)
+{
+    map[GetLineFlagsOffset(mapSize) + index / LineSize] = 1;
+    map[GetPageFlagsOffset(mapSize) + index / PageSize] = 1;
+}
+
+// Maps a hit count to one bit per bucket: 1, 2, 3, 4-7, 8-15, 16-31, 32-127
+// and 128+, small changes in loop counts then do not count as new coverage.
+static uint8_t ClassifyHits(uint8_t hits)
+{
+    if (hits == 0)
+        return 0;
+    if (hits <= 3)
+        return uint8_t(1 << (hits - 1));
+    if (hits <= 7)
+        return 1 << 3;
+    if (hits <= 15)
+        return 1 << 4;
+    if (hits <= 31)
+        return 1 << 5;
+    if (hits <= 127)
+        return 1 << 6;
+    return 1 << 7;
+}
+
+static size_t CollectLine(uint8_t* line, uint8_t* virgin)
+{
+    size_t found = 0;
+    for (size_t i = 0; i < CoverageMap::LineSize; i++)
+    {
+        const uint8_t bucket = ClassifyHits(line[i]);
+        if ((virgin[i] & bucket) != bucket)
+        {
+            virgin[i] |= bucket;
+            found++;
+        }
+    }
+    return found;
+}
+
+template<typename F>
+static void ForEachDirtyLine(uint8_t* map, size_t mapSize, F&& fn)
+{
+    constexpr size_t LinesPerPage = CoverageMap::PageSize
+                                    / CoverageMap::LineSize;
+
+    uint8_t* lineFlags = map + CoverageMap::GetLineFlagsOffset(mapSize);
+    uint8_t* pageFlags = map + CoverageMap::GetPageFlagsOffset(mapSize);
+
+    auto visitPage = [&](size_t page) {
+        pageFlags[page] = 0;
+
+        uint8_t* lines = lineFlags + page * LinesPerPage;
+        for (size_t line = 0; line < LinesPerPage; line++)
+        {
+            if (lines[line] == 0)
+                continue;
+            lines[line] = 0;
+
+            fn((page * LinesPerPage + line) * CoverageMap::LineSize);
+        }
+    };
+
+    const size_t pageCount = mapSize / CoverageMap::PageSize;
+
+    size_t page = 0;
+    for (; page + sizeof(uint64_t) <= pageCount; page += sizeof(uint64_t))
+    {
+        // Skip eight clean pages at once.
+        uint64_t pages;
+        memcpy(&pages, pageFlags + page, sizeof(pages));
+        if (pages == 0)
+            continue;
+
+        for (size_t i = page; i < page + sizeof(uint64_t); i++)
+        {
+            if (pageFlags[i] != 0)
+                visitPage(i);
+        }
+    }
+
+    for (; page < pageCount; page++)
+    {
+        if (pageFlags[page] != 0)
+            visitPage(page);
+    }
+}
+
+void CoverageMap::Reset(uint8_t* map, size_t mapSize)
+{
+    ForEachDirtyLine(map, mapSize, [map](size_t offset) {
+        memset(map + offset, 0, LineSize);
+    });
+}
+
+size_t CoverageMap::Collect(uint8_t* map, size_t mapSize, uint8_t* virgin)
+{
+    size_t found = 0;
+    ForEachDirtyLine(map, mapSize, [&](size_t offset) {
+        found += CollectLine(map + offset, virgin + offset);
+        memset(map + offset, 0, LineSize);
+    });
+    return found;
+}
+
+void CoverageMap::Merge(
+    uint8_t* dst, const uint8_t* src, size_t len, MergeOp op)
+{
+    if (HasAvx2())
+        MergeAvx2(dst, src, len, op);
+    else
+        MergeScalar(dst, src, len, op);
+}
+
+static uint64_t SaturatingAdd8x8(uint64_t a, uint64_t b)
+{
+    constexpr uint64_t Low = 0x7F7F7F7F7F7F7F7Full;
+    constexpr uint64_t High = 0x8080808080808080ull;
+
+    // Add the low 7 bits and fix up the top bit without crossing bytes.
+    const uint64_t sum = ((a & Low) + (b & Low)) ^ ((a ^ b) & High);
+
+    // Carry out of bit 7 marks the bytes that have to be clamped.
+    const uint64_t carry = ((a & b) | ((a | b) & ~sum)) & High;
+    return sum | ((carry >> 7) * 0xFF);
+}
+
+void CoverageMap::MergeScalar(
+    uint8_t* dst, const uint8_t* src, size_t len, MergeOp op)
+{
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
+    {
+        uint64_t s;
+        memcpy(&s, src + i, sizeof(s));
+
+        // Maps are mostly empty, skip without touching dst.
+        if (s == 0)
+            continue;
+
+        uint64_t d;
+        memcpy(&d, dst + i, sizeof(d));
+
+        if (op == MergeOp::Or)
+            d |= s;
+        else
+            d = SaturatingAdd8x8(d, s);
+
+        memcpy(dst + i, &d, sizeof(d));
+    }
+
+    for (; i < len; i++)
+    {
+        if (op == MergeOp::Or)
+        {
+            dst[i] |= src[i];
+        }
+        else
+        {
+            const unsigned sum = unsigned(dst[i]) + src[i];
+            dst[i] = sum > 0xFF ? 0xFF : uint8_t(sum);
+        }
+    }
+}
+
+void CoverageMap::MergeAllocation(
+    uint8_t* dst, const uint8_t* src, size_t mapSize, MergeOp op)
+{
+    Merge(dst, src, mapSize, op);
+
+    // Flags only need to be combined.
+    const size_t flagsOffset = GetLineFlagsOffset(mapSize);
+    Merge(
+        dst + flagsOffset, src + flagsOffset,
+        GetAllocationSize(mapSize) - flagsOffset, MergeOp::Or);
+}
+
+template<CoverageMap::MergeOp Op>
+COVCANE_TARGET_AVX2 static __m256i Combine(__m256i a, __m256i b)
+{
+    if constexpr (Op == CoverageMap::MergeOp::Or)
+        return _mm256_or_si256(a, b);
+    else
+        return _mm256_adds_epu8(a, b);
+}
+
+template<CoverageMap::MergeOp Op>
+COVCANE_TARGET_AVX2 static size_t MergeAvx2Impl(
+    uint8_t* dst, const uint8_t* src, size_t len)
+{
+    constexpr size_t Stride = 4 * sizeof(__m256i);
+
+    size_t i = 0;
+    for (; i + Stride <= len; i += Stride)
+    {
+        const auto* s = reinterpret_cast<const __m256i*>(src + i);
+        auto* d = reinterpret_cast<__m256i*>(dst + i);
+
+        const __m256i s0 = _mm256_loadu_si256(s + 0);
+        const __m256i s1 = _mm256_loadu_si256(s + 1);
+        const __m256i s2 = _mm256_loadu_si256(s + 2);
+        const __m256i s3 = _mm256_loadu_si256(s + 3);
+
+        // Skip the whole stride if src is empty, keeps dst clean in cache.
+        const __m256i any = _mm256_or_si256(
+            _mm256_or_si256(s0, s1), _mm256_or_si256(s2, s3));
+        if (_mm256_testz_si256(any, any))
+            continue;
+
+        _mm256_storeu_si256(
+            d + 0, Combine<Op>(_mm256_loadu_si256(d + 0), s0));
+        _mm256_storeu_si256(
+            d + 1, Combine<Op>(_mm256_loadu_si256(d + 1), s1));
+        _mm256_storeu_si256(
+            d + 2, Combine<Op>(_mm256_loadu_si256(d + 2), s2));
+        _mm256_storeu_si256(
+            d + 3, Combine<Op>(_mm256_loadu_si256(d + 3), s3));
+    }
+
+    return i;
+}
+
+void CoverageMap::MergeAvx2(
+    uint8_t* dst, const uint8_t* src, size_t len, MergeOp op)
+{
+    size_t done;
+    if (op == MergeOp::Or)
+        done = MergeAvx2Impl<MergeOp::Or>(dst, src, len);
+    else
+        done = MergeAvx2Impl<MergeOp::SaturatingAdd>(dst, src, len);
+
+    // Tail that does not fill a full stride.
+    MergeScalar(dst + done, src + done, len - done, op);
+}
+
+} // namespace CovCane
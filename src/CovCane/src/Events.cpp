@@ -0,0 +1,97 @@
+#include "Events.h"
+#include "Config.h"
+#include "Coverage.h"
+#include "Logging.h"
+#include "CovCane/EventQueue.h"
+
+#include <vector>
+
+namespace CovCane {
+
+static EventQueue::Queue _queue;
+
+struct QueueModule
+{
+    bool known = false;
+    uint32_t index = EventQueue::NoModule;
+    uintptr_t base = 0;
+};
+
+// Indexed by the coverage module id.
+static std::vector<QueueModule> _modules;
+
+bool Events::Initialize()
+{
+    const Config::Options& opts = Config::Get();
+    if (opts.eventQueue.empty())
+        return true;
+
+    const uint32_t capacity = static_cast<uint32_t>(opts.eventQueueSize);
+    if (!_queue.Create(opts.eventQueue.c_str(), capacity))
+    {
+        Logging::Msg(
+            "Unable to create event queue: %s", opts.eventQueue.c_str());
+        return false;
+    }
+
+    Logging::Msg(
+        "Created event queue %s, %u events", opts.eventQueue.c_str(),
+        capacity);
+
+    return true;
+}
+
+bool Events::IsEnabled()
+{
+    return _queue.IsOpen();
+}
+
+static const QueueModule& GetModule(uint32_t moduleId)
+{
+    if (moduleId >= _modules.size())
+        _modules.resize(moduleId + 1);
+
+    QueueModule& entry = _modules[moduleId];
+    if (entry.known)
+        return entry;
+
+    // Once the table is full later modules stay NoModule.
+    Coverage::Module mod;
+    if (Coverage::GetModule(moduleId, mod))
+    {
+        entry.index = _queue.AddModule(mod.base, mod.end - mod.base, mod.path);
+        entry.base = mod.base;
+    }
+    entry.known = true;
+    return entry;
+}
+
+void Events::AddBlock(uint32_t blockId, bool sharedNew)
+{
+    if (!_queue.IsOpen())
+        return;
+
+    Coverage::Block block;
+    if (!Coverage::GetBlock(blockId, block))
+        return;
+
+    EventQueue::Event event;
+    event.module = EventQueue::NoModule;
+    event.flags = sharedNew ? uint32_t(EventQueue::NewInSharedMap)
+                            : uint32_t(0);
+    event.offset = block.sourceVA;
+
+    if (block.moduleId != Coverage::InvalidId)
+    {
+        const QueueModule& mod = GetModule(block.moduleId);
+        if (mod.index != EventQueue::NoModule)
+        {
+            event.module = mod.index;
+            event.offset = block.sourceVA - mod.base;
+        }
+    }
+
+    _queue.Push(event);
+}
+
+} // namespace CovCane
@@ -1,26 +1,387 @@
 #include "ExceptionHandler.h"
+#include "Config.h"
 #include "Memory.h"
 #include "Logging.h"
 #include "Rewriter.h"
+#include "Coverage.h"
+#include "InstructionCoverage.h"
+#include "PageMap.h"
+#include "ModuleFilter.h"
+#include "Platform.h"
+#include "Regions.h"
 
+#include <algorithm>
+#include <atomic>
+#include <iterator>
 #include <map>
-#include <windows.h>
 #include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <dlfcn.h>
+#include <errno.h>
+#include <link.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 namespace CovCane {
 
-static std::vector<std::pair<uintptr_t, uintptr_t>> _sectionMap;
+constexpr uintptr_t PageSize = 0x1000;
+
+// Pages of every section that had its execute rights removed.
+static PageMap _sectionMap;
+
+// Base and end of every module that was considered, instrumented or not.
+static std::map<uintptr_t, uintptr_t> _seenModules;
+static std::mutex _modulesLock;
+
+// Modules are only protected once the handler can take their faults.
+static bool _installed = false;
+
+struct ProtectedRange
+{
+    uintptr_t start;
+    uintptr_t end;
+    // Protection before execute rights were removed.
+    uint32_t protection;
+};
+
+// Every range that lost its execute rights, restored while detached.
+static std::vector<ProtectedRange> _protected;
+static bool _detached = false;
+
+// Protected pages that currently take writes instead of being read-only,
+// they are sealed again before their code is translated.
+static std::set<uintptr_t> _writablePages;
+
+// Protection the program asked for on protected pages, it takes the place
+// of the original protection.
+static std::map<uintptr_t, uint32_t> _requestedProtection;
+
+// Set once any protected page was made writable, only then are the pages of
+// a block checked before it is translated.
+static std::atomic<bool> _codeWritable{ false };
+
+// Set once executable memory outside of modules was protected.
+static std::atomic<bool> _codeRegions{ false };
+
+// Implemented per platform below.
+static uint32_t QueryProtection(uintptr_t va);
+static bool SetProtection(uintptr_t startVA, uintptr_t endVA, uint32_t prot);
+static uint32_t ReadOnlyProtection();
+static uint32_t StripExecute(uint32_t protection);
+static bool IsWritable(uint32_t protection);
+using ModuleRange = std::pair<uintptr_t, uintptr_t>;
+static void CollectLoadedModules(std::set<ModuleRange>& modules);
 
 static bool AddressInSectionMap(uintptr_t addr)
 {
-    for (auto& pair : _sectionMap)
+    return _sectionMap.Contains(addr);
+}
+
+static bool SetExecutable(const ProtectedRange& range, bool executable)
+{
+    return SetProtection(
+        range.start, range.end,
+        executable ? range.protection : ReadOnlyProtection());
+}
+
+// The caller holds the modules lock.
+static const ProtectedRange* FindRange(uintptr_t va)
+{
+    for (auto& range : _protected)
+    {
+        if (va >= range.start && va < range.end)
+            return &range;
+    }
+    return nullptr;
+}
+
+static bool MarkSeen(uintptr_t base, uintptr_t end)
+{
+    std::lock_guard<std::mutex> lock(_modulesLock);
+    return _seenModules.emplace(base, end).second;
+}
+
+// Drops everything known about an unloaded module, a module mapped at the
+// same address later is treated as new. A module that stays mapped gets the
+// protection of its pages back, code still running in it continues natively.
+static size_t ForgetModule(uintptr_t base, uintptr_t end, bool mapped)
+{
+    size_t ranges = 0;
+    {
+        std::lock_guard<std::mutex> lock(_modulesLock);
+        auto seen = _seenModules.find(base);
+        if (seen == _seenModules.end())
+            return 0;
+
+        // A native module that stays loaded is still known as such.
+        const auto inside = [&](const ProtectedRange& range) {
+            return range.start >= base && range.end <= end;
+        };
+        if (mapped
+            && std::none_of(_protected.begin(), _protected.end(), inside))
+        {
+            return 0;
+        }
+        _seenModules.erase(seen);
+
+        auto it = std::remove_if(
+            _protected.begin(), _protected.end(),
+            [&](const ProtectedRange& range) {
+                if (!inside(range))
+                    return false;
+                _sectionMap.Remove(range.start, range.end);
+                if (mapped && !_detached)
+                    SetExecutable(range, true);
+                return true;
+            });
+        ranges = static_cast<size_t>(std::distance(it, _protected.end()));
+        _protected.erase(it, _protected.end());
+
+        auto first = _requestedProtection.lower_bound(base);
+        auto last = _requestedProtection.lower_bound(end);
+        if (mapped && !_detached)
+        {
+            for (auto page = first; page != last; ++page)
+            {
+                SetProtection(
+                    page->first, page->first + PageSize, page->second);
+            }
+        }
+        _requestedProtection.erase(first, last);
+        _writablePages.erase(
+            _writablePages.lower_bound(base), _writablePages.lower_bound(end));
+    }
+
+    // Native modules have nothing translated.
+    if (ranges == 0)
+        return 0;
+
+    Rewriter::RemoveModule(base, end);
+    if (!mapped)
+        Coverage::UnregisterModule(base);
+
+    return ranges;
+}
+
+void ExceptionHandler::RemoveUnloadedModules()
+{
+    // Queried outside the lock, the loader takes it under its own.
+    std::vector<ModuleRange> seen;
+    {
+        std::lock_guard<std::mutex> lock(_modulesLock);
+        seen.assign(_seenModules.begin(), _seenModules.end());
+    }
+
+    // The extent tells apart a different module mapped at the same base in
+    // the meantime.
+    std::set<ModuleRange> loaded;
+    CollectLoadedModules(loaded);
+
+    for (auto& mod : seen)
+    {
+        if (loaded.count(mod) == 0)
+            ForgetModule(mod.first, mod.second, false);
+    }
+}
+
+// Removes execute rights from [startVA, endVA) and sends its faults to the
+// rewriter, the caller holds the modules lock. A writable range may start
+// out writable, its pages are sealed once their code runs.
+static bool ProtectRangeLocked(
+    uintptr_t startVA, uintptr_t endVA, uint32_t protection, bool writable)
+{
+    // Modules are not scanned while detached, the check is repeated under
+    // the lock for scans that were already running.
+    const ProtectedRange range{ startVA, endVA, protection };
+    if (!_detached)
+    {
+        if (!writable && !SetExecutable(range, false))
+            return false;
+        if (writable
+            && !SetProtection(startVA, endVA, StripExecute(protection)))
+        {
+            return false;
+        }
+    }
+
+    if (writable && !_detached)
+    {
+        for (uintptr_t page = startVA; page < endVA; page += PageSize)
+            _writablePages.insert(page);
+        _codeWritable = true;
+    }
+
+    _protected.push_back(range);
+    _sectionMap.Add(startVA, endVA);
+
+    // Sections of modules use the cache reserved for the whole module,
+    // generated code shares one cache that grows with it.
+    Rewriter::ShareCodeCache(startVA, endVA);
+    return true;
+}
+
+// Code of a module that will be translated, the selected regions narrow it
+// down.
+static size_t TranslatedSize(
+    size_t codeSize, const std::vector<Regions::Range>& regions)
+{
+    if (!Regions::IsEnabled())
+        return codeSize;
+
+    size_t selected = 0;
+    for (auto& range : regions)
+        selected += range.end - range.start;
+    return std::min(codeSize, selected);
+}
+
+static bool ProtectRange(uintptr_t startVA, uintptr_t endVA)
+{
+    std::lock_guard<std::mutex> lock(_modulesLock);
+    return ProtectRangeLocked(
+        startVA, endVA, QueryProtection(startVA), false);
+}
+
+// Lets a write to protected code through by making its page writable, the
+// translations of the page are discarded. Writes fault as they would
+// natively unless the program may write to the page.
+static bool HandleCodeWrite(uintptr_t va)
+{
+    const uintptr_t page = va & ~(PageSize - 1);
+
+    std::lock_guard<std::mutex> lock(_modulesLock);
+    if (_detached)
+        return false;
+
+    // Another thread was faster.
+    if (_writablePages.count(page) != 0)
+        return true;
+
+    const ProtectedRange* range = FindRange(page);
+    if (range == nullptr)
+        return false;
+
+    auto it = _requestedProtection.find(page);
+    const uint32_t protection = it != _requestedProtection.end()
+                                    ? it->second
+                                    : range->protection;
+    if (!IsWritable(protection)
+        || !SetProtection(page, page + PageSize, StripExecute(protection)))
+    {
+        return false;
+    }
+
+    _writablePages.insert(page);
+    _codeWritable = true;
+
+    Rewriter::Invalidate(page, page + PageSize);
+    return true;
+}
+
+// Makes the writable pages of [startVA, endVA) read-only again and discards
+// their translations, returns whether there were any.
+static bool SealPages(uintptr_t startVA, uintptr_t endVA)
+{
+    std::lock_guard<std::mutex> lock(_modulesLock);
+
+    bool sealed = false;
+    auto it = _writablePages.lower_bound(startVA & ~(PageSize - 1));
+    while (it != _writablePages.end() && *it < endVA)
+    {
+        const uintptr_t page = *it;
+        SetProtection(page, page + PageSize, ReadOnlyProtection());
+        it = _writablePages.erase(it);
+
+        // Under the lock, no thread may pick up a stale translation after
+        // the page is sealed.
+        Rewriter::Invalidate(page, page + PageSize);
+        sealed = true;
+    }
+    return sealed;
+}
+
+// Translates the block at va. Once code was written to, the pages the block
+// covers are sealed first so that the next write faults again.
+static uintptr_t TranslateBlock(uintptr_t va)
+{
+    if (!_codeWritable)
+        return Rewriter::ProcessBranch(va);
+
+    SealPages(va, va + 1);
+    for (;;)
+    {
+        // A block reaching into a page that was still writable may have
+        // been decoded before a write, it is translated again.
+        const uintptr_t target = Rewriter::ProcessBranch(va);
+        if (target == 0 || !SealPages(va, Rewriter::GetSourceEnd(va)))
+            return target;
+    }
+}
+
+bool ExceptionHandler::Detach()
+{
+    std::lock_guard<std::mutex> lock(_modulesLock);
+    if (_detached)
+        return true;
+
+    bool res = true;
+    for (auto& range : _protected)
+    {
+        if (!SetExecutable(range, true))
+            res = false;
+    }
+    for (auto& [page, protection] : _requestedProtection)
+    {
+        if (!SetProtection(page, page + PageSize, protection))
+            res = false;
+    }
+    _writablePages.clear();
+    _detached = true;
+
+    Logging::Msg("Detached, restored %zu ranges", _protected.size());
+    return res;
+}
+
+bool ExceptionHandler::Reattach()
+{
     {
-        if (addr >= pair.first && addr < pair.second)
+        std::lock_guard<std::mutex> lock(_modulesLock);
+        if (!_detached)
             return true;
+
+        for (auto& range : _protected)
+        {
+            // Pages that stay executable simply run natively.
+            SetExecutable(range, false);
+        }
+        _detached = false;
+
+        Logging::Msg("Reattached, protected %zu ranges", _protected.size());
     }
-    return false;
+
+    // Picks up the modules loaded in between, outside the lock since the
+    // loader notifies under its own lock.
+    ScanModules();
+    return true;
 }
 
+bool ExceptionHandler::IsDetached()
+{
+    std::lock_guard<std::mutex> lock(_modulesLock);
+    return _detached;
+}
+
+#ifdef _WIN32
+
 static LONG Handler(struct _EXCEPTION_POINTERS* ExceptionInfo)
 {
     if constexpr (false)
@@ -36,11 +397,22 @@ static LONG Handler(struct _EXCEPTION_POINTERS* ExceptionInfo)
 
     const uint32_t exceptionCode = ExceptionInfo->ExceptionRecord
                                        ->ExceptionCode;
+
+    // The write is repeated once the page is writable.
+    if (exceptionCode == EXCEPTION_ACCESS_VIOLATION
+        && ExceptionInfo->ExceptionRecord->ExceptionInformation[0] == 1)
+    {
+        const uintptr_t writeAddress = static_cast<uintptr_t>(
+            ExceptionInfo->ExceptionRecord->ExceptionInformation[1]);
+        if (AddressInSectionMap(writeAddress) && HandleCodeWrite(writeAddress))
+            return EXCEPTION_CONTINUE_EXECUTION;
+    }
+
     if (exceptionCode == EXCEPTION_ACCESS_VIOLATION
         && ExceptionInfo->ExceptionRecord->ExceptionInformation[0] == 8
         && AddressInSectionMap(exceptionAddress))
     {
-        uintptr_t newIP = Rewriter::ProcessBranch(exceptionAddress);
+        uintptr_t newIP = TranslateBlock(exceptionAddress);
         if (newIP != 0)
         {
 #if _M_X64
@@ -53,6 +425,10 @@ static LONG Handler(struct _EXCEPTION_POINTERS* ExceptionInfo)
     }
     else
     {
+        // Faults inside translated code end the block early.
+        if (InstructionCoverage::IsEnabled())
+            InstructionCoverage::RecordExit(exceptionAddress);
+
         if constexpr (true)
         {
             Logging::Msg(
@@ -65,6 +441,58 @@ static LONG Handler(struct _EXCEPTION_POINTERS* ExceptionInfo)
     return EXCEPTION_CONTINUE_SEARCH;
 }
 
+static uint32_t QueryProtection(uintptr_t va)
+{
+    MEMORY_BASIC_INFORMATION info{};
+    if (VirtualQuery(reinterpret_cast<LPCVOID>(va), &info, sizeof(info)) == 0)
+        return PAGE_EXECUTE_READ;
+    return info.Protect;
+}
+
+static bool SetProtection(uintptr_t startVA, uintptr_t endVA, uint32_t prot)
+{
+    DWORD oldProt;
+    if (VirtualProtect(
+            reinterpret_cast<LPVOID>(startVA), endVA - startVA, prot, &oldProt)
+        == FALSE)
+    {
+        Logging::Msg(
+            "VirtualProtect(%p) failed: 0x%08X", (void*)startVA,
+            GetLastError());
+        return false;
+    }
+    return true;
+}
+
+static uint32_t ReadOnlyProtection()
+{
+    return PAGE_READONLY;
+}
+
+static uint32_t StripExecute(uint32_t protection)
+{
+    const uint32_t modifiers = protection & ~0xFFu;
+    switch (protection & 0xFF)
+    {
+        case PAGE_EXECUTE:
+        case PAGE_EXECUTE_READ:
+            return modifiers | PAGE_READONLY;
+        case PAGE_EXECUTE_READWRITE:
+            return modifiers | PAGE_READWRITE;
+        case PAGE_EXECUTE_WRITECOPY:
+            return modifiers | PAGE_WRITECOPY;
+    }
+    return protection;
+}
+
+static bool IsWritable(uint32_t protection)
+{
+    return (protection
+            & (PAGE_READWRITE | PAGE_WRITECOPY | PAGE_EXECUTE_READWRITE
+               | PAGE_EXECUTE_WRITECOPY))
+           != 0;
+}
+
 static bool RemoveExecutableRights(HMODULE mod)
 {
     const uintptr_t imageBase = reinterpret_cast<uintptr_t>(mod);
@@ -85,6 +513,26 @@ static bool RemoveExecutableRights(HMODULE mod)
         return false;
     }
 
+    char modulePath[MAX_PATH]{};
+    GetModuleFileNameA(mod, modulePath, sizeof(modulePath));
+
+    const uintptr_t imageEnd = imageBase + ntHdr.OptionalHeader.SizeOfImage;
+
+    std::vector<Regions::Range> regions;
+    if (Regions::IsEnabled())
+    {
+        regions = Regions::Resolve(modulePath, imageBase, imageEnd);
+        if (regions.empty())
+            return true;
+    }
+
+    Coverage::RegisterModule(imageBase, imageEnd, modulePath);
+
+    // One reservation holds the translations of every section.
+    Rewriter::ReserveCodeCache(
+        imageBase, imageEnd,
+        TranslatedSize(ntHdr.OptionalHeader.SizeOfCode, regions));
+
     uintptr_t sectionAddress = imageBase + dosHdr.e_lfanew
                                + sizeof(IMAGE_NT_HEADERS);
     for (int i = 0; i < ntHdr.FileHeader.NumberOfSections; i++)
@@ -111,41 +559,791 @@ static bool RemoveExecutableRights(HMODULE mod)
                 "Section: %s, %p - %p", sectionName, (void*)sectionVA,
                 (void*)sectionEndVA);
 
-            const uintptr_t sectionLength = sectionEndVA - sectionVA;
-
-            DWORD oldProt;
-            if (VirtualProtect(
-                    reinterpret_cast<LPVOID>(sectionVA), sectionLength,
-                    PAGE_READONLY, &oldProt)
-                == FALSE)
+            for (auto& pages :
+                 Regions::SelectPages(regions, sectionVA, sectionEndVA))
             {
-                Logging::Msg(
-                    "VirtualProtect(%p) failed: 0x%08X", (void*)sectionVA,
-                    GetLastError());
+                if (ProtectRange(pages.start, pages.end))
+                {
+                    Logging::Msg(
+                        "Removed execute from %s, %p - %p", sectionName,
+                        (void*)pages.start, (void*)pages.end);
+                }
             }
+        }
+
+        sectionAddress += sizeof(IMAGE_SECTION_HEADER);
+    }
+
+    return true;
+}
+
+static void ProcessModule(HMODULE mod)
+{
+    // Seen again by the scan on re-attach.
+    if (ExceptionHandler::IsDetached())
+        return;
+
+    MODULEINFO info{};
+    if (!GetModuleInformation(GetCurrentProcess(), mod, &info, sizeof(info)))
+        return;
+
+    const uintptr_t base = reinterpret_cast<uintptr_t>(mod);
+    if (!MarkSeen(base, base + info.SizeOfImage))
+        return;
+
+    // The runtime has to keep running natively to handle the faults.
+    HMODULE runtimeModule = nullptr;
+    GetModuleHandleExA(
+        GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS
+            | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+        reinterpret_cast<LPCSTR>(&Handler), &runtimeModule);
+    if (mod == runtimeModule)
+        return;
+
+    char modulePath[MAX_PATH]{};
+    GetModuleFileNameA(mod, modulePath, sizeof(modulePath));
+
+    const bool mainModule = mod == GetModuleHandleA(nullptr);
+    if (!ModuleFilter::IsIncluded(modulePath, mainModule))
+    {
+        Logging::Msg("Native module: %s", modulePath);
+        return;
+    }
+
+    RemoveExecutableRights(mod);
+}
+
+// Not part of the SDK headers, see LdrRegisterDllNotification.
+struct LdrDllNotificationData
+{
+    ULONG flags;
+    const void* fullDllName;
+    const void* baseDllName;
+    PVOID dllBase;
+    ULONG sizeOfImage;
+};
+
+using LdrDllNotificationFunction = VOID(CALLBACK*)(
+    ULONG, const LdrDllNotificationData*, PVOID);
+using LdrRegisterDllNotificationFn = LONG(NTAPI*)(
+    ULONG, LdrDllNotificationFunction, PVOID, PVOID*);
+
+constexpr ULONG LdrDllNotificationReasonLoaded = 1;
+constexpr ULONG LdrDllNotificationReasonUnloaded = 2;
+
+static VOID CALLBACK OnDllNotification(
+    ULONG reason, const LdrDllNotificationData* data, PVOID)
+{
+    // Runs under the loader lock before the entry point of the module, so
+    // its initialization is already translated.
+    if (reason == LdrDllNotificationReasonLoaded)
+        ProcessModule(static_cast<HMODULE>(data->dllBase));
+
+    // Sent before the image is unmapped, no other thread may run its code
+    // any more.
+    if (reason == LdrDllNotificationReasonUnloaded)
+    {
+        const uintptr_t base = reinterpret_cast<uintptr_t>(data->dllBase);
+        ForgetModule(base, base + data->sizeOfImage, false);
+    }
+}
+
+static bool RegisterDllNotification()
+{
+    auto registerFn = reinterpret_cast<LdrRegisterDllNotificationFn>(
+        GetProcAddress(
+            GetModuleHandleA("ntdll.dll"), "LdrRegisterDllNotification"));
+    if (registerFn == nullptr)
+        return false;
+
+    PVOID cookie = nullptr;
+    return registerFn(0, OnDllNotification, nullptr, &cookie) == 0;
+}
+
+static bool EnumerateModules(std::vector<HMODULE>& modules)
+{
+    modules.resize(256);
+    DWORD needed = 0;
+    for (;;)
+    {
+        const DWORD size = static_cast<DWORD>(modules.size() * sizeof(HMODULE));
+        if (!EnumProcessModules(
+                GetCurrentProcess(), modules.data(), size, &needed))
+        {
+            Logging::Msg("EnumProcessModules failed: 0x%08X", GetLastError());
+            return false;
+        }
+        if (needed <= size)
+            break;
+        modules.resize(needed / sizeof(HMODULE));
+    }
+    modules.resize(needed / sizeof(HMODULE));
+    return true;
+}
+
+static void CollectLoadedModules(std::set<ModuleRange>& loaded)
+{
+    std::vector<HMODULE> modules;
+    EnumerateModules(modules);
+    for (HMODULE mod : modules)
+    {
+        MODULEINFO info{};
+        if (!GetModuleInformation(
+                GetCurrentProcess(), mod, &info, sizeof(info)))
+        {
+            continue;
+        }
+
+        const uintptr_t base = reinterpret_cast<uintptr_t>(mod);
+        loaded.emplace(base, base + info.SizeOfImage);
+    }
+}
+
+void ExceptionHandler::ScanModules()
+{
+    // Modules loaded while detached are picked up on re-attach.
+    if (!_installed || IsDetached())
+        return;
+
+    std::vector<HMODULE> modules;
+    if (!EnumerateModules(modules))
+        return;
+
+    for (HMODULE mod : modules)
+    {
+        ProcessModule(mod);
+    }
+}
+
+bool ExceptionHandler::Initialize()
+{
+    AddVectoredExceptionHandler(1, Handler);
+    _installed = true;
+
+    // Registered first so nothing loaded during the scan is missed, modules
+    // seen twice are skipped.
+    if (!RegisterDllNotification())
+        Logging::Msg("Unable to register for DLL load notifications");
+
+    ScanModules();
+
+    return true;
+}
+
+#else
+
+// The runtime exports sigaction to keep its handler in front of the
+// program's, its own calls go to the C library.
+static int RealSigaction(
+    int sig, const struct sigaction* act, struct sigaction* oldact)
+{
+    using Sigaction = int (*)(int, const struct sigaction*, struct sigaction*);
+    static const auto next = reinterpret_cast<Sigaction>(
+        dlsym(RTLD_NEXT, "sigaction"));
+    return next(sig, act, oldact);
+}
+
+// Faults the runtime handles itself or that end a translated block early,
+// the program's handlers of these are chained behind the runtime's.
+static constexpr int ChainedSignals[] = {
+    SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGTRAP,
+};
+
+// Handler that signals not taken by the runtime are passed on to. Two slots
+// so the signal handler never reads one that is being written.
+struct ChainedAction
+{
+    struct sigaction previous[2];
+    std::atomic<int> slot{ 0 };
+    bool installed = false;
+};
+
+static ChainedAction _chained[std::size(ChainedSignals)];
+static std::mutex _signalLock;
+
+static ChainedAction* FindChained(int sig)
+{
+    for (size_t i = 0; i < std::size(ChainedSignals); i++)
+    {
+        if (ChainedSignals[i] == sig)
+            return &_chained[i];
+    }
+    return nullptr;
+}
+
+static void ForwardSignal(int sig, siginfo_t* info, void* ucontext)
+{
+    ChainedAction& chained = *FindChained(sig);
+    const int slot = chained.slot.load(std::memory_order_acquire);
+    const struct sigaction previous = chained.previous[slot];
+
+    // The handler of the program runs once, as the kernel would have reset
+    // it. No lock is taken inside the signal handler.
+    if ((previous.sa_flags & SA_RESETHAND) != 0)
+    {
+        chained.previous[slot ^ 1] = {};
+        chained.previous[slot ^ 1].sa_handler = SIG_DFL;
+        chained.slot.store(slot ^ 1, std::memory_order_release);
+    }
+
+    // Traps and signals sent by a process do not repeat when the handler
+    // returns, faults are raised again by the same instruction.
+    const bool repeats = sig != SIGTRAP && info->si_code > 0;
+
+    if ((previous.sa_flags & SA_SIGINFO) != 0)
+    {
+        if (previous.sa_sigaction != nullptr)
+        {
+            previous.sa_sigaction(sig, info, ucontext);
+            return;
+        }
+    }
+    else if (previous.sa_handler == SIG_IGN && !repeats)
+    {
+        return;
+    }
+    else if (previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN)
+    {
+        previous.sa_handler(sig);
+        return;
+    }
+
+    // Returning re-executes the faulting instruction which now terminates
+    // the process with the original signal, the others are raised again and
+    // delivered once the handler returns.
+    struct sigaction dfl = {};
+    dfl.sa_handler = SIG_DFL;
+    RealSigaction(sig, &dfl, nullptr);
+    if (!repeats)
+        raise(sig);
+}
+
+int ExceptionHandler::SetSignalAction(
+    int sig, const struct sigaction* act, struct sigaction* oldact)
+{
+    ChainedAction* chained = FindChained(sig);
+    if (chained == nullptr || !chained->installed)
+        return RealSigaction(sig, act, oldact);
+
+    // The program's handler is chained behind the runtime's instead of
+    // replacing it.
+    std::lock_guard<std::mutex> lock(_signalLock);
+    const int slot = chained->slot.load(std::memory_order_relaxed);
+    if (oldact != nullptr)
+        *oldact = chained->previous[slot];
+    if (act != nullptr)
+    {
+        chained->previous[slot ^ 1] = *act;
+        chained->slot.store(slot ^ 1, std::memory_order_release);
+    }
+    return 0;
+}
+
+void ExceptionHandler::UnblockFaults()
+{
+    sigset_t faults;
+    sigemptyset(&faults);
+    sigaddset(&faults, SIGSEGV);
+    pthread_sigmask(SIG_UNBLOCK, &faults, nullptr);
+}
+
+static void Handler(int sig, siginfo_t* info, void* ucontext)
+{
+    auto* uc = static_cast<ucontext_t*>(ucontext);
+    greg_t* regs = uc->uc_mcontext.gregs;
+
+    const uintptr_t exceptionAddress = static_cast<uintptr_t>(regs[REG_RIP]);
+    const uintptr_t faultAddress = reinterpret_cast<uintptr_t>(info->si_addr);
+
+    // Only faults from translated code are recorded, traps report the
+    // address after the instruction that raised them.
+    if (sig != SIGSEGV)
+    {
+        if (InstructionCoverage::IsEnabled() && info->si_code > 0)
+        {
+            InstructionCoverage::RecordExit(
+                sig == SIGTRAP ? exceptionAddress - 1 : exceptionAddress);
+        }
+
+        ForwardSignal(sig, info, ucontext);
+        return;
+    }
+
+    // Bit 1 of the page fault error code marks writes, the write is
+    // repeated once the page is writable.
+    if (info->si_code == SEGV_ACCERR && (regs[REG_ERR] & 2) != 0
+        && AddressInSectionMap(faultAddress) && HandleCodeWrite(faultAddress))
+    {
+        return;
+    }
+
+    // Fetching an instruction from a page without PROT_EXEC faults on the
+    // instruction pointer itself.
+    if (info->si_code == SEGV_ACCERR && faultAddress == exceptionAddress
+        && AddressInSectionMap(exceptionAddress))
+    {
+        uintptr_t newIP = TranslateBlock(exceptionAddress);
+        if (newIP != 0)
+        {
+            regs[REG_RIP] = static_cast<greg_t>(newIP);
+            return;
+        }
+    }
+    else
+    {
+        // Faults inside translated code end the block early.
+        if (InstructionCoverage::IsEnabled())
+            InstructionCoverage::RecordExit(exceptionAddress);
+
+        if constexpr (true)
+        {
+            Logging::Msg(
+                "Exception: signal %d at %p, address %p", sig,
+                (void*)exceptionAddress, (void*)faultAddress);
+        }
+    }
+
+    ForwardSignal(sig, info, ucontext);
+}
+
+struct ElfImage
+{
+    uintptr_t base;
+    uintptr_t end;
+    bool mainModule;
+    std::string path;
+    std::vector<std::pair<uintptr_t, uintptr_t>> executable;
+};
+
+static int CollectImages(dl_phdr_info* info, size_t, void* user)
+{
+    auto& images = *static_cast<std::vector<ElfImage>*>(user);
+
+    // The main program is always reported first and without a name, other
+    // unnamed objects are not backed by a file.
+    const bool mainModule = images.empty();
+    if (!mainModule && (info->dlpi_name == nullptr || *info->dlpi_name == 0))
+        return 0;
+
+    const uintptr_t pageSize = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+
+    ElfImage& image = images.emplace_back();
+    image.base = UINTPTR_MAX;
+    image.end = 0;
+    image.mainModule = mainModule;
+    if (!mainModule)
+        image.path = info->dlpi_name;
+
+    for (int i = 0; i < info->dlpi_phnum; i++)
+    {
+        const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+        if (phdr.p_type != PT_LOAD)
+            continue;
+
+        const uintptr_t segmentVA = (info->dlpi_addr + phdr.p_vaddr)
+                                    & ~(pageSize - 1);
+        const uintptr_t segmentEndVA = (info->dlpi_addr + phdr.p_vaddr
+                                        + phdr.p_memsz + pageSize - 1)
+                                       & ~(pageSize - 1);
+
+        image.base = std::min(image.base, segmentVA);
+        image.end = std::max(image.end, segmentEndVA);
+
+        if ((phdr.p_flags & PF_X) != 0)
+            image.executable.emplace_back(segmentVA, segmentEndVA);
+    }
+
+    return 0;
+}
+
+static uint32_t QueryProtection(uintptr_t)
+{
+    // Only PF_X segments are protected, writable code is not restored as
+    // such.
+    return PROT_READ | PROT_EXEC;
+}
+
+static bool SetProtection(uintptr_t startVA, uintptr_t endVA, uint32_t prot)
+{
+    if (Platform::ProtectPages(
+            reinterpret_cast<void*>(startVA), endVA - startVA,
+            static_cast<int>(prot))
+        != 0)
+    {
+        Logging::Msg("mprotect(%p) failed: %d", (void*)startVA, errno);
+        return false;
+    }
+    return true;
+}
+
+static uint32_t ReadOnlyProtection()
+{
+    return PROT_READ;
+}
+
+static uint32_t StripExecute(uint32_t protection)
+{
+    // The rewriter has to read what it cannot execute.
+    if ((protection & PROT_EXEC) == 0)
+        return protection;
+    return (protection & ~static_cast<uint32_t>(PROT_EXEC)) | PROT_READ;
+}
+
+static bool IsWritable(uint32_t protection)
+{
+    return (protection & PROT_WRITE) != 0;
+}
+
+// The caller holds the modules lock.
+static bool OverlapsModule(uintptr_t startVA, uintptr_t endVA)
+{
+    // Modules do not overlap, only the last one starting before the end
+    // can reach into the range.
+    auto it = _seenModules.lower_bound(endVA);
+    if (it == _seenModules.begin())
+        return false;
+    --it;
+    return it->second > startVA;
+}
+
+// Applies a protection to memory outside the protected ranges, the caller
+// holds the modules lock. With JIT code enabled, anonymous memory that
+// becomes executable is protected from then on.
+static int ProtectNative(uintptr_t startVA, uintptr_t endVA, int prot)
+{
+    if ((prot & PROT_EXEC) != 0 && Config::Get().jitCode
+        && !OverlapsModule(startVA, endVA))
+    {
+        // Detached ranges are only recorded until re-attached.
+        if (_detached
+            && Platform::ProtectPages(
+                   reinterpret_cast<void*>(startVA), endVA - startVA, prot)
+                   != 0)
+        {
+            return -1;
+        }
+        if (ProtectRangeLocked(
+                startVA, endVA, static_cast<uint32_t>(prot),
+                (prot & PROT_WRITE) != 0))
+        {
+            _codeRegions = true;
+            return 0;
+        }
+    }
+
+    return Platform::ProtectPages(
+        reinterpret_cast<void*>(startVA), endVA - startVA, prot);
+}
+
+int ExceptionHandler::ProtectMemory(void* addr, size_t len, int prot)
+{
+    const uintptr_t startVA = reinterpret_cast<uintptr_t>(addr);
+    const uintptr_t endVA = (startVA + len + PageSize - 1) & ~(PageSize - 1);
+
+    // Invalid requests fail in the kernel as they would natively.
+    if (!_installed || (startVA & (PageSize - 1)) != 0 || startVA >= endVA)
+        return Platform::ProtectPages(addr, len, prot);
+
+    std::lock_guard<std::mutex> lock(_modulesLock);
+
+    // Parts of the request inside protected ranges, in address order.
+    std::vector<Regions::Range> code;
+    for (auto& range : _protected)
+    {
+        const uintptr_t partStart = std::max(startVA, range.start);
+        const uintptr_t partEnd = std::min(endVA, range.end);
+        if (partStart < partEnd)
+            code.push_back({ partStart, partEnd });
+    }
+    std::sort(
+        code.begin(), code.end(),
+        [](const Regions::Range& a, const Regions::Range& b) {
+            return a.start < b.start;
+        });
+
+    const bool writable = (prot & PROT_WRITE) != 0;
+
+    int res = 0;
+    uintptr_t cur = startVA;
+    for (auto& part : code)
+    {
+        if (cur < part.start && ProtectNative(cur, part.start, prot) != 0)
+            res = -1;
+        cur = part.end;
+
+        // Protected code stays without execute rights, writes are allowed
+        // right away when asked for.
+        const int applied = _detached ? prot
+                                      : static_cast<int>(StripExecute(prot));
+        if (Platform::ProtectPages(
+                reinterpret_cast<void*>(part.start), part.end - part.start,
+                applied)
+            != 0)
+        {
+            res = -1;
+            continue;
+        }
+
+        for (uintptr_t page = part.start; page < part.end; page += PageSize)
+        {
+            _requestedProtection[page] = static_cast<uint32_t>(prot);
+            if (writable && !_detached)
+                _writablePages.insert(page);
             else
-            {
-                Logging::Msg("Removed execute from %s", sectionName);
-                _sectionMap.emplace_back(sectionVA, sectionEndVA);
+                _writablePages.erase(page);
+        }
+        if (writable && !_detached)
+            _codeWritable = true;
+
+        Rewriter::Invalidate(part.start, part.end);
+    }
+
+    if (cur < endVA && ProtectNative(cur, endVA, prot) != 0)
+        res = -1;
+
+    return res;
+}
 
-                Rewriter::CreateSectionBuffer(sectionVA, sectionEndVA);
+void ExceptionHandler::OnMapMemory(void* addr, size_t len, int prot, int flags)
+{
+    if (!_installed || !Config::Get().jitCode || (prot & PROT_EXEC) == 0
+        || (flags & MAP_ANONYMOUS) == 0)
+    {
+        return;
+    }
+
+    const uintptr_t startVA = reinterpret_cast<uintptr_t>(addr);
+    const uintptr_t endVA = (startVA + len + PageSize - 1) & ~(PageSize - 1);
+
+    // A fixed mapping replaces whatever was there.
+    if ((flags & MAP_FIXED) != 0)
+        OnUnmapMemory(addr, len);
+
+    std::lock_guard<std::mutex> lock(_modulesLock);
+    if (ProtectRangeLocked(
+            startVA, endVA, static_cast<uint32_t>(prot),
+            (prot & PROT_WRITE) != 0))
+    {
+        _codeRegions = true;
+    }
+}
+
+void ExceptionHandler::OnUnmapMemory(void* addr, size_t len)
+{
+    // Modules are unmapped by the loader, only code the program mapped
+    // itself goes through here.
+    if (!_codeRegions)
+        return;
+
+    const uintptr_t startVA = reinterpret_cast<uintptr_t>(addr);
+    const uintptr_t endVA = (startVA + len + PageSize - 1) & ~(PageSize - 1);
+    if ((startVA & (PageSize - 1)) != 0 || startVA >= endVA)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(_modulesLock);
+
+        // Ranges partly unmapped keep the rest.
+        bool removed = false;
+        std::vector<ProtectedRange> kept;
+        for (auto& range : _protected)
+        {
+            if (range.end <= startVA || range.start >= endVA)
+            {
+                kept.push_back(range);
+                continue;
             }
+
+            const uintptr_t cutStart = std::max(startVA, range.start);
+            const uintptr_t cutEnd = std::min(endVA, range.end);
+            _sectionMap.Remove(cutStart, cutEnd);
+            if (range.start < cutStart)
+                kept.push_back({ range.start, cutStart, range.protection });
+            if (cutEnd < range.end)
+                kept.push_back({ cutEnd, range.end, range.protection });
+            removed = true;
         }
+        if (!removed)
+            return;
 
-        sectionAddress += sizeof(IMAGE_SECTION_HEADER);
+        _protected.swap(kept);
+        _writablePages.erase(
+            _writablePages.lower_bound(startVA),
+            _writablePages.lower_bound(endVA));
+        _requestedProtection.erase(
+            _requestedProtection.lower_bound(startVA),
+            _requestedProtection.lower_bound(endVA));
+    }
+
+    Rewriter::RemoveModule(startVA, endVA);
+}
+
+static bool RemoveExecutableRights(const ElfImage& image)
+{
+    std::vector<Regions::Range> regions;
+    if (Regions::IsEnabled())
+    {
+        regions = Regions::Resolve(image.path.c_str(), image.base, image.end);
+        if (regions.empty())
+            return true;
+    }
+
+    Coverage::RegisterModule(image.base, image.end, image.path.c_str());
+
+    // One reservation holds the translations of every segment.
+    size_t codeSize = 0;
+    for (auto& segment : image.executable)
+        codeSize += segment.second - segment.first;
+    Rewriter::ReserveCodeCache(
+        image.base, image.end, TranslatedSize(codeSize, regions));
+
+    for (auto& segment : image.executable)
+    {
+        const uintptr_t segmentVA = segment.first;
+        const uintptr_t segmentEndVA = segment.second;
+
+        Logging::Msg(
+            "Segment: %p - %p", (void*)segmentVA, (void*)segmentEndVA);
+
+        for (auto& pages :
+             Regions::SelectPages(regions, segmentVA, segmentEndVA))
+        {
+            if (ProtectRange(pages.start, pages.end))
+            {
+                Logging::Msg(
+                    "Removed execute from %p - %p", (void*)pages.start,
+                    (void*)pages.end);
+            }
+        }
     }
 
     return true;
 }
 
+static void CollectLoadedModules(std::set<ModuleRange>& loaded)
+{
+    std::vector<ElfImage> images;
+    dl_iterate_phdr(CollectImages, &images);
+    for (auto& image : images)
+    {
+        loaded.emplace(image.base, image.end);
+    }
+}
+
+uintptr_t ExceptionHandler::ReleaseModule(const void* addr)
+{
+    const uintptr_t va = reinterpret_cast<uintptr_t>(addr);
+
+    ModuleRange mod{};
+    {
+        std::lock_guard<std::mutex> lock(_modulesLock);
+        auto it = _seenModules.upper_bound(va);
+        if (it == _seenModules.begin())
+            return 0;
+        --it;
+        if (va >= it->second)
+            return 0;
+        mod = *it;
+    }
+
+    if (ForgetModule(mod.first, mod.second, true) == 0)
+        return 0;
+    return mod.first;
+}
+
+void ExceptionHandler::FinishRelease(uintptr_t base)
+{
+    std::set<ModuleRange> loaded;
+    CollectLoadedModules(loaded);
+
+    auto it = std::find_if(
+        loaded.begin(), loaded.end(),
+        [&](const ModuleRange& mod) { return mod.first == base; });
+    if (it == loaded.end())
+    {
+        Coverage::UnregisterModule(base);
+        return;
+    }
+
+    // Other references kept it loaded, its coverage entry is still valid and
+    // is picked up again by the scan.
+    ScanModules();
+}
+
+void ExceptionHandler::ScanModules()
+{
+    // Modules loaded while detached are picked up on re-attach.
+    if (!_installed || IsDetached())
+        return;
+
+    // Collected first, the loader lock is held during the iteration.
+    std::vector<ElfImage> images;
+    dl_iterate_phdr(CollectImages, &images);
+
+    // The runtime has to keep running natively to handle the faults.
+    uintptr_t runtimeBase = 0;
+    Dl_info info{};
+    if (dladdr(reinterpret_cast<void*>(&Handler), &info) != 0)
+        runtimeBase = reinterpret_cast<uintptr_t>(info.dli_fbase);
+
+    for (auto& image : images)
+    {
+        if (image.end == 0 || image.base == runtimeBase)
+            continue;
+        if (!MarkSeen(image.base, image.end))
+            continue;
+
+        if (image.mainModule)
+        {
+            char modulePath[PATH_MAX]{};
+            if (readlink("/proc/self/exe", modulePath, sizeof(modulePath) - 1)
+                != -1)
+            {
+                image.path = modulePath;
+            }
+        }
+
+        if (!ModuleFilter::IsIncluded(image.path.c_str(), image.mainModule))
+        {
+            Logging::Msg("Native module: %s", image.path.c_str());
+            continue;
+        }
+
+        RemoveExecutableRights(image);
+    }
+}
+
 bool ExceptionHandler::Initialize()
 {
-    AddVectoredExceptionHandler(1, Handler);
+    struct sigaction action = {};
+    action.sa_sigaction = Handler;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+
+    for (size_t i = 0; i < std::size(ChainedSignals); i++)
+    {
+        const int sig = ChainedSignals[i];
+        if (RealSigaction(sig, &action, &_chained[i].previous[0]) != 0)
+        {
+            Logging::Msg("sigaction(%d) failed: %d", sig, errno);
+            // Without SIGSEGV nothing gets translated.
+            if (sig == SIGSEGV)
+                return false;
+            continue;
+        }
+        _chained[i].installed = true;
+    }
+    _installed = true;
 
-    // TODO: Allow multiple modules.
-    RemoveExecutableRights(GetModuleHandleA(nullptr));
+    // A blocked SIGSEGV inherited from the parent would kill the process on
+    // the first fault.
+    UnblockFaults();
+
+    ScanModules();
 
     return true;
 }
 
+#endif
+
 } // namespace CovCane
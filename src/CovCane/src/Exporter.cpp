@@ -0,0 +1,342 @@
+#include "Exporter.h"
+#include "Config.h"
+#include "Coverage.h"
+#include "FileWriter.h"
+#include "Location.h"
+#include "Logging.h"
+#include "CovCane/CoverageFile.h"
+
+#include <algorithm>
+#include <map>
+#include <string.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace CovCane {
+
+constexpr uint64_t SanCovMagic64 = 0xC0BFFFFFFFFFFF64ull;
+
+// Entry of the drcov basic block table.
+struct DrCovBlock
+{
+    uint32_t start;
+    uint16_t size;
+    uint16_t moduleId;
+};
+static_assert(sizeof(DrCovBlock) == 8);
+
+struct CoveredBlock
+{
+    const Coverage::Block* block;
+    uint64_t hits;
+};
+
+static unsigned GetProcessId()
+{
+#ifdef _WIN32
+    return static_cast<unsigned>(_getpid());
+#else
+    return static_cast<unsigned>(getpid());
+#endif
+}
+
+// With profiling only blocks that executed count, otherwise a block counts
+// once it was translated.
+static std::vector<CoveredBlock> GetCoveredBlocks(
+    const std::vector<Coverage::Block>& blocks)
+{
+    const bool profile = Config::Get().profile;
+    const std::vector<uint64_t> hitCounts = profile ? Coverage::GetHitCounts()
+                                                    : std::vector<uint64_t>();
+
+    std::vector<CoveredBlock> res;
+    res.reserve(blocks.size());
+
+    for (auto& block : blocks)
+    {
+        uint64_t hits = 1;
+        if (profile)
+        {
+            hits = block.id < hitCounts.size() ? hitCounts[block.id] : 0;
+            if (hits == 0)
+                continue;
+        }
+        res.push_back({ &block, hits });
+    }
+
+    return res;
+}
+
+static bool WriteDrCov(const char* output)
+{
+    const auto modules = Coverage::GetModules();
+    const auto blocks = Coverage::GetBlocks();
+    const auto covered = GetCoveredBlocks(blocks);
+
+    size_t blockCount = 0;
+    for (auto& entry : covered)
+    {
+        if (entry.block->moduleId < modules.size())
+            blockCount++;
+    }
+
+    FileWriter writer;
+    if (!writer.Open(output))
+        return false;
+
+    writer.Print("DRCOV VERSION: 2\n");
+    writer.Print("DRCOV FLAVOR: drcov\n");
+    writer.Print("Module Table: version 2, count %zu\n", modules.size());
+    writer.Print("Columns: id, base, end, entry, checksum, timestamp, path\n");
+
+    for (auto& mod : modules)
+    {
+        writer.Print(
+            "%3u, 0x%016llx, 0x%016llx, 0x%016llx, 0x%08x, 0x%08x, %s\n",
+            mod.id, (unsigned long long)mod.base, (unsigned long long)mod.end,
+            0ull, 0u, 0u, mod.path.c_str());
+    }
+
+    writer.Print("BB Table: %zu bbs\n", blockCount);
+
+    for (auto& entry : covered)
+    {
+        const Coverage::Block& block = *entry.block;
+        if (block.moduleId >= modules.size())
+            continue;
+
+        DrCovBlock bb{};
+        bb.start = static_cast<uint32_t>(
+            block.sourceVA - modules[block.moduleId].base);
+        bb.size = static_cast<uint16_t>(std::min<uint32_t>(
+            block.sourceSize, 0xFFFF));
+        bb.moduleId = static_cast<uint16_t>(block.moduleId);
+        writer.WriteValue(bb);
+    }
+
+    if (!writer.Close())
+    {
+        Logging::Msg("Failed to write drcov output: %s", output);
+        return false;
+    }
+
+    Logging::Msg("Wrote %zu drcov blocks to %s", blockCount, output);
+    return true;
+}
+
+static bool WriteSanCov(const char* outputDir)
+{
+    const auto modules = Coverage::GetModules();
+    const auto blocks = Coverage::GetBlocks();
+    const auto covered = GetCoveredBlocks(blocks);
+
+    struct SanCovModule
+    {
+        const char* path;
+        std::vector<uint64_t> pcs;
+    };
+
+    // All loads of a path go to one file, offsets are module relative.
+    std::vector<SanCovModule> files;
+    std::unordered_map<std::string, size_t> pathIds;
+    std::vector<size_t> fileIds;
+    for (auto& mod : modules)
+    {
+        auto it = pathIds.emplace(mod.path, files.size()).first;
+        if (it->second == files.size())
+            files.push_back({ mod.path.c_str(), {} });
+        fileIds.push_back(it->second);
+    }
+
+    for (auto& entry : covered)
+    {
+        const Coverage::Block& block = *entry.block;
+        if (block.moduleId >= modules.size())
+            continue;
+        files[fileIds[block.moduleId]].pcs.push_back(
+            block.sourceVA - modules[block.moduleId].base);
+    }
+
+    // Files are named after the module, modules with the same file name in
+    // different directories get a counter appended.
+    std::unordered_map<std::string, unsigned> names;
+
+    bool res = true;
+    for (auto& file : files)
+    {
+        std::vector<uint64_t>& pcs = file.pcs;
+        if (pcs.empty())
+            continue;
+
+        std::sort(pcs.begin(), pcs.end());
+        pcs.erase(std::unique(pcs.begin(), pcs.end()), pcs.end());
+
+        std::string name = Location::GetFileName(file.path);
+        const unsigned count = ++names[name];
+        if (count > 1)
+            name += "-" + std::to_string(count);
+
+        char path[512]{};
+        snprintf(
+            path, sizeof(path), "%s/%s.%u.sancov", outputDir, name.c_str(),
+            GetProcessId());
+
+        FileWriter writer;
+        if (!writer.Open(path))
+        {
+            res = false;
+            continue;
+        }
+
+        writer.WriteValue(SanCovMagic64);
+        writer.Write(pcs.data(), pcs.size() * sizeof(uint64_t));
+
+        if (!writer.Close())
+        {
+            Logging::Msg("Failed to write sancov output: %s", path);
+            res = false;
+            continue;
+        }
+
+        Logging::Msg(
+            "Wrote %zu sancov offsets of %s to %s", pcs.size(), file.path,
+            path);
+    }
+
+    return res;
+}
+
+static bool WriteBinary(const char* output)
+{
+    const auto modules = Coverage::GetModules();
+    const auto blocks = Coverage::GetBlocks();
+    const auto covered = GetCoveredBlocks(blocks);
+
+    // A module loaded again gets a new id, offsets are module relative so
+    // all loads of a path share one entry and the builder sums their hits.
+    CoverageFile::Builder builder(Config::Get().profile);
+    std::unordered_map<std::string, uint32_t> pathIds;
+    std::vector<uint32_t> entryIds;
+    for (auto& mod : modules)
+    {
+        auto it = pathIds.find(mod.path);
+        if (it == pathIds.end())
+        {
+            it = pathIds
+                     .emplace(
+                         mod.path,
+                         builder.AddModule(
+                             mod.path, mod.base, mod.end - mod.base))
+                     .first;
+        }
+        entryIds.push_back(it->second);
+    }
+
+    // Module ids are assigned in registration order.
+    size_t blockCount = 0;
+    for (auto& entry : covered)
+    {
+        const Coverage::Block& block = *entry.block;
+        if (block.moduleId >= modules.size())
+            continue;
+
+        builder.AddBlock(
+            entryIds[block.moduleId],
+            static_cast<uint32_t>(
+                block.sourceVA - modules[block.moduleId].base),
+            entry.hits);
+        blockCount++;
+    }
+
+    FileWriter writer;
+    if (!writer.Open(output))
+        return false;
+
+    if (!builder.Write(writer) || !writer.Close())
+    {
+        Logging::Msg("Failed to write coverage file: %s", output);
+        return false;
+    }
+
+    Logging::Msg("Wrote %zu blocks to %s", blockCount, output);
+    return true;
+}
+
+bool Exporter::ParseFormat(const char* name, Format& format)
+{
+    if (strcmp(name, "drcov") == 0)
+        format = Format::DrCov;
+    else if (strcmp(name, "sancov") == 0)
+        format = Format::SanCov;
+    else if (strcmp(name, "cov") == 0)
+        format = Format::Binary;
+    else
+        return false;
+    return true;
+}
+
+bool Exporter::Write(Format format, const char* output)
+{
+    switch (format)
+    {
+        case Format::DrCov:
+            return WriteDrCov(output);
+        case Format::SanCov:
+            return WriteSanCov(output);
+        case Format::Binary:
+            return WriteBinary(output);
+    }
+    return false;
+}
+
+void Exporter::WriteConfigured()
+{
+    const Config::Options& opts = Config::Get();
+
+    const std::string& list = opts.exportFormats;
+    size_t pos = 0;
+    while (pos < list.size())
+    {
+        size_t end = list.find(',', pos);
+        if (end == std::string::npos)
+            end = list.size();
+
+        const std::string name = list.substr(pos, end - pos);
+        pos = end + 1;
+
+        Format format;
+        if (!ParseFormat(name.c_str(), format))
+        {
+            Logging::Msg("Unknown export format: %s", name.c_str());
+            continue;
+        }
+
+        char output[512]{};
+        switch (format)
+        {
+            case Format::DrCov:
+                snprintf(
+                    output, sizeof(output), "%s/CovCane.%u.drcov",
+                    opts.exportDir.c_str(), GetProcessId());
+                break;
+            case Format::SanCov:
+                snprintf(output, sizeof(output), "%s", opts.exportDir.c_str());
+                break;
+            case Format::Binary:
+                snprintf(
+                    output, sizeof(output), "%s/CovCane.%u.cov",
+                    opts.exportDir.c_str(), GetProcessId());
+                break;
+        }
+
+        Write(format, output);
+    }
+}
+
+} // namespace CovCane
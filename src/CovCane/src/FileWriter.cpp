@@ -0,0 +1,106 @@
+#include "FileWriter.h"
+#include "Logging.h"
+#include "Platform.h"
+
+#include <stdarg.h>
+#include <string.h>
+
+namespace CovCane {
+
+// Room reserved for a single Print call.
+constexpr size_t MaxRecordSize = 1024;
+
+FileWriter::~FileWriter()
+{
+    Close();
+}
+
+bool FileWriter::Open(const char* path)
+{
+    Close();
+
+    _file = Platform::OpenFile(path, "wb");
+    if (_file == nullptr)
+    {
+        Logging::Msg("Unable to open output: %s", path);
+        return false;
+    }
+
+    if (!_buffer)
+        _buffer.reset(new char[BufferSize]);
+
+    _used = 0;
+    _failed = false;
+    return true;
+}
+
+bool FileWriter::Close()
+{
+    if (_file == nullptr)
+        return false;
+
+    Flush();
+    if (fclose(_file) != 0)
+        _failed = true;
+    _file = nullptr;
+
+    return !_failed;
+}
+
+void FileWriter::Flush()
+{
+    if (_used == 0)
+        return;
+
+    if (fwrite(_buffer.get(), 1, _used, _file) != _used)
+        _failed = true;
+    _used = 0;
+}
+
+void FileWriter::Write(const void* data, size_t len)
+{
+    if (_file == nullptr)
+        return;
+
+    if (_used + len > BufferSize)
+    {
+        Flush();
+
+        // Large blocks bypass the buffer.
+        if (len > BufferSize)
+        {
+            if (fwrite(data, 1, len, _file) != len)
+                _failed = true;
+            return;
+        }
+    }
+
+    memcpy(_buffer.get() + _used, data, len);
+    _used += len;
+}
+
+void FileWriter::Print(const char* fmt, ...)
+{
+    if (_file == nullptr)
+        return;
+
+    if (_used + MaxRecordSize > BufferSize)
+        Flush();
+
+    va_list args;
+    va_start(args, fmt);
+    const int res = vsnprintf(
+        _buffer.get() + _used, MaxRecordSize, fmt, args);
+    va_end(args);
+
+    if (res < 0)
+    {
+        _failed = true;
+        return;
+    }
+
+    // Longer records are truncated.
+    _used += static_cast<size_t>(res) < MaxRecordSize ? res : MaxRecordSize - 1;
+}
+
+} // namespace CovCane
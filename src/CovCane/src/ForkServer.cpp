@@ -0,0 +1,224 @@
+#include "ForkServer.h"
+#include "Config.h"
+#include "Coverage.h"
+#include "Location.h"
+#include "Logging.h"
+#include "Platform.h"
+#include "Rewriter.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <strings.h>
+#endif
+#ifdef __linux__
+#include <errno.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+namespace CovCane {
+
+static bool EqualsNoCase(const char* a, const char* b)
+{
+#ifdef _WIN32
+    return _stricmp(a, b) == 0;
+#else
+    return strcasecmp(a, b) == 0;
+#endif
+}
+
+// Resolves the first module+offset token of a line, the other columns of a
+// profile report are ignored.
+static uintptr_t ResolveEntry(
+    char* line, const std::vector<Coverage::Module>& modules)
+{
+    char* plus = strstr(line, "+0x");
+    if (plus == nullptr)
+        return 0;
+
+    char* name = plus;
+    while (name > line && name[-1] != ' ' && name[-1] != '\t')
+        name--;
+
+    *plus = '\0';
+    const uintptr_t offset = static_cast<uintptr_t>(
+        strtoull(plus + 1, nullptr, 16));
+
+    for (auto& mod : modules)
+    {
+        if (!EqualsNoCase(Location::GetFileName(mod.path.c_str()), name))
+            continue;
+        if (offset >= mod.end - mod.base)
+            return 0;
+        return mod.base + offset;
+    }
+
+    return 0;
+}
+
+size_t ForkServer::WarmUp(const char* listFile)
+{
+    FILE* fp = Platform::OpenFile(listFile, "rt");
+    if (fp == nullptr)
+    {
+        Logging::Msg("Unable to open warm list: %s", listFile);
+        return 0;
+    }
+
+    const std::vector<Coverage::Module> modules = Coverage::GetModules();
+
+    size_t warmed = 0;
+    size_t skipped = 0;
+
+    char line[512];
+    while (fgets(line, sizeof(line), fp) != nullptr)
+    {
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+
+        const uintptr_t va = ResolveEntry(line, modules);
+        if (va != 0 && Rewriter::ProcessBranch(va) != 0)
+            warmed++;
+        else
+            skipped++;
+    }
+
+    fclose(fp);
+
+    Logging::Msg(
+        "Warmed %zu blocks from %s, skipped %zu", warmed, listFile, skipped);
+
+    return warmed;
+}
+
+#ifdef __linux__
+
+// Descriptors used by AFL, the driver writes to the control pipe to request
+// a run and reads the child pid and wait status from the status pipe.
+constexpr int ControlFd = 198;
+constexpr int StatusFd = 199;
+
+bool ForkServer::AttachSharedMap()
+{
+    const char* shmId = getenv("__AFL_SHM_ID");
+    if (shmId == nullptr)
+        return true;
+
+    uint8_t* map = Coverage::GetMap();
+    if (map == nullptr)
+    {
+        Logging::Msg("No coverage map to share");
+        return false;
+    }
+
+    // A segment of another size would cover the dirty flags behind the map
+    // or leave part of the map private.
+    const int id = atoi(shmId);
+    shmid_ds info{};
+    if (shmctl(id, IPC_STAT, &info) != 0)
+    {
+        Logging::Msg("shmctl(%s) failed: %d", shmId, errno);
+        return false;
+    }
+    if (info.shm_segsz != Coverage::GetMapSize())
+    {
+        Logging::Msg(
+            "Shared map %s has %zu bytes, the coverage map %zu", shmId,
+            static_cast<size_t>(info.shm_segsz), Coverage::GetMapSize());
+        return false;
+    }
+
+    // Replaces the map pages in place, the dirty flags behind the map stay
+    // private and the translated code keeps its absolute map address.
+    void* res = shmat(id, map, SHM_REMAP);
+    if (res == reinterpret_cast<void*>(-1))
+    {
+        Logging::Msg("shmat failed: %d", errno);
+        return false;
+    }
+
+    Logging::Msg(
+        "Attached shared map %s, %zu bytes", shmId, Coverage::GetMapSize());
+
+    return true;
+}
+
+bool ForkServer::Run()
+{
+    static bool started = false;
+    if (started)
+        return false;
+    started = true;
+
+    const Config::Options& opts = Config::Get();
+    if (!opts.warmList.empty())
+        WarmUp(opts.warmList.c_str());
+
+    uint32_t hello = 0;
+    if (write(StatusFd, &hello, sizeof(hello)) != sizeof(hello))
+    {
+        Logging::Msg("No fork server driver listening on %d", StatusFd);
+        return false;
+    }
+
+    Logging::Msg("Fork server running");
+
+    // Children would otherwise write the buffered messages again.
+    Logging::Flush();
+
+    for (;;)
+    {
+        uint32_t wasKilled = 0;
+        if (read(ControlFd, &wasKilled, sizeof(wasKilled)) != sizeof(wasKilled))
+            _exit(0);
+
+        const pid_t pid = fork();
+        if (pid < 0)
+        {
+            Logging::Msg("fork failed: %d", errno);
+            _exit(1);
+        }
+
+        if (pid == 0)
+        {
+            close(ControlFd);
+            close(StatusFd);
+
+            // The code cache is inherited, only the hits of the server
+            // itself have to go.
+            Coverage::ResetMap();
+            return true;
+        }
+
+        int32_t childPid = pid;
+        if (write(StatusFd, &childPid, sizeof(childPid)) != sizeof(childPid))
+            _exit(1);
+
+        int status = 0;
+        if (waitpid(pid, &status, 0) < 0)
+            _exit(1);
+
+        if (write(StatusFd, &status, sizeof(status)) != sizeof(status))
+            _exit(1);
+    }
+}
+
+#else
+
+bool ForkServer::AttachSharedMap()
+{
+    return true;
+}
+
+bool ForkServer::Run()
+{
+    Logging::Msg("Fork server is only supported on Linux");
+    return false;
+}
+
+#endif
+
+} // namespace CovCane
@@ -0,0 +1,252 @@
+#include "InstructionCoverage.h"
+#include "BranchCoverage.h"
+#include "Config.h"
+#include "Coverage.h"
+#include "Location.h"
+#include "Logging.h"
+#include "Platform.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <mutex>
+
+namespace CovCane {
+
+struct BlockInstructions
+{
+    uintptr_t targetVA;
+    uint32_t targetSize;
+    std::vector<InstructionCoverage::Instruction> instructions;
+    // Exceptions raised inside the block and the furthest instruction one
+    // was raised at, plus one.
+    uint64_t exits;
+    uint32_t furthestExit;
+};
+
+static std::vector<BlockInstructions> _blocks;
+// Translated start address to block id.
+static std::map<uintptr_t, uint32_t> _blocksByTarget;
+static bool _enabled = false;
+static std::mutex _lock;
+
+bool InstructionCoverage::Initialize()
+{
+    _enabled = Config::Get().instructionCoverage;
+    return true;
+}
+
+bool InstructionCoverage::IsEnabled()
+{
+    return _enabled;
+}
+
+void InstructionCoverage::AddBlock(
+    uint32_t blockId,
+    uintptr_t targetVA,
+    uint32_t targetSize,
+    std::vector<Instruction> instructions)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+
+    if (blockId >= _blocks.size())
+        _blocks.resize(blockId + 1);
+
+    BlockInstructions& block = _blocks[blockId];
+
+    // A block translated again after its code changed keeps what was
+    // recorded as long as its instructions still line up.
+    const bool sameLayout = std::equal(
+        block.instructions.begin(), block.instructions.end(),
+        instructions.begin(), instructions.end(),
+        [](const Instruction& a, const Instruction& b) {
+            return a.length == b.length;
+        });
+    if (!sameLayout)
+    {
+        block.exits = 0;
+        block.furthestExit = 0;
+    }
+
+    block.targetVA = targetVA;
+    block.targetSize = targetSize;
+    block.instructions = std::move(instructions);
+
+    _blocksByTarget[targetVA] = blockId;
+}
+
+void InstructionCoverage::RemoveBlock(uintptr_t targetVA)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    _blocksByTarget.erase(targetVA);
+}
+
+bool InstructionCoverage::RecordExit(uintptr_t targetVA)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+
+    auto it = _blocksByTarget.upper_bound(targetVA);
+    if (it == _blocksByTarget.begin())
+        return false;
+    --it;
+
+    BlockInstructions& block = _blocks[it->second];
+    if (block.instructions.empty())
+        return false;
+
+    // Addresses before the first instruction belong to the block probe.
+    const uintptr_t offset = targetVA - block.targetVA;
+    if (offset < block.instructions.front().targetOffset
+        || offset >= block.targetSize)
+        return false;
+
+    // Last instruction starting at or before the address.
+    auto ins = std::upper_bound(
+        block.instructions.begin(), block.instructions.end(), offset,
+        [](uintptr_t value, const Instruction& entry) {
+            return value < entry.targetOffset;
+        });
+    const uint32_t index = static_cast<uint32_t>(
+        ins - block.instructions.begin());
+
+    block.exits++;
+    block.furthestExit = std::max(block.furthestExit, index);
+
+    return true;
+}
+
+using BlockCoverageList = std::vector<InstructionCoverage::BlockCoverage>;
+
+BlockCoverageList InstructionCoverage::GetCoverage()
+{
+    const bool profile = Config::Get().profile;
+    const auto hitCounts = Coverage::GetHitCounts();
+    const auto blocks = Coverage::GetBlocks();
+
+    BlockCoverageList res;
+
+    std::lock_guard<std::mutex> lock(_lock);
+
+    for (auto& info : blocks)
+    {
+        if (info.id >= _blocks.size())
+            continue;
+
+        const uint64_t hits = info.id < hitCounts.size() ? hitCounts[info.id]
+                                                          : 0;
+        if (profile && hits == 0)
+            continue;
+
+        const BlockInstructions& block = _blocks[info.id];
+        const uint32_t count = static_cast<uint32_t>(
+            block.instructions.size());
+
+        // Without hit counts a block that raised an exception is assumed to
+        // never have completed.
+        const bool completed = block.exits == 0
+                               || (profile && hits > block.exits);
+        const uint32_t end = completed ? count : block.furthestExit;
+
+        uint32_t executed = 0;
+        uintptr_t va = info.sourceVA;
+        for (; executed < end; executed++)
+        {
+            const Instruction& ins = block.instructions[executed];
+            va += ins.length;
+
+            if (!ins.conditional || !BranchCoverage::IsEnabled())
+                continue;
+
+            // The rest of the block only ran if the branch fell through.
+            const uint32_t site = BranchCoverage::FindSite(va - ins.length);
+            if (site != Coverage::InvalidId
+                && (BranchCoverage::GetState(site) & BranchCoverage::NotTaken)
+                       == 0)
+            {
+                executed++;
+                break;
+            }
+        }
+
+        BlockCoverage& entry = res.emplace_back();
+        entry.blockId = info.id;
+        entry.instructionCount = count;
+        entry.executedCount = executed;
+
+        // Within a block only a prefix runs, so the bitmap is at most two
+        // runs. The run encoding keeps the format open for merged blocks.
+        entry.runs.push_back(executed);
+        if (count > executed)
+            entry.runs.push_back(count - executed);
+    }
+
+    return res;
+}
+
+bool InstructionCoverage::WriteReport(const char* outputFile)
+{
+    const auto modules = Coverage::GetModules();
+    const auto blocks = Coverage::GetBlocks();
+    const auto coverage = GetCoverage();
+
+    FILE* fp = Platform::OpenFile(outputFile, "wt");
+    if (fp == nullptr)
+    {
+        Logging::Msg("Unable to open instruction output: %s", outputFile);
+        return false;
+    }
+
+    uint64_t total = 0;
+    uint64_t executed = 0;
+    for (auto& entry : coverage)
+    {
+        total += entry.instructionCount;
+        executed += entry.executedCount;
+    }
+
+    fprintf(
+        fp, "# Blocks: %zu, instructions: %llu, executed: %llu\n",
+        coverage.size(), (unsigned long long)total,
+        (unsigned long long)executed);
+    fprintf(
+        fp, "# %-16s %-40s %-6s %-6s %s\n", "va", "module+offset", "count",
+        "ran", "runs");
+
+    // Blocks are listed by id, GetBlocks only skips failed translations.
+    size_t next = 0;
+    for (auto& entry : coverage)
+    {
+        while (next < blocks.size() && blocks[next].id != entry.blockId)
+            next++;
+        if (next == blocks.size())
+            break;
+
+        const Coverage::Block& block = blocks[next];
+
+        char location[64];
+        Location::Format(
+            location, sizeof(location),
+            block.moduleId < modules.size() ? &modules[block.moduleId]
+                                            : nullptr,
+            block.sourceVA);
+
+        fprintf(
+            fp, "  %016llx %-40s %-6u %-6u ",
+            (unsigned long long)block.sourceVA, location,
+            entry.instructionCount, entry.executedCount);
+
+        for (size_t i = 0; i < entry.runs.size(); i++)
+            fprintf(fp, i == 0 ? "%u" : ",%u", entry.runs[i]);
+        fprintf(fp, "\n");
+    }
+
+    fclose(fp);
+
+    Logging::Msg(
+        "Wrote instruction coverage of %zu blocks to %s", coverage.size(),
+        outputFile);
+
+    return true;
+}
+
+} // namespace CovCane
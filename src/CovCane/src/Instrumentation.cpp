@@ -0,0 +1,423 @@
+#include "Instrumentation.h"
+#include "Config.h"
+#include "Coverage.h"
+#include "CoverageMap.h"
+#include "ThreadContext.h"
+
+#include <cstddef>
+
+namespace CovCane {
+
+using namespace asmjit;
+
+// The System V ABI allows leaf functions to use 128 bytes below rsp, the
+// probes must not clobber it.
+constexpr int32_t RedZoneSize = 128;
+
+static void EmitProbeEnter(x86::Assembler& cb, bool saveFlags = true)
+{
+    cb.lea(x86::rsp, x86::ptr(x86::rsp, -RedZoneSize));
+    if (saveFlags)
+        cb.pushfq();
+    cb.push(x86::rax);
+}
+
+static void EmitProbeLeave(x86::Assembler& cb, bool saveFlags = true)
+{
+    cb.pop(x86::rax);
+    if (saveFlags)
+        cb.popfq();
+    cb.lea(x86::rsp, x86::ptr(x86::rsp, RedZoneSize));
+}
+
+static void EmitSharedCounter(
+    x86::Assembler& cb, uint64_t* counter, bool atomic)
+{
+    cb.mov(x86::rax, reinterpret_cast<uintptr_t>(counter));
+    if (atomic)
+        cb.lock();
+    cb.inc(x86::qword_ptr(x86::rax));
+}
+
+static void EmitPerThreadCounter(
+    x86::Assembler& cb, uint64_t* counter, uint32_t blockId)
+{
+    Label sharedCounter = cb.newLabel();
+    Label done = cb.newLabel();
+
+    ThreadContext::EmitLoad(cb, x86::rax);
+    cb.test(x86::rax, x86::rax);
+    cb.jz(sharedCounter);
+    cb.mov(
+        x86::rax,
+        x86::qword_ptr(x86::rax, offsetof(ThreadContext::Context, counters)));
+    cb.test(x86::rax, x86::rax);
+    cb.jz(sharedCounter);
+    cb.inc(x86::qword_ptr(x86::rax, int32_t(blockId * sizeof(uint64_t))));
+    cb.jmp(done);
+
+    // Threads without a context fall back to the atomic shared counter.
+    cb.bind(sharedCounter);
+    EmitSharedCounter(cb, counter, true);
+
+    cb.bind(done);
+}
+
+static void EmitCounter(x86::Assembler& cb, uint32_t blockId)
+{
+    uint64_t* counter = Coverage::GetCounter(blockId);
+    if (counter == nullptr)
+        return;
+
+    switch (Config::Get().counterMode)
+    {
+        case Config::CounterMode::Racy:
+            EmitSharedCounter(cb, counter, false);
+            break;
+        case Config::CounterMode::Atomic:
+            EmitSharedCounter(cb, counter, true);
+            break;
+        case Config::CounterMode::PerThread:
+            // The thread counters must exist before code increments them.
+            if (ThreadContext::IsAvailable()
+                && ThreadContext::CommitCounters(blockId + 1))
+            {
+                EmitPerThreadCounter(cb, counter, blockId);
+            }
+            else
+            {
+                EmitSharedCounter(cb, counter, true);
+            }
+            break;
+    }
+}
+
+static bool UsesCallContext()
+{
+    return Config::Get().callContext && ThreadContext::IsAvailable();
+}
+
+static bool UsesPathHash()
+{
+    return Config::Get().pathLength != 0 && ThreadContext::IsAvailable();
+}
+
+// Rotation of the path hash per block, odd so that up to 32 blocks land on
+// distinct rotations.
+constexpr uint32_t PathRotation = 5;
+
+static uint32_t RotateLeft(uint32_t value, uint32_t count)
+{
+    count %= 32;
+    return count == 0 ? value : (value << count) | (value >> (32 - count));
+}
+
+// Stable ids of blocks outside of modules are sequential, mixing them lets
+// every rotation of the path hash reach the map index bits.
+static uint32_t GetPathId(uint32_t blockId)
+{
+    uint32_t x = Coverage::GetStableId(blockId) + 0x9E3779B9u;
+    x = (x ^ (x >> 16)) * 0x85EBCA6Bu;
+    x = (x ^ (x >> 13)) * 0xC2B2AE35u;
+    return x ^ (x >> 16);
+}
+
+// Adds the block to the path hash of the context in rax, rcx and rdx are
+// free. The hash is rotated once per block, so a block entered n blocks ago
+// is rotated by n * PathRotation. The ring keeps the block's id rotated by
+// length * PathRotation, which removes it from the hash once it falls out of
+// the window.
+static void EmitPathUpdate(x86::Assembler& cb, uint32_t blockId)
+{
+    const uint32_t length = static_cast<uint32_t>(Config::Get().pathLength);
+    const uint32_t id = GetPathId(blockId);
+
+    constexpr int32_t hashOffset = offsetof(ThreadContext::Context, pathHash);
+    constexpr int32_t posOffset = offsetof(ThreadContext::Context, pathPos);
+    constexpr int32_t ringOffset = offsetof(ThreadContext::Context, pathRing);
+    constexpr uint32_t ringMask = ThreadContext::MaxPathLength - 1;
+
+    cb.mov(x86::ecx, x86::dword_ptr(x86::rax, posOffset));
+    cb.add(x86::dword_ptr(x86::rax, posOffset), 1);
+
+    // Removal value of the block length steps back, read before the slot
+    // is reused when length is the ring size.
+    cb.lea(x86::edx, x86::ptr(x86::rcx, -int32_t(length)));
+    cb.and_(x86::edx, ringMask);
+    cb.mov(x86::edx, x86::dword_ptr(x86::rax, x86::rdx, 2, ringOffset));
+    cb.xor_(x86::edx, id);
+
+    cb.and_(x86::ecx, ringMask);
+    cb.mov(
+        x86::dword_ptr(x86::rax, x86::rcx, 2, ringOffset),
+        RotateLeft(id, length * PathRotation));
+
+    cb.rol(x86::dword_ptr(x86::rax, hashOffset), PathRotation);
+    cb.xor_(x86::dword_ptr(x86::rax, hashOffset), x86::edx);
+    cb.mov(x86::ecx, x86::dword_ptr(x86::rax, hashOffset));
+}
+
+// Map update with an index computed at runtime from the block, the path
+// hash and the call stack hash. rcx and rdx are free.
+static void EmitDynamicMapUpdate(
+    x86::Assembler& cb,
+    uint8_t* map,
+    size_t mapSize,
+    size_t index,
+    uint32_t blockId)
+{
+    Label sharedMap = cb.newLabel();
+    Label update = cb.newLabel();
+
+    // Threads without a context use the plain block index.
+    cb.mov(x86::ecx, uint32_t(index));
+
+    ThreadContext::EmitLoad(cb, x86::rax);
+    cb.test(x86::rax, x86::rax);
+    cb.jz(sharedMap);
+
+    // The path hash includes the block itself and replaces its index.
+    if (UsesPathHash())
+        EmitPathUpdate(cb, blockId);
+
+    if (UsesCallContext())
+    {
+        cb.xor_(
+            x86::ecx,
+            x86::dword_ptr(
+                x86::rax, offsetof(ThreadContext::Context, callHash)));
+    }
+
+    cb.and_(x86::ecx, uint32_t(mapSize - 1));
+    cb.mov(
+        x86::rax,
+        x86::qword_ptr(x86::rax, offsetof(ThreadContext::Context, map)));
+    cb.test(x86::rax, x86::rax);
+    cb.jnz(update);
+
+    cb.bind(sharedMap);
+    cb.mov(x86::rax, reinterpret_cast<uintptr_t>(map));
+
+    cb.bind(update);
+    x86::Mem entry = x86::byte_ptr(x86::rax, x86::rcx);
+    cb.add(entry, 1);
+    cb.adc(entry, 0);
+
+    // Line and page flags, 64 and 4096 entries per flag.
+    static_assert(CoverageMap::LineSize == 64 && CoverageMap::PageSize == 4096);
+    cb.shr(x86::ecx, 6);
+    cb.mov(
+        x86::byte_ptr(
+            x86::rax, x86::rcx, 0,
+            int32_t(CoverageMap::GetLineFlagsOffset(mapSize))),
+        1);
+    cb.shr(x86::ecx, 6);
+    cb.mov(
+        x86::byte_ptr(
+            x86::rax, x86::rcx, 0,
+            int32_t(CoverageMap::GetPageFlagsOffset(mapSize))),
+        1);
+}
+
+static void EmitMapUpdate(x86::Assembler& cb, uint32_t blockId)
+{
+    uint8_t* map = Coverage::GetMap();
+    if (map == nullptr)
+        return;
+
+    const size_t mapSize = Coverage::GetMapSize();
+    const size_t index = Coverage::GetMapIndex(blockId);
+
+    if (UsesCallContext() || UsesPathHash())
+    {
+        EmitDynamicMapUpdate(cb, map, mapSize, index, blockId);
+        return;
+    }
+
+    Label sharedMap = cb.newLabel();
+    Label update = cb.newLabel();
+
+    if (ThreadContext::IsAvailable())
+    {
+        ThreadContext::EmitLoad(cb, x86::rax);
+        cb.test(x86::rax, x86::rax);
+        cb.jz(sharedMap);
+        cb.mov(
+            x86::rax,
+            x86::qword_ptr(x86::rax, offsetof(ThreadContext::Context, map)));
+        cb.test(x86::rax, x86::rax);
+        cb.jnz(update);
+    }
+
+    // Threads without a context write into the shared map.
+    cb.bind(sharedMap);
+    cb.mov(x86::rax, reinterpret_cast<uintptr_t>(map));
+
+    // Increment without ever wrapping back to zero.
+    cb.bind(update);
+    x86::Mem entry = x86::byte_ptr(x86::rax, int32_t(index));
+    cb.add(entry, 1);
+    cb.adc(entry, 0);
+
+    // Plain stores keep the dirty tracking cheap.
+    const size_t lineFlag = CoverageMap::GetLineFlagsOffset(mapSize)
+                            + index / CoverageMap::LineSize;
+    const size_t pageFlag = CoverageMap::GetPageFlagsOffset(mapSize)
+                            + index / CoverageMap::PageSize;
+    cb.mov(x86::byte_ptr(x86::rax, int32_t(lineFlag)), 1);
+    cb.mov(x86::byte_ptr(x86::rax, int32_t(pageFlag)), 1);
+}
+
+bool Instrumentation::EmitBlockProbe(x86::Assembler& cb, uint32_t blockId)
+{
+    const Config::Options& opts = Config::Get();
+    if (!opts.profile && !opts.coverageMap)
+        return false;
+
+    const bool dynamicIndex = opts.coverageMap
+                              && (UsesCallContext() || UsesPathHash());
+
+    EmitProbeEnter(cb);
+    if (dynamicIndex)
+    {
+        cb.push(x86::rcx);
+        cb.push(x86::rdx);
+    }
+
+    if (opts.profile)
+        EmitCounter(cb, blockId);
+
+    if (opts.coverageMap)
+        EmitMapUpdate(cb, blockId);
+
+    if (dynamicIndex)
+    {
+        cb.pop(x86::rdx);
+        cb.pop(x86::rcx);
+    }
+    EmitProbeLeave(cb);
+
+    return true;
+}
+
+bool Instrumentation::HasCallContext()
+{
+    return Coverage::GetMap() != nullptr && UsesCallContext();
+}
+
+// Call site ids are spread over all 32 bits so every rotation of the hash
+// reaches the map index bits.
+static uint32_t GetCallSiteId(uintptr_t returnVA)
+{
+    uint64_t x = returnVA * 0x9E3779B97F4A7C15ull;
+    x ^= x >> 32;
+    return static_cast<uint32_t>(x);
+}
+
+// Status flags are volatile across calls in both x64 ABIs, neither the callee
+// entry nor the return address reads them, so the call context probes do
+// not save them.
+void Instrumentation::EmitCallContext(x86::Assembler& cb, uintptr_t returnVA)
+{
+    const uint32_t depth = static_cast<uint32_t>(Config::Get().contextDepth);
+    const uint32_t site = GetCallSiteId(returnVA);
+
+    constexpr int32_t stackOffset = offsetof(
+        ThreadContext::Context, callStack);
+    constexpr int32_t hashOffset = offsetof(ThreadContext::Context, callHash);
+    constexpr int32_t depthOffset = offsetof(
+        ThreadContext::Context, callDepth);
+
+    static_assert(sizeof(ThreadContext::CallFrame) == 8);
+
+    Label done = cb.newLabel();
+
+    EmitProbeEnter(cb, false);
+    cb.push(x86::rcx);
+    cb.push(x86::rdx);
+
+    ThreadContext::EmitLoad(cb, x86::rax);
+    cb.test(x86::rax, x86::rax);
+    cb.jz(done);
+
+    // Push the caller's hash and this site.
+    cb.mov(x86::ecx, x86::dword_ptr(x86::rax, depthOffset));
+    cb.add(x86::dword_ptr(x86::rax, depthOffset), 1);
+    cb.and_(x86::ecx, ThreadContext::CallStackSize - 1);
+    cb.mov(x86::edx, x86::dword_ptr(x86::rax, hashOffset));
+    cb.mov(x86::dword_ptr(x86::rax, x86::rcx, 3, stackOffset), x86::edx);
+    cb.mov(x86::dword_ptr(x86::rax, x86::rcx, 3, stackOffset + 4), site);
+
+    // hash = rotl(hash, 32 / depth) ^ site ^ site[depth - N]. After N calls
+    // a site is rotated back into place and cancelled by the last term, so
+    // only the innermost N sites remain.
+    cb.sub(x86::ecx, depth);
+    cb.and_(x86::ecx, ThreadContext::CallStackSize - 1);
+    cb.rol(x86::edx, 32 / depth);
+    cb.xor_(x86::edx, site);
+    cb.xor_(x86::edx, x86::dword_ptr(x86::rax, x86::rcx, 3, stackOffset + 4));
+    cb.mov(x86::dword_ptr(x86::rax, hashOffset), x86::edx);
+
+    cb.bind(done);
+    cb.pop(x86::rdx);
+    cb.pop(x86::rcx);
+    EmitProbeLeave(cb, false);
+}
+
+void Instrumentation::EmitReturnContext(x86::Assembler& cb)
+{
+    const uint32_t depth = static_cast<uint32_t>(Config::Get().contextDepth);
+
+    constexpr int32_t stackOffset = offsetof(
+        ThreadContext::Context, callStack);
+    constexpr int32_t hashOffset = offsetof(ThreadContext::Context, callHash);
+    constexpr int32_t depthOffset = offsetof(
+        ThreadContext::Context, callDepth);
+
+    Label done = cb.newLabel();
+
+    EmitProbeEnter(cb, false);
+    cb.push(x86::rcx);
+
+    ThreadContext::EmitLoad(cb, x86::rax);
+    cb.test(x86::rax, x86::rax);
+    cb.jz(done);
+
+    // Returns from frames entered before the thread had a context.
+    cb.mov(x86::ecx, x86::dword_ptr(x86::rax, depthOffset));
+    cb.cmp(x86::ecx, depth);
+    cb.jbe(done);
+
+    cb.sub(x86::ecx, 1);
+    cb.mov(x86::dword_ptr(x86::rax, depthOffset), x86::ecx);
+    cb.and_(x86::ecx, ThreadContext::CallStackSize - 1);
+    cb.mov(x86::ecx, x86::dword_ptr(x86::rax, x86::rcx, 3, stackOffset));
+    cb.mov(x86::dword_ptr(x86::rax, hashOffset), x86::ecx);
+
+    cb.bind(done);
+    cb.pop(x86::rcx);
+    EmitProbeLeave(cb, false);
+}
+
+void Instrumentation::EmitBranchProbe(
+    x86::Assembler& cb,
+    uint32_t siteId,
+    BranchCoverage::Direction direction,
+    bool saveFlags)
+{
+    uint8_t* state = BranchCoverage::GetStateByte(siteId);
+    if (state == nullptr)
+        return;
+
+    EmitProbeEnter(cb, saveFlags);
+
+    // Not atomic, a racing thread can drop a direction of a neighbouring
+    // site which is set again the next time it executes.
+    cb.mov(x86::rax, reinterpret_cast<uintptr_t>(state));
+    cb.or_(
+        x86::byte_ptr(x86::rax), BranchCoverage::GetStateMask(siteId, direction));
+
+    EmitProbeLeave(cb, saveFlags);
+}
+
+} // namespace CovCane
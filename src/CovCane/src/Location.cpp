@@ -0,0 +1,30 @@
+#include "Location.h"
+
+#include <stdio.h>
+#include <string.h>
+
+namespace CovCane {
+
+const char* Location::GetFileName(const char* path)
+{
+    const char* slash = strrchr(path, '\\');
+    if (slash == nullptr)
+        slash = strrchr(path, '/');
+    return slash != nullptr ? slash + 1 : path;
+}
+
+void Location::Format(
+    char* buf, size_t size, const Coverage::Module* mod, uintptr_t addr)
+{
+    if (mod == nullptr)
+    {
+        snprintf(buf, size, "?");
+        return;
+    }
+
+    snprintf(
+        buf, size, "%s+0x%llx", GetFileName(mod->path.c_str()),
+        (unsigned long long)(addr - mod->base));
+}
+
+} // namespace CovCane
@@ -1,5 +1,10 @@
 #include "Logging.h"
+#include "Platform.h"
+
+#include <string.h>
+#ifdef _WIN32
 #include <windows.h>
+#endif
 
 namespace CovCane::Logging {
 
@@ -9,11 +14,16 @@ namespace Detail {
 
     void DebugMsg(const char* str)
     {
+#ifdef _WIN32
         size_t bufLen = strlen(str) + 32;
         std::unique_ptr<char[]> prefixed(new char[bufLen]);
         strcpy_s(prefixed.get(), bufLen, "[CovCane] ");
         strcat_s(prefixed.get(), bufLen, str);
         OutputDebugStringA(prefixed.get());
+#else
+        // There is no debugger channel, stderr is the closest equivalent.
+        fprintf(stderr, "[CovCane] %s\n", str);
+#endif
     }
 
     void Msg(const char* str)
@@ -30,7 +40,7 @@ namespace Detail {
 
 bool Initialize(const char* outputFile)
 {
-    fopen_s(&_logFile, outputFile, "wt");
+    _logFile = Platform::OpenFile(outputFile, "wt");
     if (_logFile == nullptr)
         return false;
     return true;
@@ -1,21 +1,110 @@
-#include <windows.h>
 #include "Logging.h"
+#include "BranchCoverage.h"
 #include "ExceptionHandler.h"
+#include "Config.h"
+#include "Control.h"
+#include "Coverage.h"
+#include "Events.h"
+#include "Exporter.h"
+#include "ForkServer.h"
+#include "InstructionCoverage.h"
+#include "Profiler.h"
+#include "Regions.h"
+#include "SharedMap.h"
+#include "ThreadContext.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#include <link.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 using namespace CovCane;
 
+#ifdef _WIN32
+
+static uint32_t GetProcessId()
+{
+    return GetCurrentProcessId();
+}
+
+static void* GetImageBase()
+{
+    return GetModuleHandleA(nullptr);
+}
+
+#else
+
+static uint32_t GetProcessId()
+{
+    return static_cast<uint32_t>(getpid());
+}
+
+static void* GetImageBase()
+{
+    // The main program is reported first, its load bias is the image base
+    // for position independent executables.
+    void* base = nullptr;
+    dl_iterate_phdr(
+        [](dl_phdr_info* info, size_t, void* user) {
+            *static_cast<void**>(user) = reinterpret_cast<void*>(
+                info->dlpi_addr);
+            return 1;
+        },
+        &base);
+    return base;
+}
+
+#endif
+
 static void Startup()
 {
-    Logging::Initialize("CovCane.log");
+    Config::InitializeLog();
+    Logging::Initialize(Config::Get().logFile.c_str());
+
+    Logging::Msg("Process Id: %u", GetProcessId());
+    Logging::Msg("Image Base: %p", GetImageBase());
+
+    Config::Initialize();
+
+    if (!Coverage::Initialize())
+        Logging::Msg("Failed to initialize coverage.");
+
+    if (!BranchCoverage::Initialize())
+        Logging::Msg("Failed to initialize branch coverage.");
+
+    if (!InstructionCoverage::Initialize())
+        Logging::Msg("Failed to initialize instruction coverage.");
+
+    if (!SharedMap::Initialize())
+        Logging::Msg("Failed to attach the shared map.");
+
+    if (!Events::Initialize())
+        Logging::Msg("Failed to create the event queue.");
+
+    if (!ForkServer::AttachSharedMap())
+        Logging::Msg("Failed to attach the shared coverage map.");
 
-    Logging::Msg("Process Id: %u", GetCurrentProcessId());
-    Logging::Msg("Image Base: %p", (void*)GetModuleHandleA(nullptr));
+    if (!ThreadContext::Initialize())
+        Logging::Msg("Failed to initialize thread contexts.");
+
+    if (!Regions::Initialize())
+        Logging::Msg("Failed to load the region list.");
 
     if (!ExceptionHandler::Initialize())
         Logging::Msg("Failed to initialize exception handling.");
     else
         Logging::Msg("Initialized exception handling.");
 
+    if (!Control::Initialize())
+        Logging::Msg("Failed to start the control channel.");
+
+#ifdef _WIN32
     if constexpr (false)
     {
         while (!IsDebuggerPresent())
@@ -23,16 +112,39 @@ static void Startup()
             Sleep(1000);
         }
     }
+#endif
 
     Logging::Msg("Environment setup");
+
+    if (Config::Get().forkServer)
+        ForkServer::Run();
 }
 
 static void Shutdown()
 {
     Logging::Msg("Shutdown");
+
+    const Config::Options& opts = Config::Get();
+    if (opts.profile)
+        Profiler::WriteReport(opts.profileOutput.c_str());
+
+    if (opts.branchCoverage)
+        BranchCoverage::WriteReport(opts.branchOutput.c_str());
+
+    if (opts.instructionCoverage)
+        InstructionCoverage::WriteReport(opts.instructionOutput.c_str());
+
+    if (!opts.coverageFile.empty())
+        Exporter::Write(Exporter::Format::Binary, opts.coverageFile.c_str());
+
+    if (!opts.exportFormats.empty())
+        Exporter::WriteConfigured();
+
     Logging::Flush();
 }
 
+#ifdef _WIN32
+
 BOOL APIENTRY
     DllMain(HMODULE hModule, DWORD ul_reason_for_call, LPVOID lpReserved)
 {
@@ -44,8 +156,10 @@ BOOL APIENTRY
             Startup();
             break;
         case DLL_THREAD_ATTACH:
+            ThreadContext::Attach();
             break;
         case DLL_THREAD_DETACH:
+            ThreadContext::Detach();
             break;
         case DLL_PROCESS_DETACH:
             Shutdown();
@@ -53,3 +167,210 @@ BOOL APIENTRY
     }
     return TRUE;
 }
+
+#else
+
+namespace {
+
+struct ThreadStart
+{
+    void* (*routine)(void*);
+    void* arg;
+};
+
+} // namespace
+
+static void* ThreadMain(void* param)
+{
+    const ThreadStart start = *static_cast<ThreadStart*>(param);
+    delete static_cast<ThreadStart*>(param);
+
+    // The signal mask may come from the thread attributes.
+    ExceptionHandler::UnblockFaults();
+
+    // Detached again by the key destructor when the thread exits.
+    ThreadContext::Attach();
+
+    return start.routine(start.arg);
+}
+
+// There is no thread attach notification, threads created through pthreads
+// get their context from this wrapper instead.
+extern "C" __attribute__((visibility("default"))) int pthread_create(
+    pthread_t* thread,
+    const pthread_attr_t* attr,
+    void* (*routine)(void*),
+    void* arg)
+{
+    using PthreadCreate = int (*)(
+        pthread_t*, const pthread_attr_t*, void* (*)(void*), void*);
+    static const auto next = reinterpret_cast<PthreadCreate>(
+        dlsym(RTLD_NEXT, "pthread_create"));
+
+    if (!ThreadContext::IsAvailable())
+        return next(thread, attr, routine, arg);
+
+    auto* start = new ThreadStart{ routine, arg };
+    const int res = next(thread, attr, ThreadMain, start);
+    if (res != 0)
+        delete start;
+    return res;
+}
+
+// Libraries loaded at runtime are instrumented once dlopen returns, their
+// constructors have run natively by then.
+extern "C" __attribute__((visibility("default"))) void* dlopen(
+    const char* file, int mode)
+{
+    using Dlopen = void* (*)(const char*, int);
+    static const auto next = reinterpret_cast<Dlopen>(
+        dlsym(RTLD_NEXT, "dlopen"));
+
+    void* handle = next(file, mode);
+    if (handle != nullptr)
+        ExceptionHandler::ScanModules();
+    return handle;
+}
+
+// Translations of unloaded libraries have to go before their addresses are
+// reused. The library is released while it is still mapped, its destructors
+// run natively. Dependencies unloaded along with it are dropped afterwards.
+extern "C" __attribute__((visibility("default"))) int dlclose(void* handle)
+{
+    using Dlclose = int (*)(void*);
+    static const auto next = reinterpret_cast<Dlclose>(
+        dlsym(RTLD_NEXT, "dlclose"));
+
+    // The handle is no longer valid once the call returns.
+    link_map* map = nullptr;
+    uintptr_t base = 0;
+    if (dlinfo(handle, RTLD_DI_LINKMAP, &map) == 0 && map != nullptr)
+        base = ExceptionHandler::ReleaseModule(map->l_ld);
+
+    const int res = next(handle);
+    if (base != 0)
+        ExceptionHandler::FinishRelease(base);
+    if (res == 0)
+        ExceptionHandler::RemoveUnloadedModules();
+    return res;
+}
+
+// Code the program patches or generates is followed through its mappings,
+// the runtime maps its own memory with direct system calls.
+extern "C" __attribute__((visibility("default"))) int mprotect(
+    void* addr, size_t len, int prot)
+{
+    return ExceptionHandler::ProtectMemory(addr, len, prot);
+}
+
+extern "C" __attribute__((visibility("default"))) void* mmap(
+    void* addr, size_t len, int prot, int flags, int fd, off_t offset)
+{
+    using Mmap = void* (*)(void*, size_t, int, int, int, off_t);
+    static const auto next = reinterpret_cast<Mmap>(dlsym(RTLD_NEXT, "mmap"));
+
+    void* res = next(addr, len, prot, flags, fd, offset);
+    if (res != MAP_FAILED)
+        ExceptionHandler::OnMapMemory(res, len, prot, flags);
+    return res;
+}
+
+// Programs built with _FILE_OFFSET_BITS=64 and JIT libraries calling it by
+// name map through mmap64, a separate symbol that bypasses the one above.
+extern "C" __attribute__((visibility("default"))) void* mmap64(
+    void* addr, size_t len, int prot, int flags, int fd, off64_t offset)
+{
+    using Mmap64 = void* (*)(void*, size_t, int, int, int, off64_t);
+    static const auto next = reinterpret_cast<Mmap64>(
+        dlsym(RTLD_NEXT, "mmap64"));
+
+    void* res = next(addr, len, prot, flags, fd, offset);
+    if (res != MAP_FAILED)
+        ExceptionHandler::OnMapMemory(res, len, prot, flags);
+    return res;
+}
+
+extern "C" __attribute__((visibility("default"))) int munmap(
+    void* addr, size_t len)
+{
+    using Munmap = int (*)(void*, size_t);
+    static const auto next = reinterpret_cast<Munmap>(
+        dlsym(RTLD_NEXT, "munmap"));
+
+    // Before the range can be mapped again by another thread.
+    ExceptionHandler::OnUnmapMemory(addr, len);
+    return next(addr, len);
+}
+
+// Every block exit is a SIGSEGV and other faults end blocks early, the
+// program's handlers are chained behind the runtime's instead of replacing
+// them.
+extern "C" __attribute__((visibility("default"))) int sigaction(
+    int sig, const struct sigaction* act, struct sigaction* oldact)
+{
+    return ExceptionHandler::SetSignalAction(sig, act, oldact);
+}
+
+extern "C" __attribute__((visibility("default"))) sighandler_t signal(
+    int sig, sighandler_t handler)
+{
+    // BSD semantics, as the C library implements signal.
+    struct sigaction act = {};
+    act.sa_handler = handler;
+    act.sa_flags = SA_RESTART;
+    sigemptyset(&act.sa_mask);
+
+    struct sigaction oldact = {};
+    if (ExceptionHandler::SetSignalAction(sig, &act, &oldact) != 0)
+        return SIG_ERR;
+    return oldact.sa_handler;
+}
+
+// SIGSEGV cannot be blocked, blocked faults would kill the process.
+static const sigset_t* AllowFaults(int how, const sigset_t* set, sigset_t& out)
+{
+    if (set == nullptr || how == SIG_UNBLOCK)
+        return set;
+
+    out = *set;
+    sigdelset(&out, SIGSEGV);
+    return &out;
+}
+
+extern "C" __attribute__((visibility("default"))) int sigprocmask(
+    int how, const sigset_t* set, sigset_t* oldset)
+{
+    using Sigprocmask = int (*)(int, const sigset_t*, sigset_t*);
+    static const auto next = reinterpret_cast<Sigprocmask>(
+        dlsym(RTLD_NEXT, "sigprocmask"));
+
+    sigset_t allowed;
+    return next(how, AllowFaults(how, set, allowed), oldset);
+}
+
+extern "C" __attribute__((visibility("default"))) int pthread_sigmask(
+    int how, const sigset_t* set, sigset_t* oldset)
+{
+    using PthreadSigmask = int (*)(int, const sigset_t*, sigset_t*);
+    static const auto next = reinterpret_cast<PthreadSigmask>(
+        dlsym(RTLD_NEXT, "pthread_sigmask"));
+
+    sigset_t allowed;
+    return next(how, AllowFaults(how, set, allowed), oldset);
+}
+
+__attribute__((constructor)) static void OnLoad()
+{
+    Startup();
+
+    // Unlike DLL injection the runtime is loaded by the thread that runs
+    // the program, so it gets a context as well.
+    ThreadContext::Attach();
+}
+
+__attribute__((destructor)) static void OnUnload()
+{
+    Shutdown();
+}
+
+#endif
@@ -1,8 +1,18 @@
 #include "Memory.h"
+#include "Platform.h"
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
 
 namespace CovCane {
 
+#ifdef _WIN32
+
 bool Memory::SafeRead(uintptr_t addr, void* dest, size_t len)
 {
     size_t bytesRead = 0;
@@ -29,4 +39,79 @@ bool Memory::SafeWrite(uintptr_t addr, const void* src, size_t len)
     return bytesWritten == len;
 }
 
+void* Memory::AllocatePages(size_t len)
+{
+    return VirtualAlloc(nullptr, len, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+}
+
+void Memory::FreePages(void* addr, size_t len)
+{
+    if (addr != nullptr)
+        VirtualFree(addr, 0, MEM_RELEASE);
+}
+
+void* Memory::ReservePages(size_t len)
+{
+    return VirtualAlloc(nullptr, len, MEM_RESERVE, PAGE_NOACCESS);
+}
+
+bool Memory::CommitPages(void* addr, size_t len)
+{
+    return VirtualAlloc(addr, len, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+}
+
+#else
+
+// process_vm_readv fails with EFAULT on unmapped memory instead of raising
+// SIGSEGV, like ReadProcessMemory does.
+bool Memory::SafeRead(uintptr_t addr, void* dest, size_t len)
+{
+    iovec local{ dest, len };
+    iovec remote{ reinterpret_cast<void*>(addr), len };
+
+    const ssize_t bytesRead = process_vm_readv(
+        getpid(), &local, 1, &remote, 1, 0);
+    return bytesRead == static_cast<ssize_t>(len);
+}
+
+// Writes through /proc/self/mem ignore the page protection, which matches
+// WriteProcessMemory.
+bool Memory::SafeWrite(uintptr_t addr, const void* src, size_t len)
+{
+    const int fd = open("/proc/self/mem", O_RDWR | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+
+    const ssize_t bytesWritten = pwrite(fd, src, len, off_t(addr));
+    close(fd);
+    return bytesWritten == static_cast<ssize_t>(len);
+}
+
+void* Memory::AllocatePages(size_t len)
+{
+    void* res = Platform::MapPages(
+        nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS);
+    return res != MAP_FAILED ? res : nullptr;
+}
+
+void Memory::FreePages(void* addr, size_t len)
+{
+    if (addr != nullptr)
+        Platform::UnmapPages(addr, len);
+}
+
+void* Memory::ReservePages(size_t len)
+{
+    void* res = Platform::MapPages(
+        nullptr, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE);
+    return res != MAP_FAILED ? res : nullptr;
+}
+
+bool Memory::CommitPages(void* addr, size_t len)
+{
+    return Platform::ProtectPages(addr, len, PROT_READ | PROT_WRITE) == 0;
+}
+
+#endif
+
 } // namespace CovCane
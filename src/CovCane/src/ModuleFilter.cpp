@@ -0,0 +1,106 @@
+#include "ModuleFilter.h"
+#include "Config.h"
+#include "Location.h"
+
+#include <ctype.h>
+#include <string.h>
+
+namespace CovCane {
+
+// Libraries the runtime itself calls into while handling a fault, they can
+// not run translated.
+static const char* const _runtimeModules[] = {
+#ifdef _WIN32
+    "ntdll.dll",    "kernel32.dll",  "kernelbase.dll", "ucrtbase*.dll",
+    "vcruntime*.dll", "msvcp*.dll",  "dbghelp.dll",    "CovCane.dll",
+    "Zydis.dll",    "Zycore.dll",    "asmjit.dll",
+#else
+    "ld-linux*",     "linux-vdso.so*", "libc.so*",   "libc-*.so",
+    "libm.so*",      "libm-*.so",      "libdl.so*",  "libpthread.so*",
+    "librt.so*",     "libstdc++.so*",  "libgcc_s.so*", "libCovCane.so*",
+    "libZydis.so*",  "libZycore.so*",  "libasmjit.so*",
+#endif
+};
+
+static bool EqualChar(char a, char b)
+{
+#ifdef _WIN32
+    return tolower(static_cast<unsigned char>(a))
+           == tolower(static_cast<unsigned char>(b));
+#else
+    return a == b;
+#endif
+}
+
+static bool HasSeparator(const char* str)
+{
+    return strchr(str, '/') != nullptr || strchr(str, '\\') != nullptr;
+}
+
+bool ModuleFilter::MatchGlob(const char* pattern, const char* str)
+{
+    // Backtracks to the last star only, enough for globs without classes.
+    const char* star = nullptr;
+    const char* resume = nullptr;
+    while (*str != '\0')
+    {
+        if (*pattern == '*')
+        {
+            star = pattern++;
+            resume = str;
+        }
+        else if (
+            *pattern == '?'
+            || (*pattern != '\0' && EqualChar(*pattern, *str)))
+        {
+            pattern++;
+            str++;
+        }
+        else if (star != nullptr)
+        {
+            pattern = star + 1;
+            str = ++resume;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    while (*pattern == '*')
+        pattern++;
+    return *pattern == '\0';
+}
+
+bool ModuleFilter::MatchAny(
+    const std::vector<std::string>& patterns, const char* path)
+{
+    const char* fileName = Location::GetFileName(path);
+    for (auto& pattern : patterns)
+    {
+        const char* subject = HasSeparator(pattern.c_str()) ? path : fileName;
+        if (MatchGlob(pattern.c_str(), subject))
+            return true;
+    }
+    return false;
+}
+
+bool ModuleFilter::IsIncluded(const char* path, bool mainModule)
+{
+    const char* fileName = Location::GetFileName(path);
+    for (const char* pattern : _runtimeModules)
+    {
+        if (MatchGlob(pattern, fileName))
+            return false;
+    }
+
+    const Config::Options& opts = Config::Get();
+    if (MatchAny(opts.moduleExclude, path))
+        return false;
+
+    if (opts.moduleInclude.empty())
+        return mainModule;
+    return MatchAny(opts.moduleInclude, path);
+}
+
+} // namespace CovCane
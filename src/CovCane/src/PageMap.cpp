@@ -0,0 +1,84 @@
+#include "PageMap.h"
+
+#include <stdlib.h>
+
+namespace CovCane {
+
+PageMap::~PageMap()
+{
+    Leaf* leaves = _leaves.load(std::memory_order_relaxed);
+    if (leaves == nullptr)
+        return;
+
+    for (size_t i = 0; i < LeafCount; i++)
+    {
+        free(leaves[i].load(std::memory_order_relaxed));
+    }
+    free(leaves);
+}
+
+bool PageMap::Add(uintptr_t start, uintptr_t end)
+{
+    if (start >= end || uint64_t(end - 1) >> AddressBits != 0)
+        return false;
+
+    // Large zeroed allocations come straight from the OS, the untouched
+    // parts of the top level and the leaves cost no memory. Zeroed memory
+    // is a valid array of null atomic pointers.
+    Leaf* leaves = _leaves.load(std::memory_order_relaxed);
+    if (leaves == nullptr)
+    {
+        leaves = static_cast<Leaf*>(calloc(LeafCount, sizeof(Leaf)));
+        if (leaves == nullptr)
+            return false;
+        _leaves.store(leaves, std::memory_order_release);
+    }
+
+    const uintptr_t firstPage = start >> PageShift;
+    const uintptr_t lastPage = (end - 1) >> PageShift;
+    for (uintptr_t page = firstPage; page <= lastPage; page++)
+    {
+        uint64_t* leaf = leaves[page / LeafPages].load(
+            std::memory_order_relaxed);
+        if (leaf == nullptr)
+        {
+            // Published only once zeroed, a concurrent lookup sees either
+            // no leaf or a valid one.
+            leaf = static_cast<uint64_t*>(
+                calloc(LeafWords, sizeof(uint64_t)));
+            if (leaf == nullptr)
+                return false;
+            leaves[page / LeafPages].store(leaf, std::memory_order_release);
+        }
+
+        const uintptr_t bit = page % LeafPages;
+        leaf[bit / 64] |= uint64_t(1) << (bit % 64);
+    }
+
+    return true;
+}
+
+void PageMap::Remove(uintptr_t start, uintptr_t end)
+{
+    Leaf* leaves = _leaves.load(std::memory_order_relaxed);
+    if (leaves == nullptr || start >= end
+        || uint64_t(end - 1) >> AddressBits != 0)
+    {
+        return;
+    }
+
+    const uintptr_t firstPage = start >> PageShift;
+    const uintptr_t lastPage = (end - 1) >> PageShift;
+    for (uintptr_t page = firstPage; page <= lastPage; page++)
+    {
+        uint64_t* leaf = leaves[page / LeafPages].load(
+            std::memory_order_relaxed);
+        if (leaf == nullptr)
+            continue;
+
+        const uintptr_t bit = page % LeafPages;
+        leaf[bit / 64] &= ~(uint64_t(1) << (bit % 64));
+    }
+}
+
+} // namespace CovCane
@@ -0,0 +1,96 @@
+#include "Persistent.h"
+#include "Coverage.h"
+#include "CoverageMap.h"
+#include "Logging.h"
+
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+namespace CovCane {
+
+static CovCane_PersistentTarget _target = nullptr;
+
+// Hit count buckets seen by any iteration so far.
+static std::vector<uint8_t> _virgin;
+static std::mutex _lock;
+
+void Persistent::SetTarget(CovCane_PersistentTarget target)
+{
+    _target = target;
+    Logging::Msg("Persistent target: %p", (void*)target);
+}
+
+bool Persistent::Run(
+    CovCane_InputCallback nextInput,
+    CovCane_ResultCallback onResult,
+    void* user,
+    uint64_t maxIterations,
+    CovCane_PersistentStats* stats)
+{
+    if (_target == nullptr || nextInput == nullptr)
+    {
+        Logging::Msg("Persistent loop requires a target and an input callback");
+        return false;
+    }
+
+    // Only one loop can own the virgin map at a time.
+    std::lock_guard<std::mutex> lock(_lock);
+
+    const size_t mapSize = Coverage::GetMapSize();
+    uint8_t* map = Coverage::GetThreadMap();
+    if (map == nullptr)
+    {
+        Logging::Msg("Persistent loop runs without coverage, set COVCANE_MAP");
+    }
+    else
+    {
+        _virgin.resize(mapSize);
+
+        // Drop whatever the setup code before the loop hit.
+        CoverageMap::Reset(map, mapSize);
+    }
+
+    CovCane_PersistentStats res{};
+
+    auto start = std::chrono::steady_clock::now();
+    while (maxIterations == 0 || res.executions < maxIterations)
+    {
+        const uint8_t* data = nullptr;
+        size_t size = 0;
+        if (nextInput(user, &data, &size) == 0)
+            break;
+
+        // The first call translates the target, every later call runs
+        // straight from the code cache.
+        const int result = _target(data, size);
+        res.executions++;
+
+        size_t newEntries = 0;
+        if (map != nullptr)
+            newEntries = CoverageMap::Collect(map, mapSize, _virgin.data());
+
+        if (newEntries != 0)
+            res.newCoverage++;
+
+        if (onResult != nullptr)
+            onResult(user, data, size, result, newEntries);
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    res.elapsedSeconds = std::chrono::duration<double>(end - start).count();
+
+    Logging::Msg(
+        "Persistent loop: %llu executions, %llu with new coverage, %.0f "
+        "exec/s",
+        (unsigned long long)res.executions,
+        (unsigned long long)res.newCoverage,
+        res.elapsedSeconds > 0.0 ? res.executions / res.elapsedSeconds : 0.0);
+
+    if (stats != nullptr)
+        *stats = res;
+
+    return true;
+}
+
+} // namespace CovCane
@@ -0,0 +1,88 @@
+#include "Profiler.h"
+#include "Coverage.h"
+#include "Location.h"
+#include "Logging.h"
+#include "Platform.h"
+
+#include <algorithm>
+#include <cstdio>
+
+namespace CovCane {
+
+struct ProfileEntry
+{
+    const Coverage::Block* block;
+    uint64_t hits;
+};
+
+bool Profiler::WriteReport(const char* outputFile)
+{
+    const auto modules = Coverage::GetModules();
+    const auto blocks = Coverage::GetBlocks();
+    const auto hitCounts = Coverage::GetHitCounts();
+
+    // Snapshot the counters once so the sort sees stable values.
+    std::vector<ProfileEntry> entries;
+    entries.reserve(blocks.size());
+
+    uint64_t totalHits = 0;
+    for (auto& block : blocks)
+    {
+        const uint64_t hits = block.id < hitCounts.size() ? hitCounts[block.id]
+                                                           : 0;
+        entries.push_back({ &block, hits });
+        totalHits += hits;
+    }
+
+    std::sort(
+        entries.begin(), entries.end(),
+        [](const ProfileEntry& a, const ProfileEntry& b) {
+            if (a.hits != b.hits)
+                return a.hits > b.hits;
+            return a.block->sourceVA < b.block->sourceVA;
+        });
+
+    FILE* fp = Platform::OpenFile(outputFile, "wt");
+    if (fp == nullptr)
+    {
+        Logging::Msg("Unable to open profile output: %s", outputFile);
+        return false;
+    }
+
+    fprintf(
+        fp, "# Blocks: %zu, Hits: %llu\n", entries.size(),
+        (unsigned long long)totalHits);
+    fprintf(
+        fp, "# %-6s %-16s %-16s %-40s %-6s %-6s %s\n", "rank", "hits", "va",
+        "module+offset", "size", "jit", "ratio");
+
+    size_t rank = 0;
+    for (auto& entry : entries)
+    {
+        const Coverage::Block& block = *entry.block;
+
+        char location[64];
+        Location::Format(
+            location, sizeof(location),
+            block.moduleId < modules.size() ? &modules[block.moduleId]
+                                            : nullptr,
+            block.sourceVA);
+
+        const double ratio = block.sourceSize != 0
+                                 ? double(block.targetSize) / block.sourceSize
+                                 : 0.0;
+
+        fprintf(
+            fp, "  %-6zu %-16llu %016llx %-40s %-6u %-6u %.2f\n", rank++,
+            (unsigned long long)entry.hits, (unsigned long long)block.sourceVA,
+            location, block.sourceSize, block.targetSize, ratio);
+    }
+
+    fclose(fp);
+
+    Logging::Msg("Wrote profile of %zu blocks to %s", entries.size(), outputFile);
+
+    return true;
+}
+
+} // namespace CovCane
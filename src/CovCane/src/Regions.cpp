@@ -0,0 +1,371 @@
+#include "Regions.h"
+#include "Config.h"
+#include "Logging.h"
+#include "ModuleFilter.h"
+#include "Platform.h"
+#include "Symbolizer.h"
+
+#include <algorithm>
+#include <mutex>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#ifdef _WIN32
+#include <windows.h>
+#include <dbghelp.h>
+#else
+#include <link.h>
+#endif
+
+namespace CovCane {
+
+enum class EntryKind
+{
+    // Absolute addresses, only useful without ASLR.
+    Address,
+    // Offsets from the module base.
+    Offset,
+    // Functions whose name matches a glob pattern.
+    Symbol,
+};
+
+struct Entry
+{
+    EntryKind kind;
+    std::string module;
+    std::string symbol;
+    uintptr_t start;
+    uintptr_t end;
+};
+
+constexpr uintptr_t PageSize = 0x1000;
+
+static std::vector<Entry> _entries;
+static bool _enabled = false;
+
+// The symbol handler of dbghelp is not thread safe.
+static std::mutex _lock;
+
+static bool ParseRange(const char* str, uintptr_t& start, uintptr_t& end)
+{
+    char* next = nullptr;
+    start = static_cast<uintptr_t>(strtoull(str, &next, 16));
+    if (next == str || *next != '-')
+        return false;
+
+    const char* endStr = next + 1;
+    end = static_cast<uintptr_t>(strtoull(endStr, &next, 16));
+    return next != endStr && start < end;
+}
+
+// Entries are one per line:
+//   0x401000-0x402000       absolute address range
+//   module+0x1000-0x1800    range relative to the module base
+//   module!name             functions matching name in the module
+//   name                    functions matching name in any module
+// Module and function names may contain '*' and '?'.
+static bool ParseEntry(const std::string& line, Entry& entry)
+{
+    entry = {};
+
+    const size_t bang = line.find('!');
+    const size_t plus = line.find("+0x");
+    if (bang != std::string::npos)
+    {
+        entry.kind = EntryKind::Symbol;
+        entry.module = line.substr(0, bang);
+        entry.symbol = line.substr(bang + 1);
+        return !entry.module.empty() && !entry.symbol.empty();
+    }
+    if (plus != std::string::npos)
+    {
+        entry.kind = EntryKind::Offset;
+        entry.module = line.substr(0, plus);
+        return !entry.module.empty()
+               && ParseRange(line.c_str() + plus + 1, entry.start, entry.end);
+    }
+    if (line.compare(0, 2, "0x") == 0)
+    {
+        entry.kind = EntryKind::Address;
+        return ParseRange(line.c_str(), entry.start, entry.end);
+    }
+
+    entry.kind = EntryKind::Symbol;
+    entry.module = "*";
+    entry.symbol = line;
+    return true;
+}
+
+bool Regions::Initialize()
+{
+    const std::string& listFile = Config::Get().regionList;
+    if (listFile.empty())
+        return true;
+
+    FILE* fp = Platform::OpenFile(listFile.c_str(), "rt");
+    if (fp == nullptr)
+    {
+        Logging::Msg("Unable to open region list: %s", listFile.c_str());
+        return false;
+    }
+
+    char buf[512];
+    while (fgets(buf, sizeof(buf), fp) != nullptr)
+    {
+        std::string line = buf;
+        line.erase(0, line.find_first_not_of(" \t"));
+        line.erase(line.find_last_not_of(" \t\r\n") + 1);
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        Entry entry;
+        if (!ParseEntry(line, entry))
+        {
+            Logging::Msg("Invalid region: %s", line.c_str());
+            continue;
+        }
+        _entries.push_back(std::move(entry));
+    }
+
+    fclose(fp);
+
+    // An empty list still selects nothing, rather than everything.
+    _enabled = true;
+
+    Logging::Msg(
+        "Loaded %zu regions from %s", _entries.size(), listFile.c_str());
+
+    return true;
+}
+
+bool Regions::IsEnabled()
+{
+    return _enabled;
+}
+
+#ifdef _WIN32
+
+static BOOL CALLBACK OnSymbol(PSYMBOL_INFO info, ULONG size, PVOID user)
+{
+    auto& out = *static_cast<std::vector<Regions::Range>*>(user);
+
+    // Exports carry no size, their first page is selected at least.
+    const uintptr_t va = static_cast<uintptr_t>(info->Address);
+    out.push_back({ va, va + std::max<ULONG>(size, 1) });
+    return TRUE;
+}
+
+static void FindSymbols(
+    const char* path,
+    uintptr_t base,
+    uintptr_t end,
+    const std::vector<const std::string*>& patterns,
+    std::vector<Regions::Range>& out)
+{
+    if (!Symbolizer::Initialize())
+        return;
+
+    const HANDLE process = GetCurrentProcess();
+
+    // Modules loaded after SymInitialize are unknown to dbghelp until they
+    // are added explicitly, already known ones are left as they are.
+    SymLoadModuleEx(
+        process, nullptr, path, nullptr, base, static_cast<DWORD>(end - base),
+        nullptr, 0);
+
+    for (const std::string* pattern : patterns)
+    {
+        if (!SymEnumSymbols(process, base, pattern->c_str(), OnSymbol, &out))
+        {
+            Logging::Msg(
+                "SymEnumSymbols(%s) failed: 0x%08X", pattern->c_str(),
+                GetLastError());
+        }
+    }
+}
+
+#else
+
+template<typename T>
+static bool ReadAt(FILE* fp, uint64_t offset, T* out, size_t count)
+{
+    return fseek(fp, static_cast<long>(offset), SEEK_SET) == 0
+           && fread(out, sizeof(T), count, fp) == count;
+}
+
+// Reads the function symbols from the file on disk, the static symbol table
+// is not mapped and the dynamic one lacks local functions.
+static void FindSymbols(
+    const char* path,
+    uintptr_t base,
+    uintptr_t,
+    const std::vector<const std::string*>& patterns,
+    std::vector<Regions::Range>& out)
+{
+    FILE* fp = Platform::OpenFile(path, "rb");
+    if (fp == nullptr)
+    {
+        Logging::Msg("Unable to open %s for symbols", path);
+        return;
+    }
+
+    ElfW(Ehdr) ehdr{};
+    std::vector<ElfW(Phdr)> phdrs;
+    std::vector<ElfW(Shdr)> shdrs;
+    if (!ReadAt(fp, 0, &ehdr, 1)
+        || memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0
+        || ehdr.e_ident[EI_CLASS] != ELFCLASS64)
+    {
+        Logging::Msg("Not an ELF64 file: %s", path);
+        fclose(fp);
+        return;
+    }
+
+    phdrs.resize(ehdr.e_phnum);
+    shdrs.resize(ehdr.e_shnum);
+    if (!ReadAt(fp, ehdr.e_phoff, phdrs.data(), phdrs.size())
+        || !ReadAt(fp, ehdr.e_shoff, shdrs.data(), shdrs.size()))
+    {
+        Logging::Msg("Unable to read the headers of %s", path);
+        fclose(fp);
+        return;
+    }
+
+    // The module base is the first loaded page, the symbol values are
+    // relative to the address the file was linked at.
+    uintptr_t linkBase = UINTPTR_MAX;
+    for (auto& phdr : phdrs)
+    {
+        if (phdr.p_type == PT_LOAD)
+            linkBase = std::min<uintptr_t>(linkBase, phdr.p_vaddr);
+    }
+    const uintptr_t bias = base - (linkBase & ~(PageSize - 1));
+
+    const ElfW(Shdr)* symtab = nullptr;
+    for (auto& shdr : shdrs)
+    {
+        if (shdr.sh_type == SHT_SYMTAB)
+            symtab = &shdr;
+        else if (shdr.sh_type == SHT_DYNSYM && symtab == nullptr)
+            symtab = &shdr;
+    }
+    if (symtab == nullptr || symtab->sh_link >= shdrs.size())
+    {
+        Logging::Msg("No symbol table in %s", path);
+        fclose(fp);
+        return;
+    }
+
+    const ElfW(Shdr)& strtab = shdrs[symtab->sh_link];
+    std::vector<ElfW(Sym)> syms(symtab->sh_size / sizeof(ElfW(Sym)));
+    std::vector<char> strs(strtab.sh_size + 1);
+    if (!ReadAt(fp, symtab->sh_offset, syms.data(), syms.size())
+        || !ReadAt(fp, strtab.sh_offset, strs.data(), strtab.sh_size))
+    {
+        Logging::Msg("Unable to read the symbols of %s", path);
+        fclose(fp);
+        return;
+    }
+    fclose(fp);
+
+    for (auto& sym : syms)
+    {
+        if (ELF64_ST_TYPE(sym.st_info) != STT_FUNC
+            || sym.st_shndx == SHN_UNDEF || sym.st_name >= strtab.sh_size)
+        {
+            continue;
+        }
+
+        const char* name = strs.data() + sym.st_name;
+        for (const std::string* pattern : patterns)
+        {
+            if (!ModuleFilter::MatchGlob(pattern->c_str(), name))
+                continue;
+
+            const uintptr_t va = bias + sym.st_value;
+            out.push_back({ va, va + std::max<uintptr_t>(sym.st_size, 1) });
+            break;
+        }
+    }
+}
+
+#endif
+
+std::vector<Regions::Range> Regions::Resolve(
+    const char* path, uintptr_t base, uintptr_t end)
+{
+    std::vector<Range> res;
+
+    std::vector<const std::string*> symbols;
+    for (auto& entry : _entries)
+    {
+        if (entry.kind == EntryKind::Address)
+        {
+            res.push_back({ entry.start, entry.end });
+            continue;
+        }
+
+        const std::vector<std::string> module{ entry.module };
+        if (!ModuleFilter::MatchAny(module, path))
+            continue;
+
+        if (entry.kind == EntryKind::Offset)
+            res.push_back({ base + entry.start, base + entry.end });
+        else
+            symbols.push_back(&entry.symbol);
+    }
+
+    if (!symbols.empty())
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        FindSymbols(path, base, end, symbols, res);
+    }
+
+    // Clip to the module and widen to whole pages, then merge neighbours.
+    for (auto& range : res)
+    {
+        range.start = std::max(range.start, base) & ~(PageSize - 1);
+        range.end = (std::min(range.end, end) + PageSize - 1)
+                    & ~(PageSize - 1);
+    }
+    res.erase(
+        std::remove_if(
+            res.begin(), res.end(),
+            [](const Range& range) { return range.start >= range.end; }),
+        res.end());
+    std::sort(res.begin(), res.end(), [](const Range& a, const Range& b) {
+        return a.start < b.start;
+    });
+
+    std::vector<Range> merged;
+    for (auto& range : res)
+    {
+        if (!merged.empty() && range.start <= merged.back().end)
+            merged.back().end = std::max(merged.back().end, range.end);
+        else
+            merged.push_back(range);
+    }
+
+    Logging::Msg("Selected %zu regions in %s", merged.size(), path);
+
+    return merged;
+}
+
+std::vector<Regions::Range> Regions::SelectPages(
+    const std::vector<Range>& selected, uintptr_t startVA, uintptr_t endVA)
+{
+    if (!_enabled)
+        return { { startVA, endVA } };
+
+    std::vector<Range> res;
+    for (auto& range : selected)
+    {
+        const uintptr_t start = std::max(range.start, startVA);
+        const uintptr_t end = std::min(range.end, endVA);
+        if (start < end)
+            res.push_back({ start, end });
+    }
+    return res;
+}
+
+} // namespace CovCane
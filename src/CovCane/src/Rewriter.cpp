@@ -1,8 +1,18 @@
 #include "Rewriter.h"
+#include "BranchCoverage.h"
 #include "Logging.h"
 #include "Translation.h"
 #include "Runtime.h"
-
+#include "Coverage.h"
+#include "Events.h"
+#include "Instrumentation.h"
+#include "InstructionCoverage.h"
+#include "Memory.h"
+#include "SharedMap.h"
+
+#include <algorithm>
+#include <iterator>
+#include <map>
 #include <unordered_map>
 #include <mutex>
 
@@ -11,6 +21,11 @@ namespace CovCane {
 static Runtime _jitRT;
 static std::unordered_map<uintptr_t, uintptr_t> _sourceToTarget;
 static std::unordered_map<uintptr_t, uintptr_t> _targetToSource;
+
+// End of the original instructions of every translation, ordered to find the
+// blocks overlapping a modified range.
+static std::map<uintptr_t, uintptr_t> _sourceEnds;
+static uintptr_t _maxSourceSize = 0;
 static std::mutex _lock;
 
 using DecodedBranch = std::vector<ZydisDecodedInstruction>;
@@ -27,9 +42,91 @@ static void PrintBranchInstructions(const DecodedBranch& decoded)
     }
 }
 
-bool Rewriter::CreateSectionBuffer(uintptr_t startVA, uintptr_t endVA)
+bool Rewriter::ReserveCodeCache(
+    uintptr_t startVA, uintptr_t endVA, size_t codeSize)
+{
+    // Modules are added while other threads translate.
+    std::lock_guard<std::mutex> lock(_lock);
+    return _jitRT.reserveRegion(startVA, endVA, codeSize);
+}
+
+bool Rewriter::ShareCodeCache(uintptr_t startVA, uintptr_t endVA)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    return _jitRT.shareRegion(startVA, endVA);
+}
+
+// Removes every translation whose source overlaps [startVA, endVA), the
+// caller holds the lock. The code stays in the cache until its range is
+// released.
+static size_t RemoveTranslations(uintptr_t startVA, uintptr_t endVA)
+{
+    size_t removed = 0;
+    auto it = _sourceEnds.lower_bound(
+        startVA - std::min(startVA, _maxSourceSize));
+    while (it != _sourceEnds.end() && it->first < endVA)
+    {
+        if (it->second <= startVA)
+        {
+            ++it;
+            continue;
+        }
+
+        auto itTarget = _sourceToTarget.find(it->first);
+        if (itTarget != _sourceToTarget.end())
+        {
+            _targetToSource.erase(itTarget->second);
+            if (InstructionCoverage::IsEnabled())
+                InstructionCoverage::RemoveBlock(itTarget->second);
+            _sourceToTarget.erase(itTarget);
+            removed++;
+        }
+
+        it = _sourceEnds.erase(it);
+    }
+    return removed;
+}
+
+size_t Rewriter::RemoveModule(uintptr_t startVA, uintptr_t endVA)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+
+    const size_t removed = RemoveTranslations(startVA, endVA);
+
+    if (BranchCoverage::IsEnabled())
+        BranchCoverage::RemoveSites(startVA, endVA);
+
+    const size_t released = _jitRT.releaseRegions(startVA, endVA);
+    Logging::Msg(
+        "Removed %zu translations of %p - %p, released %zu bytes", removed,
+        (void*)startVA, (void*)endVA, released);
+
+    return removed;
+}
+
+size_t Rewriter::Invalidate(uintptr_t startVA, uintptr_t endVA)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+
+    const size_t removed = RemoveTranslations(startVA, endVA);
+    if constexpr (Logging::LoggingEnabled)
+    {
+        if (removed != 0)
+        {
+            Logging::Msg(
+                "Invalidated %zu translations of %p - %p", removed,
+                (void*)startVA, (void*)endVA);
+        }
+    }
+    return removed;
+}
+
+uintptr_t Rewriter::GetSourceEnd(uintptr_t sourceVA)
 {
-    return _jitRT.createBuffer(startVA, endVA) != nullptr;
+    std::lock_guard<std::mutex> lock(_lock);
+
+    auto it = _sourceEnds.find(sourceVA);
+    return it != _sourceEnds.end() ? it->second : 0;
 }
 
 static bool IsDirectCondControlFlow(const ZydisDecodedInstruction& ins)
@@ -91,19 +188,24 @@ static bool IsBranchTerminal(const ZydisDecodedInstruction& ins)
     return false;
 }
 
-static DecodedBranch DecodeBranch(
-    uintptr_t source, bool rewrittenBranch = false)
+static void InitDecoder(ZydisDecoder& decoder)
 {
-    DecodedBranch decoded;
-
-    ZydisDecoder decoder;
-#ifdef _M_X64
+#if defined(_M_X64) || defined(__x86_64__)
     ZydisDecoderInit(
         &decoder, ZYDIS_MACHINE_MODE_LONG_64, ZYDIS_ADDRESS_WIDTH_64);
 #else
     ZydisDecoderInit(
         &decoder, ZYDIS_MACHINE_MODE_LONG_COMPAT_32, ZYDIS_ADDRESS_WIDTH_32);
 #endif
+}
+
+static DecodedBranch DecodeBranch(
+    uintptr_t source, bool rewrittenBranch = false)
+{
+    DecodedBranch decoded;
+
+    ZydisDecoder decoder;
+    InitDecoder(decoder);
 
     bool hasPushRax = false;
     bool hasMov = false;
@@ -196,6 +298,130 @@ static DecodedBranch DecodeBranch(
     return decoded;
 }
 
+// Conditional branches that get direction probes. The rcx and mask register
+// forms only have a short encoding that can not reach an out of line stub.
+static bool HasBranchDirections(const ZydisDecodedInstruction& ins)
+{
+    switch (ins.mnemonic)
+    {
+        case ZYDIS_MNEMONIC_JCXZ:
+        case ZYDIS_MNEMONIC_JECXZ:
+        case ZYDIS_MNEMONIC_JRCXZ:
+        case ZYDIS_MNEMONIC_JKNZD:
+        case ZYDIS_MNEMONIC_JKZD:
+            return false;
+    }
+    return IsDirectCondControlFlow(ins)
+           && ins.operands[0].type == ZYDIS_OPERAND_TYPE_IMMEDIATE;
+}
+
+// The status flags a branch probe clobbers.
+static const ZydisCPUFlag StatusFlags[] = {
+    ZYDIS_CPUFLAG_CF, ZYDIS_CPUFLAG_PF, ZYDIS_CPUFLAG_AF,
+    ZYDIS_CPUFLAG_ZF, ZYDIS_CPUFLAG_SF, ZYDIS_CPUFLAG_OF,
+};
+
+// Instructions followed from a branch exit before the flags are assumed live.
+constexpr int MaxFlagScan = 8;
+
+// Returns false if the straight line code at va writes every status flag
+// before reading any, anything else is treated as live.
+static bool AreFlagsLive(uintptr_t va)
+{
+    ZydisDecoder decoder;
+    InitDecoder(decoder);
+
+    constexpr uint32_t allWritten = (1u << std::size(StatusFlags)) - 1;
+    uint32_t written = 0;
+
+    for (int n = 0; n < MaxFlagScan; n++)
+    {
+        uint8_t buf[16]{};
+        if (!Memory::SafeRead(va, buf, sizeof(buf)))
+            return true;
+
+        ZydisDecodedInstruction ins;
+        if (ZydisDecoderDecodeBuffer(&decoder, buf, sizeof(buf), va, &ins)
+            != ZYDIS_STATUS_SUCCESS)
+            return true;
+
+        for (size_t i = 0; i < std::size(StatusFlags); i++)
+        {
+            if (written & (1u << i))
+                continue;
+
+            switch (ins.accessedFlags[StatusFlags[i]].action)
+            {
+                case ZYDIS_CPUFLAG_ACTION_TESTED:
+                case ZYDIS_CPUFLAG_ACTION_TESTED_MODIFIED:
+                    return true;
+                case ZYDIS_CPUFLAG_ACTION_MODIFIED:
+                case ZYDIS_CPUFLAG_ACTION_SET_0:
+                case ZYDIS_CPUFLAG_ACTION_SET_1:
+                case ZYDIS_CPUFLAG_ACTION_UNDEFINED:
+                    written |= 1u << i;
+                    break;
+            }
+        }
+
+        if (written == allWritten)
+            return false;
+
+        if (IsDirectCondControlFlow(ins) || IsBranchTerminal(ins))
+            return true;
+
+        va += ins.length;
+    }
+
+    return true;
+}
+
+// Out of line exit of a conditional branch, records the taken direction and
+// continues at the original target.
+struct TakenStub
+{
+    asmjit::Label label;
+    uint32_t siteId;
+    uintptr_t targetVA;
+    bool saveFlags;
+};
+
+// Emits the branch to a stub for the taken direction and records the not
+// taken direction inline. Returns false if the branch has no site.
+static bool EmitBranchDirections(
+    asmjit::x86::Assembler& cb,
+    const ZydisDecodedInstruction& ins,
+    std::vector<TakenStub>& stubs)
+{
+    uintptr_t targetVA = 0;
+    if (ZydisCalcAbsoluteAddress(&ins, &ins.operands[0], &targetVA)
+        != ZYDIS_STATUS_SUCCESS)
+        return false;
+
+    const uintptr_t fallthroughVA = ins.instrAddress + ins.length;
+    const uint32_t siteId = BranchCoverage::AddSite(
+        ins.instrAddress, targetVA, fallthroughVA);
+    if (siteId == Coverage::InvalidId)
+        return false;
+
+    TakenStub& stub = stubs.emplace_back();
+    stub.label = cb.newLabel();
+    stub.siteId = siteId;
+    stub.targetVA = targetVA;
+    stub.saveFlags = AreFlagsLive(targetVA);
+
+    if (!Translation::convertConditionalBranch(ins, cb, stub.label))
+    {
+        stubs.pop_back();
+        return false;
+    }
+
+    Instrumentation::EmitBranchProbe(
+        cb, siteId, BranchCoverage::NotTaken, AreFlagsLive(fallthroughVA));
+
+    return true;
+}
+
 class AsmJitErrorHandler : public asmjit::ErrorHandler
 {
 public:
@@ -244,10 +470,41 @@ uintptr_t Rewriter::ProcessBranch(uintptr_t source)
 
     asmjit::x86::Assembler assembler(&code);
 
+    uintptr_t sourceEndVA = source;
+    if (!decodedBranch.empty())
+    {
+        auto& lastIns = decodedBranch.back();
+        sourceEndVA = lastIns.instrAddress + lastIns.length;
+    }
+
+    const uint32_t blockId = Coverage::AddBlock(
+        source, static_cast<uint32_t>(sourceEndVA - source));
+
+    Instrumentation::EmitBlockProbe(assembler, blockId);
+
+    // Size of the probe in front of the translated instructions.
+    const size_t probeSize = assembler.offset();
+
     uintptr_t endVA = 0;
 
+    std::vector<TakenStub> takenStubs;
+
+    const bool callContext = Instrumentation::HasCallContext();
+
+    // Boundaries of the translated instructions, the decoded branch already
+    // has the source side.
+    const bool recordInstructions = InstructionCoverage::IsEnabled();
+    std::vector<InstructionCoverage::Instruction> instructions;
+
     for (auto& ins : decodedBranch)
     {
+        if (recordInstructions)
+        {
+            instructions.push_back(
+                { static_cast<uint32_t>(assembler.offset()), ins.length,
+                  IsDirectCondControlFlow(ins) });
+        }
+
         // Redirects control flow to already rewritten branches.
         // May cause issues on x64 with exceptions but improves overall
         // performance.
@@ -277,6 +534,23 @@ uintptr_t Rewriter::ProcessBranch(uintptr_t source)
             }
         }
 
+        if (callContext && ins.mnemonic == ZYDIS_MNEMONIC_CALL)
+        {
+            Instrumentation::EmitCallContext(
+                assembler, ins.instrAddress + ins.length);
+        }
+        else if (callContext && ins.mnemonic == ZYDIS_MNEMONIC_RET)
+        {
+            Instrumentation::EmitReturnContext(assembler);
+        }
+
+        if (BranchCoverage::IsEnabled() && HasBranchDirections(ins)
+            && EmitBranchDirections(assembler, ins, takenStubs))
+        {
+            endVA = ins.instrAddress + ins.length;
+            continue;
+        }
+
         if (!Translation::convertInstruction(ins, assembler))
         {
             Logging::Msg(
@@ -289,6 +563,14 @@ uintptr_t Rewriter::ProcessBranch(uintptr_t source)
     // Append jump back to end of branch at original VA.
     assembler.jmp(endVA);
 
+    for (auto& stub : takenStubs)
+    {
+        assembler.bind(stub.label);
+        Instrumentation::EmitBranchProbe(
+            assembler, stub.siteId, BranchCoverage::Taken, stub.saveFlags);
+        assembler.jmp(stub.targetVA);
+    }
+
     void* fn = nullptr;
     asmjit::Error err = _jitRT.add(&fn, &code, source);
     if (err)
@@ -301,13 +583,31 @@ uintptr_t Rewriter::ProcessBranch(uintptr_t source)
     _sourceToTarget.emplace(source, destVA);
     _targetToSource.emplace(destVA, source);
 
-    // Validate output.
-    if constexpr (true)
+    // Empty blocks still cover their first byte.
+    const uintptr_t sourceEnd = std::max(sourceEndVA, source + 1);
+    _sourceEnds[source] = sourceEnd;
+    _maxSourceSize = std::max(_maxSourceSize, sourceEnd - source);
+
+    Coverage::CommitBlock(
+        blockId, destVA, static_cast<uint32_t>(code.codeSize()));
+    if (recordInstructions)
+    {
+        InstructionCoverage::AddBlock(
+            blockId, destVA, static_cast<uint32_t>(code.codeSize()),
+            std::move(instructions));
+    }
+    const bool sharedNew = SharedMap::AddBlock(blockId);
+    Events::AddBlock(blockId, sharedNew);
+
+    // Validate output, branch and call context probes are interleaved with
+    // the translated instructions so those blocks are skipped.
+    if (takenStubs.empty() && !callContext)
     {
         ZydisFormatter fmt;
         ZydisFormatterInit(&fmt, ZYDIS_FORMATTER_STYLE_INTEL);
 
-        DecodedBranch decodedRewrittenBranch = DecodeBranch(destVA, true);
+        DecodedBranch decodedRewrittenBranch = DecodeBranch(
+            destVA + probeSize, true);
 
         char bufferLeft[64]{};
         char bufferRight[64]{};
@@ -1,54 +1,175 @@
 #include <stdint.h>
 #include "Runtime.h"
 #include "Logging.h"
+#include "Platform.h"
+
+#include <algorithm>
+#include <limits>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+#endif
 
 namespace CovCane {
 
-static uint8_t* AllocateNearby(uintptr_t va, size_t len, uint32_t pageProtect)
+// Translations are larger than the code they come from, a reservation only
+// costs address space until it is committed.
+constexpr size_t ExpansionFactor = 4;
+constexpr size_t MinReservation = 1024 * 1024;
+constexpr size_t MaxReservation = 256 * 1024 * 1024;
+constexpr size_t CommitSize = 64 * 1024;
+
+// First shared reservation, generated code usually comes in small pieces.
+constexpr size_t SharedReservation = 64 * 1024;
+
+// Addresses a reservation may start at, the allocation granularity of
+// Windows.
+constexpr uintptr_t ReservationAlignment = 0x10000;
+
+// Every byte of a reservation has to stay within a rel32 of va.
+static bool IsNearby(uintptr_t va, uintptr_t base, size_t len)
 {
-    SYSTEM_INFO sysInfo{};
-    GetSystemInfo(&sysInfo);
+    const uintptr_t distance = base > va ? base + len - va : va - base;
+    return distance < static_cast<uintptr_t>(
+               std::numeric_limits<int32_t>::max());
+}
 
-    va = va + (~va & (sysInfo.dwPageSize - 1));
+#ifdef _WIN32
 
-    auto allocateNearbyDelta = [&](intptr_t delta) -> void* {
-        MEMORY_BASIC_INFORMATION mbi;
+static uint8_t* ReserveNearby(uintptr_t va, size_t len)
+{
+    auto reserveAt = [&](uintptr_t base) -> uint8_t* {
+        if (!IsNearby(va, base, len))
+            return nullptr;
+        return static_cast<uint8_t*>(VirtualAlloc(
+            reinterpret_cast<LPVOID>(base), len, MEM_RESERVE, PAGE_NOACCESS));
+    };
 
-        const intptr_t maxSize = std::numeric_limits<int32_t>::max();
-        intptr_t deltaSize = 0;
-        for (uintptr_t nearbyVA = va; deltaSize < maxSize;
-             nearbyVA += delta, deltaSize += std::abs(delta))
+    // Walks the free regions above va, a region at a time.
+    MEMORY_BASIC_INFORMATION mbi{};
+    uintptr_t addr = va;
+    while (IsNearby(va, addr, len)
+           && VirtualQuery(reinterpret_cast<LPCVOID>(addr), &mbi, sizeof(mbi))
+                  != 0)
+    {
+        const uintptr_t regionVA = reinterpret_cast<uintptr_t>(
+            mbi.BaseAddress);
+        const uintptr_t regionEndVA = regionVA + mbi.RegionSize;
+
+        const uintptr_t base = (regionVA + ReservationAlignment - 1)
+                               & ~(ReservationAlignment - 1);
+        if (mbi.State == MEM_FREE && base + len <= regionEndVA)
         {
-            if (!VirtualQuery(
-                    reinterpret_cast<LPCVOID>(nearbyVA), &mbi, sizeof(mbi)))
-                break;
+            if (uint8_t* res = reserveAt(base))
+                return res;
+        }
+        addr = regionEndVA;
+    }
 
-            if (mbi.State != MEM_FREE)
-                continue;
+    // Then below it, taking the top of each free region.
+    addr = va;
+    while (addr != 0 && IsNearby(va, addr, len)
+           && VirtualQuery(reinterpret_cast<LPCVOID>(addr), &mbi, sizeof(mbi))
+                  != 0)
+    {
+        const uintptr_t regionVA = reinterpret_cast<uintptr_t>(
+            mbi.BaseAddress);
+        const uintptr_t regionEndVA = regionVA + mbi.RegionSize;
 
-            uintptr_t baseVA = reinterpret_cast<uintptr_t>(mbi.BaseAddress);
-            baseVA -= (baseVA & 0xFFFF);
+        if (mbi.State == MEM_FREE && regionEndVA - regionVA >= len)
+        {
+            const uintptr_t base = (regionEndVA - len)
+                                   & ~(ReservationAlignment - 1);
+            if (base >= regionVA)
+            {
+                if (uint8_t* res = reserveAt(base))
+                    return res;
+            }
+        }
+        addr = regionVA != 0 ? regionVA - 1 : 0;
+    }
 
-            void* res = VirtualAlloc(
-                reinterpret_cast<LPVOID>(baseVA), len, MEM_RESERVE | MEM_COMMIT,
-                pageProtect);
-            if (res)
-                return res;
+    return nullptr;
+}
+
+static bool CommitPages(uintptr_t va, size_t len)
+{
+    return VirtualAlloc(
+               reinterpret_cast<LPVOID>(va), len, MEM_COMMIT,
+               PAGE_EXECUTE_READWRITE)
+           != nullptr;
+}
+
+static void FreeNearby(uintptr_t va, size_t)
+{
+    VirtualFree(reinterpret_cast<LPVOID>(va), 0, MEM_RELEASE);
+}
+
+#else
+
+static uint8_t* ReserveNearby(uintptr_t va, size_t len)
+{
+    auto reserveAt = [&](uintptr_t base) -> void* {
+        void* res = Platform::MapPages(
+            reinterpret_cast<void*>(base), len, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE
+                | MAP_FIXED_NOREPLACE);
+        if (res == MAP_FAILED)
+            return nullptr;
+
+        // Kernels before 4.17 take the address as a hint only.
+        if (res != reinterpret_cast<void*>(base))
+        {
+            Platform::UnmapPages(res, len);
+            return nullptr;
         }
-        return nullptr;
+        return res;
     };
 
-    const intptr_t pageSize = sysInfo.dwPageSize;
+    va = (va + ReservationAlignment - 1) & ~(ReservationAlignment - 1);
 
-    // Up
-    void* res = allocateNearbyDelta(+pageSize);
-    if (res)
-        return static_cast<uint8_t*>(res);
+    // The heap grows up from the end of the executable, so look below the
+    // image first. Stepping by the reservation size keeps the number of
+    // attempts low, occupied ranges fail with EEXIST.
+    const uintptr_t step = std::max<uintptr_t>(len, ReservationAlignment);
+    for (uintptr_t delta = step; delta <= va && IsNearby(va, va - delta, len);
+         delta += step)
+    {
+        if (void* res = reserveAt(va - delta))
+            return static_cast<uint8_t*>(res);
+    }
+
+    for (uintptr_t delta = 0; IsNearby(va, va + delta, len); delta += step)
+    {
+        if (void* res = reserveAt(va + delta))
+            return static_cast<uint8_t*>(res);
+    }
+
+    return nullptr;
+}
+
+static bool CommitPages(uintptr_t va, size_t len)
+{
+    return Platform::ProtectPages(
+               reinterpret_cast<void*>(va), len,
+               PROT_READ | PROT_WRITE | PROT_EXEC)
+           == 0;
+}
 
-    // Down
-    return static_cast<uint8_t*>(allocateNearbyDelta(-pageSize));
+static void FreeNearby(uintptr_t va, size_t len)
+{
+    Platform::UnmapPages(reinterpret_cast<void*>(va), len);
 }
 
+#endif
+
 Runtime::Runtime() noexcept
 {
     // Setup target properties.
@@ -60,54 +181,202 @@ Runtime::Runtime() noexcept
     _codeInfo._fastCallConv = asmjit::CallConv::kIdHostFastCall;
 }
 
-void* Runtime::alloc(size_t len, uintptr_t sourceVA)
+Runtime::Region* Runtime::findRegion(uintptr_t sourceVA)
 {
-    for (auto& buf : _buffers)
+    if (_lastRegion != nullptr && sourceVA >= _lastRegion->ownerStart
+        && sourceVA < _lastRegion->ownerEnd)
     {
-        size_t left = buf.end - buf.cur;
-        if (left >= len)
-        {
-            uint64_t distance = sourceVA > buf.cur ? sourceVA - buf.cur
-                                                   : buf.cur - sourceVA;
+        return _lastRegion;
+    }
 
-            // Make sure the distance is not more than 31 bit.
-            if (distance >= std::numeric_limits<int32_t>::max())
-                continue;
+    auto it = _regions.upper_bound(sourceVA);
+    if (it == _regions.begin())
+        return nullptr;
+    --it;
+    if (sourceVA >= it->second.ownerEnd)
+        return nullptr;
+
+    _lastRegion = &it->second;
+    return _lastRegion;
+}
+
+bool Runtime::addReservation(Region& region, uintptr_t va, size_t len)
+{
+    len = (len + ReservationAlignment - 1) & ~(ReservationAlignment - 1);
+
+    uint8_t* res = ReserveNearby(va, len);
+    if (res == nullptr)
+    {
+        Logging::Msg("Unable to reserve code cache near %p", (void*)va);
+        return false;
+    }
+
+    const uintptr_t base = reinterpret_cast<uintptr_t>(res);
+    region.reservations.push_back({ base, base + len, base, base, 0 });
+
+    Logging::Msg(
+        "Reserved code cache: %p - %p for %p - %p", (void*)base,
+        (void*)(base + len), (void*)region.ownerStart,
+        (void*)region.ownerEnd);
+    return true;
+}
+
+Runtime::Reservation* Runtime::findShared(uintptr_t sourceVA, size_t len)
+{
+    // Newest first, the older ones are mostly full.
+    for (auto it = _shared.rbegin(); it != _shared.rend(); ++it)
+    {
+        if (it->end - it->cur >= len && IsNearby(sourceVA, it->cur, len))
+            return &*it;
+    }
+
+    const size_t previous = _shared.empty()
+                                ? 0
+                                : _shared.back().end - _shared.back().base;
+    size_t size = std::clamp(
+        previous * 2, SharedReservation, MaxReservation);
+    size = (std::max(size, len) + ReservationAlignment - 1)
+           & ~(ReservationAlignment - 1);
+
+    uint8_t* res = ReserveNearby(sourceVA, size);
+    if (res == nullptr)
+    {
+        Logging::Msg("Unable to reserve code cache near %p", (void*)sourceVA);
+        return nullptr;
+    }
+
+    const uintptr_t base = reinterpret_cast<uintptr_t>(res);
+    _shared.push_back({ base, base + size, base, base, 0 });
 
-            void* res = reinterpret_cast<void*>(buf.cur);
-            buf.cur += len;
+    Logging::Msg(
+        "Reserved shared code cache: %p - %p", (void*)base,
+        (void*)(base + size));
+    return &_shared.back();
+}
 
-            return res;
+void* Runtime::take(Reservation& res, size_t len)
+{
+    const uintptr_t va = res.cur;
+    res.cur += len;
+
+    if (res.cur > res.committed)
+    {
+        const uintptr_t committedEnd = std::min(
+            (res.cur + CommitSize - 1) & ~(CommitSize - 1), res.end);
+        if (!CommitPages(res.committed, committedEnd - res.committed))
+        {
+            Logging::Msg(
+                "Unable to commit code cache at %p", (void*)res.committed);
+            res.cur = va;
+            return nullptr;
         }
+        res.committed = committedEnd;
+    }
+
+    return reinterpret_cast<void*>(va);
+}
+
+void* Runtime::allocShared(Region& region, size_t len, uintptr_t sourceVA)
+{
+    Reservation* res = findShared(sourceVA, len);
+    if (res == nullptr)
+        return nullptr;
+
+    auto& bases = region.sharedBases;
+    if (std::find(bases.begin(), bases.end(), res->base) == bases.end())
+    {
+        bases.push_back(res->base);
+        res->users++;
     }
 
-    // No buffer found, create a new one that is near sourceVA.
-    constexpr size_t BufferSize = (1024 * 1024);
+    return take(*res, len);
+}
+
+void* Runtime::alloc(size_t len, uintptr_t sourceVA)
+{
+    Region* region = findRegion(sourceVA);
+    if (region == nullptr)
+        return allocShared(_unowned, len, sourceVA);
+    if (region->shared)
+        return allocShared(*region, len, sourceVA);
+
+    // A full reservation, or one out of reach of the source in a very large
+    // module, is followed by another one of the same size.
+    Reservation* res = &region->reservations.back();
+    if (res->end - res->cur < len || !IsNearby(sourceVA, res->cur, len))
+    {
+        const size_t size = std::max<size_t>(res->end - res->base, len);
+        if (!addReservation(*region, sourceVA, size))
+            return nullptr;
+        res = &region->reservations.back();
+    }
+
+    return take(*res, len);
+}
+
+bool Runtime::reserveRegion(uintptr_t startVA, uintptr_t endVA, size_t codeSize)
+{
+    if (findRegion(startVA) != nullptr)
+        return true;
+
+    const size_t len = std::clamp(
+        codeSize * ExpansionFactor, MinReservation, MaxReservation);
 
-    uint8_t* res = AllocateNearby(sourceVA, BufferSize, PAGE_EXECUTE_READWRITE);
+    Region region{ startVA, endVA, {}, false, {} };
+    if (!addReservation(region, startVA, len))
+        return false;
 
-    Buffer& buf = _buffers.emplace_back();
-    buf.base = reinterpret_cast<uintptr_t>(res);
-    buf.cur = buf.base + len;
-    buf.end = buf.base + BufferSize;
+    _regions.emplace(startVA, std::move(region));
+    return true;
+}
+
+bool Runtime::shareRegion(uintptr_t startVA, uintptr_t endVA)
+{
+    if (findRegion(startVA) != nullptr)
+        return true;
 
-    return res;
+    _regions.emplace(startVA, Region{ startVA, endVA, {}, true, {} });
+    return true;
 }
 
-void* Runtime::createBuffer(uintptr_t startVA, uintptr_t endVA)
+size_t Runtime::releaseRegions(uintptr_t startVA, uintptr_t endVA)
 {
-    size_t len = endVA - startVA;
+    size_t released = 0;
+    auto it = _regions.lower_bound(startVA);
+    while (it != _regions.end() && it->first < endVA)
+    {
+        if (it->second.ownerEnd > endVA)
+        {
+            ++it;
+            continue;
+        }
 
-    uint8_t* res = AllocateNearby(startVA, len, PAGE_EXECUTE_READWRITE);
+        for (auto& res : it->second.reservations)
+        {
+            FreeNearby(res.base, res.end - res.base);
+            released += res.end - res.base;
+        }
+
+        // Shared reservations go once their last user is gone.
+        for (uintptr_t base : it->second.sharedBases)
+        {
+            auto res = std::find_if(
+                _shared.begin(), _shared.end(),
+                [&](const Reservation& entry) { return entry.base == base; });
+            if (res == _shared.end() || --res->users != 0)
+                continue;
 
-    Buffer& buf = _buffers.emplace_back();
-    buf.base = reinterpret_cast<uintptr_t>(res);
-    buf.cur = buf.base;
-    buf.end = buf.base + len;
+            FreeNearby(res->base, res->end - res->base);
+            released += res->end - res->base;
+            _shared.erase(res);
+        }
 
-    Logging::Msg("Created buffer: %p - %p", buf.base, buf.end);
+        if (_lastRegion == &it->second)
+            _lastRegion = nullptr;
+        it = _regions.erase(it);
+    }
 
-    return res;
+    return released;
 }
 
 asmjit::Error Runtime::_add(
@@ -133,7 +402,7 @@ asmjit::Error Runtime::_add(
     asmjit::Error err = code->relocateToBase(reinterpret_cast<uintptr_t>(rw));
     if (ASMJIT_UNLIKELY(err))
     {
-        VirtualFree(rw, estimatedCodeSize, MEM_FREE);
+        // The space belongs to a shared buffer and is not reused.
         return err;
     }
 
@@ -170,7 +439,14 @@ asmjit::Error Runtime::_release(void* p) noexcept
 
 void Runtime::flush(const void* p, size_t size) noexcept
 {
+#ifdef _WIN32
     ::FlushInstructionCache(GetCurrentProcess(), p, size);
+#else
+    // x86 keeps the instruction cache coherent, this only orders the stores.
+    const char* begin = static_cast<const char*>(p);
+    __builtin___clear_cache(
+        const_cast<char*>(begin), const_cast<char*>(begin) + size);
+#endif
 }
 
 } // namespace CovCane
@@ -0,0 +1,48 @@
+#include "SharedMap.h"
+#include "Config.h"
+#include "Coverage.h"
+#include "Logging.h"
+#include "CovCane/SharedCoverage.h"
+
+namespace CovCane {
+
+static SharedCoverage::Segment _segment;
+
+bool SharedMap::Initialize()
+{
+    const Config::Options& opts = Config::Get();
+    if (opts.sharedMap.empty())
+        return true;
+
+    if (!_segment.Create(opts.sharedMap.c_str(), opts.sharedMapBits))
+    {
+        Logging::Msg("Unable to attach shared map: %s", opts.sharedMap.c_str());
+        return false;
+    }
+
+    const SharedCoverage::Header* header = _segment.GetHeader();
+    Logging::Msg(
+        "Attached shared map %s, %llu bits, %llu blocks, process %llu",
+        opts.sharedMap.c_str(), (unsigned long long)header->mapBits,
+        (unsigned long long)header->coveredBlocks,
+        (unsigned long long)header->processes);
+
+    return true;
+}
+
+bool SharedMap::IsAttached()
+{
+    return _segment.IsOpen();
+}
+
+bool SharedMap::AddBlock(uint32_t blockId)
+{
+    if (!_segment.IsOpen())
+        return false;
+
+    // Blocks outside of registered modules have no stable key.
+    const uint64_t key = Coverage::GetBlockKey(blockId);
+    return key != 0 && _segment.Mark(key);
+}
+
+} // namespace CovCane
@@ -0,0 +1,54 @@
+#include "Symbolizer.h"
+#include "Logging.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <dbghelp.h>
+#endif
+
+namespace CovCane {
+
+#ifdef _WIN32
+
+static bool _initialized = false;
+
+bool Symbolizer::Initialize()
+{
+    if (_initialized)
+        return true;
+
+    SymSetOptions(SYMOPT_DEFERRED_LOADS | SYMOPT_UNDNAME);
+    if (!SymInitialize(GetCurrentProcess(), nullptr, TRUE))
+    {
+        Logging::Msg("SymInitialize failed: 0x%08X", GetLastError());
+        return false;
+    }
+
+    _initialized = true;
+    return true;
+}
+
+void Symbolizer::Shutdown()
+{
+    if (!_initialized)
+        return;
+
+    SymCleanup(GetCurrentProcess());
+    _initialized = false;
+}
+
+#else
+
+bool Symbolizer::Initialize()
+{
+    Logging::Msg("Symbols are not available on this platform");
+    return false;
+}
+
+void Symbolizer::Shutdown()
+{
+}
+
+#endif
+
+} // namespace CovCane
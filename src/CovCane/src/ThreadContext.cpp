@@ -0,0 +1,282 @@
+#include "ThreadContext.h"
+#include "Config.h"
+#include "Coverage.h"
+#include "CoverageMap.h"
+#include "Logging.h"
+#include "Memory.h"
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+namespace CovCane {
+
+#ifdef _WIN32
+
+// Offset of TlsSlots in the x64 TEB, only the first 64 slots live there.
+constexpr uint32_t TebTlsSlotsOffset = 0x1480;
+constexpr uint32_t TebTlsSlotsCount = 64;
+
+static DWORD _tlsIndex = TLS_OUT_OF_INDEXES;
+
+#else
+
+// Initial exec TLS sits at the same offset from the thread pointer in every
+// thread, so the translated code can address it through fs directly.
+static __thread ThreadContext::Context* _current
+    __attribute__((tls_model("initial-exec")));
+static intptr_t _tlsOffset = 0;
+static bool _tlsAvailable = false;
+
+// Only used for its destructor, which detaches exiting threads.
+static pthread_key_t _exitKey;
+
+#endif
+
+// Per-thread counters are reserved for every block but committed in chunks
+// as blocks get translated, most threads never see more than a few.
+constexpr size_t CounterReservation = Coverage::MaxBlocks * sizeof(uint64_t);
+constexpr uint32_t CounterCommitBlocks = 0x10000 / sizeof(uint64_t);
+
+static std::vector<ThreadContext::Context*> _contexts;
+static uint32_t _counterCount = 0;
+static std::mutex _lock;
+
+static ThreadContext::Context* GetSlot()
+{
+#ifdef _WIN32
+    return static_cast<ThreadContext::Context*>(TlsGetValue(_tlsIndex));
+#else
+    return _current;
+#endif
+}
+
+static void SetSlot(ThreadContext::Context* ctx)
+{
+#ifdef _WIN32
+    TlsSetValue(_tlsIndex, ctx);
+#else
+    _current = ctx;
+    pthread_setspecific(_exitKey, ctx);
+#endif
+}
+
+static bool UsesPerThreadCounters()
+{
+    const Config::Options& opts = Config::Get();
+    return opts.profile && opts.counterMode == Config::CounterMode::PerThread;
+}
+
+#ifdef _WIN32
+
+bool ThreadContext::Initialize()
+{
+    _tlsIndex = TlsAlloc();
+    if (_tlsIndex == TLS_OUT_OF_INDEXES)
+    {
+        Logging::Msg("TlsAlloc failed: 0x%08X", GetLastError());
+        return false;
+    }
+
+    if (_tlsIndex >= TebTlsSlotsCount)
+    {
+        // Expansion slots require an additional indirection.
+        Logging::Msg("TLS index %u is not directly addressable", _tlsIndex);
+        TlsFree(_tlsIndex);
+        _tlsIndex = TLS_OUT_OF_INDEXES;
+        return false;
+    }
+
+    return true;
+}
+
+bool ThreadContext::IsAvailable()
+{
+    return _tlsIndex != TLS_OUT_OF_INDEXES;
+}
+
+#else
+
+bool ThreadContext::Initialize()
+{
+    if (pthread_key_create(
+            &_exitKey, [](void*) { ThreadContext::Detach(); })
+        != 0)
+    {
+        Logging::Msg("pthread_key_create failed");
+        return false;
+    }
+
+    // The thread control block starts with a pointer to itself.
+    uintptr_t threadPointer = 0;
+    asm volatile("mov %%fs:0, %0" : "=r"(threadPointer));
+
+    _tlsOffset = static_cast<intptr_t>(
+        reinterpret_cast<uintptr_t>(&_current) - threadPointer);
+    _tlsAvailable = true;
+
+    return true;
+}
+
+bool ThreadContext::IsAvailable()
+{
+    return _tlsAvailable;
+}
+
+#endif
+
+void ThreadContext::Attach()
+{
+    if (!IsAvailable())
+        return;
+
+    if (GetSlot() != nullptr)
+        return;
+
+    auto* ctx = new Context{};
+
+    // Frames below the hash depth stay zero so the first calls have nothing
+    // to remove from the hash.
+    ctx->callDepth = static_cast<uint32_t>(Config::Get().contextDepth);
+
+    if (UsesPerThreadCounters())
+    {
+        ctx->counters = static_cast<uint64_t*>(
+            Memory::ReservePages(CounterReservation));
+    }
+
+    if (Coverage::GetMap() != nullptr && Config::Get().threadMaps)
+    {
+        ctx->map = static_cast<uint8_t*>(Memory::AllocatePages(
+            CoverageMap::GetAllocationSize(Coverage::GetMapSize())));
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+
+        if (ctx->counters != nullptr && _counterCount != 0
+            && !Memory::CommitPages(
+                ctx->counters, _counterCount * sizeof(uint64_t)))
+        {
+            // The translated code falls back to the shared counters.
+            Logging::Msg("Unable to commit thread counters");
+            Memory::FreePages(ctx->counters, CounterReservation);
+            ctx->counters = nullptr;
+        }
+        if (ctx->counters != nullptr)
+            ctx->counterCount = _counterCount;
+
+        _contexts.push_back(ctx);
+    }
+
+    SetSlot(ctx);
+}
+
+void ThreadContext::Detach()
+{
+    if (!IsAvailable())
+        return;
+
+    auto* ctx = GetSlot();
+    if (ctx == nullptr)
+        return;
+
+    SetSlot(nullptr);
+
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        for (auto it = _contexts.begin(); it != _contexts.end(); ++it)
+        {
+            if (*it == ctx)
+            {
+                _contexts.erase(it);
+                break;
+            }
+        }
+
+        // Fold while holding the lock so a snapshot never misses the counts.
+        if (ctx->counters != nullptr)
+            Coverage::FoldCounters(ctx->counters, ctx->counterCount);
+        if (ctx->map != nullptr)
+            Coverage::FoldMap(ctx->map);
+    }
+
+    Memory::FreePages(ctx->counters, CounterReservation);
+    Memory::FreePages(
+        ctx->map, CoverageMap::GetAllocationSize(Coverage::GetMapSize()));
+    delete ctx;
+}
+
+ThreadContext::Context* ThreadContext::Current()
+{
+    if (!IsAvailable())
+        return nullptr;
+    return GetSlot();
+}
+
+bool ThreadContext::CommitCounters(uint32_t count)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+
+    if (count <= _counterCount)
+        return true;
+    if (count > Coverage::MaxBlocks)
+        return false;
+
+    const uint32_t newCount = std::min<uint32_t>(
+        (count + CounterCommitBlocks - 1) / CounterCommitBlocks
+            * CounterCommitBlocks,
+        Coverage::MaxBlocks);
+
+    for (auto* ctx : _contexts)
+    {
+        if (ctx->counters == nullptr)
+            continue;
+
+        if (!Memory::CommitPages(
+                ctx->counters + ctx->counterCount,
+                (newCount - ctx->counterCount) * sizeof(uint64_t)))
+        {
+            Logging::Msg("Unable to commit thread counters");
+            return false;
+        }
+        ctx->counterCount = newCount;
+    }
+
+    _counterCount = newCount;
+    return true;
+}
+
+void ThreadContext::EmitLoad(
+    asmjit::x86::Assembler& cb, const asmjit::x86::Gp& reg)
+{
+#ifdef _WIN32
+    asmjit::x86::Mem slot = asmjit::x86::qword_ptr_abs(
+        TebTlsSlotsOffset + _tlsIndex * sizeof(void*));
+    slot.setSegment(asmjit::x86::gs);
+#else
+    // The offset is negative, it is encoded as a sign extended disp32.
+    asmjit::x86::Mem slot = asmjit::x86::qword_ptr_abs(
+        static_cast<uint64_t>(_tlsOffset));
+    slot.setSegment(asmjit::x86::fs);
+#endif
+
+    cb.mov(reg, slot);
+}
+
+void ThreadContext::ForEach(
+    void (*fn)(const Context& ctx, void* user), void* user)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    for (auto* ctx : _contexts)
+    {
+        fn(*ctx, user);
+    }
+}
+
+} // namespace CovCane
@@ -3485,4 +3485,17 @@ bool convertInstruction(
     return true;
 }
 
+bool convertConditionalBranch(
+    const ZydisDecodedInstruction& instr,
+    asmjit::x86::Assembler& cb,
+    const asmjit::Label& target)
+{
+    const uint32_t mnemonic = convertMnemonic(instr.mnemonic);
+    if (mnemonic == 0)
+        return false;
+
+    cb.emit(mnemonic, target);
+    return true;
+}
+
 } // namespace CovCane::Translation
\ No newline at end of file
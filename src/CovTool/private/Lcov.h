@@ -0,0 +1,10 @@
+#pragma once
+
+namespace CovCane::Lcov {
+
+// Resolves the blocks of a drcov or CovCane coverage file to source lines
+// and writes them as an lcov trace file. Every line with code in the covered
+// modules is listed, the ones no block reached with zero hits.
+bool Write(const char* input, const char* output);
+
+} // namespace CovCane::Lcov
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace CovCane::SourceLines {
+
+// Start of the code of a source line, relative to the base the runtime
+// records for the module. Line zero marks the end of a run of code.
+struct Record
+{
+    uint64_t offset;
+    uint32_t file;
+    uint32_t line;
+};
+
+struct Table
+{
+    std::vector<std::string> files;
+    // Sorted by offset.
+    std::vector<Record> records;
+};
+
+// Reads every line record of the module from its debug information, the PDB
+// DbgHelp finds for it on Windows and DWARF from the file or the one its
+// .gnu_debuglink names on Linux.
+bool Load(const char* path, Table& table);
+
+} // namespace CovCane::SourceLines
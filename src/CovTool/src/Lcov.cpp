@@ -0,0 +1,294 @@
+#include "Lcov.h"
+#include "SourceLines.h"
+#include "CovCane/CoverageFile.h"
+
+#include <algorithm>
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace CovCane {
+
+struct CoveredBlock
+{
+    uint32_t offset;
+    // Zero when the input does not record it.
+    uint32_t size;
+    uint64_t hits;
+};
+
+struct CoveredModule
+{
+    std::string path;
+    std::vector<CoveredBlock> blocks;
+};
+
+// Hit count per line of every source file.
+using LineTable = std::map<std::string, std::map<uint32_t, uint64_t>>;
+
+static bool ReadCoverageFile(
+    const char* path, std::vector<CoveredModule>& modules)
+{
+    CoverageFile::Reader reader;
+    if (!reader.Open(path))
+        return false;
+
+    const bool hitCounts = reader.HasHitCounts();
+    for (uint32_t i = 0; i < reader.GetModuleCount(); i++)
+    {
+        CoveredModule& mod = modules.emplace_back();
+        mod.path = std::string(reader.GetModulePath(i));
+
+        reader.ForEachBlock(i, [&](uint32_t offset, uint64_t hits) {
+            mod.blocks.push_back({ offset, 0, hitCounts ? hits : 1 });
+        });
+    }
+
+    return true;
+}
+
+static bool ReadLine(std::string_view& data, std::string_view& line)
+{
+    const size_t end = data.find('\n');
+    if (end == std::string_view::npos)
+        return false;
+
+    line = data.substr(0, end);
+    if (!line.empty() && line.back() == '\r')
+        line.remove_suffix(1);
+    data.remove_prefix(end + 1);
+    return true;
+}
+
+static bool StartsWith(std::string_view str, std::string_view prefix)
+{
+    return str.substr(0, prefix.size()) == prefix;
+}
+
+// Reads the module table and basic block table of a drcov file. The path is
+// the last column of the module table and may itself contain commas.
+static bool ReadDrCov(
+    const std::string& contents, std::vector<CoveredModule>& modules)
+{
+    std::string_view data(contents);
+    std::string_view line;
+
+    size_t moduleCount = 0;
+    while (ReadLine(data, line))
+    {
+        if (StartsWith(line, "Module Table:"))
+        {
+            const size_t count = line.rfind("count ");
+            const size_t pos = count != std::string_view::npos
+                                   ? count + 6
+                                   : line.find(':') + 1;
+            moduleCount = strtoul(
+                std::string(line.substr(pos)).c_str(), nullptr, 10);
+            break;
+        }
+    }
+
+    // Version 1 tables have no column header.
+    size_t columns = 5;
+    if (StartsWith(data, "Columns:"))
+    {
+        ReadLine(data, line);
+        columns = std::count(line.begin(), line.end(), ',') + 1;
+    }
+
+    for (size_t i = 0; i < moduleCount; i++)
+    {
+        if (!ReadLine(data, line))
+            return false;
+
+        const size_t id = strtoul(std::string(line).c_str(), nullptr, 10);
+        size_t pos = 0;
+        for (size_t column = 1; column < columns && pos != line.npos; column++)
+        {
+            pos = line.find(',', pos);
+            if (pos != line.npos)
+                pos++;
+        }
+        if (pos == line.npos)
+            return false;
+        while (pos < line.size() && line[pos] == ' ')
+            pos++;
+
+        if (id >= modules.size())
+            modules.resize(id + 1);
+        modules[id].path = std::string(line.substr(pos));
+    }
+
+    if (!ReadLine(data, line) || !StartsWith(line, "BB Table:"))
+        return false;
+
+    const size_t blockCount = strtoul(
+        std::string(line.substr(9)).c_str(), nullptr, 10);
+    if (blockCount > data.size() / 8)
+        return false;
+
+    for (size_t i = 0; i < blockCount; i++)
+    {
+        const uint8_t* entry = reinterpret_cast<const uint8_t*>(data.data())
+                               + i * 8;
+
+        uint32_t start;
+        uint16_t size;
+        uint16_t id;
+        memcpy(&start, entry, sizeof(start));
+        memcpy(&size, entry + 4, sizeof(size));
+        memcpy(&id, entry + 6, sizeof(id));
+
+        if (id < modules.size())
+            modules[id].blocks.push_back({ start, size, 1 });
+    }
+
+    return true;
+}
+
+static bool ReadInput(const char* path, std::vector<CoveredModule>& modules)
+{
+    FILE* fp = nullptr;
+#ifdef _WIN32
+    fopen_s(&fp, path, "rb");
+#else
+    fp = fopen(path, "rb");
+#endif
+    if (fp == nullptr)
+        return false;
+
+    std::string contents;
+    char buffer[0x10000];
+    size_t len;
+    while ((len = fread(buffer, 1, sizeof(buffer), fp)) != 0)
+        contents.append(buffer, len);
+    fclose(fp);
+
+    if (StartsWith(contents, "DRCOV VERSION:"))
+        return ReadDrCov(contents, modules);
+    return ReadCoverageFile(path, modules);
+}
+
+// Every line with code starts out unhit, blocks raise the lines their code
+// belongs to. Without a size only the line at the block start is known.
+static void AddModule(
+    const SourceLines::Table& lines,
+    const std::vector<CoveredBlock>& blocks,
+    LineTable& table)
+{
+    std::vector<std::map<uint32_t, uint64_t>*> files;
+    for (auto& file : lines.files)
+        files.push_back(&table[file]);
+
+    for (auto& record : lines.records)
+    {
+        if (record.line != 0)
+            files[record.file]->emplace(record.line, 0);
+    }
+
+    for (auto& block : blocks)
+    {
+        const uint64_t end = uint64_t(block.offset) + block.size;
+
+        // The record covering the block start, then every one inside it.
+        auto it = std::upper_bound(
+            lines.records.begin(), lines.records.end(), block.offset,
+            [](uint64_t offset, const SourceLines::Record& record) {
+                return offset < record.offset;
+            });
+        if (it != lines.records.begin())
+            --it;
+
+        for (; it != lines.records.end(); ++it)
+        {
+            if (it->offset > block.offset && it->offset >= end)
+                break;
+            if (it->line == 0)
+                continue;
+
+            uint64_t& hits = (*files[it->file])[it->line];
+            hits = std::max(hits, block.hits);
+        }
+    }
+}
+
+bool Lcov::Write(const char* input, const char* output)
+{
+    std::vector<CoveredModule> modules;
+    if (!ReadInput(input, modules))
+    {
+        printf("Unable to read coverage: %s\n", input);
+        return false;
+    }
+
+    // A module loaded more than once shares its line table.
+    std::unordered_map<std::string, std::vector<CoveredBlock>> blocks;
+    for (auto& mod : modules)
+    {
+        if (mod.path.empty())
+            continue;
+        auto& list = blocks[mod.path];
+        list.insert(list.end(), mod.blocks.begin(), mod.blocks.end());
+    }
+
+    LineTable table;
+    for (auto& [path, list] : blocks)
+    {
+        SourceLines::Table lines;
+        if (SourceLines::Load(path.c_str(), lines))
+            AddModule(lines, list, table);
+    }
+
+    FILE* fp = nullptr;
+#ifdef _WIN32
+    fopen_s(&fp, output, "wb");
+#else
+    fp = fopen(output, "wb");
+#endif
+    if (fp == nullptr)
+    {
+        printf("Unable to open output: %s\n", output);
+        return false;
+    }
+
+    uint64_t found = 0;
+    uint64_t hit = 0;
+
+    fprintf(fp, "TN:\n");
+    for (auto& [file, lines] : table)
+    {
+        if (lines.empty())
+            continue;
+
+        size_t fileHit = 0;
+        fprintf(fp, "SF:%s\n", file.c_str());
+        for (auto& [line, hits] : lines)
+        {
+            fprintf(fp, "DA:%u,%llu\n", line, (unsigned long long)hits);
+            if (hits != 0)
+                fileHit++;
+        }
+        fprintf(fp, "LF:%zu\nLH:%zu\nend_of_record\n", lines.size(), fileHit);
+
+        found += lines.size();
+        hit += fileHit;
+    }
+
+    if (fclose(fp) != 0)
+    {
+        printf("Failed to write output: %s\n", output);
+        return false;
+    }
+
+    printf(
+        "Wrote %llu of %llu lines hit to %s\n", (unsigned long long)hit,
+        (unsigned long long)found, output);
+    return true;
+}
+
+} // namespace CovCane
@@ -0,0 +1,585 @@
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "Lcov.h"
+#include "CovCane/ControlChannel.h"
+#include "CovCane/CoverageFile.h"
+#include "CovCane/CoverageMerge.h"
+#include "CovCane/EventQueue.h"
+#include "CovCane/SharedCoverage.h"
+
+using namespace CovCane;
+
+struct FileSink
+{
+    FILE* file;
+
+    void Write(const void* data, size_t len)
+    {
+        fwrite(data, 1, len, file);
+    }
+};
+
+static std::string_view GetFileName(std::string_view path)
+{
+    const size_t slash = path.find_last_of("\\/");
+    if (slash != std::string_view::npos)
+        path = path.substr(slash + 1);
+    return path;
+}
+
+static FILE* OpenOutput(const char* path)
+{
+    FILE* fp = nullptr;
+#ifdef _WIN32
+    fopen_s(&fp, path, "wb");
+#else
+    fp = fopen(path, "wb");
+#endif
+    return fp;
+}
+
+static bool OpenFile(CoverageFile::Reader& reader, const char* path)
+{
+    auto start = std::chrono::steady_clock::now();
+    if (!reader.Open(path))
+    {
+        printf("Unable to open coverage file: %s\n", path);
+        return false;
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    printf(
+        "Opened %s in %.3f ms\n", path,
+        std::chrono::duration<double, std::milli>(end - start).count());
+
+    return true;
+}
+
+static int CommandInfo(const char* path)
+{
+    CoverageFile::Reader reader;
+    if (!OpenFile(reader, path))
+        return EXIT_FAILURE;
+
+    const CoverageFile::Header& header = reader.GetHeader();
+    printf("Size: %llu bytes\n", (unsigned long long)header.fileSize);
+    printf("Blocks: %llu\n", (unsigned long long)header.blockCount);
+    printf("Hit counts: %s\n", reader.HasHitCounts() ? "yes" : "no");
+    printf("Modules: %u\n", header.moduleCount);
+
+    for (uint32_t i = 0; i < reader.GetModuleCount(); i++)
+    {
+        const CoverageFile::ModuleEntry& mod = reader.GetModule(i);
+        const std::string_view path = reader.GetModulePath(i);
+
+        printf(
+            "  %3u %016llx %10llu blocks %.*s\n", i,
+            (unsigned long long)mod.base, (unsigned long long)mod.blockCount,
+            (int)path.size(), path.data());
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static int CommandDump(const char* path)
+{
+    CoverageFile::Reader reader;
+    if (!OpenFile(reader, path))
+        return EXIT_FAILURE;
+
+    const bool hitCounts = reader.HasHitCounts();
+    for (uint32_t i = 0; i < reader.GetModuleCount(); i++)
+    {
+        const std::string_view name = GetFileName(reader.GetModulePath(i));
+
+        reader.ForEachBlock(i, [&](uint32_t offset, uint64_t hits) {
+            if (hitCounts)
+            {
+                printf(
+                    "%.*s+0x%x %llu\n", (int)name.size(), name.data(), offset,
+                    (unsigned long long)hits);
+            }
+            else
+            {
+                printf("%.*s+0x%x\n", (int)name.size(), name.data(), offset);
+            }
+        });
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// Directories contribute every .cov file they contain.
+static void CollectInputs(const char* path, std::vector<std::string>& inputs)
+{
+    namespace fs = std::filesystem;
+
+    std::error_code ec;
+    if (!fs::is_directory(path, ec))
+    {
+        inputs.push_back(path);
+        return;
+    }
+
+    for (auto& entry : fs::directory_iterator(path, ec))
+    {
+        if (entry.is_regular_file(ec) && entry.path().extension() == ".cov")
+            inputs.push_back(entry.path().string());
+    }
+}
+
+static int CommandMerge(int argc, const char* argv[])
+{
+    bool intersect = false;
+    unsigned threadCount = std::thread::hardware_concurrency();
+    const char* output = nullptr;
+    std::vector<std::string> inputs;
+
+    for (int i = 0; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-i") == 0)
+            intersect = true;
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            threadCount = static_cast<unsigned>(atoi(argv[++i]));
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            output = argv[++i];
+        else
+            CollectInputs(argv[i], inputs);
+    }
+
+    if (output == nullptr || inputs.empty())
+    {
+        printf("merge requires -o <output> and at least one input\n");
+        return EXIT_FAILURE;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::string> failed;
+    CoverageMerge::Accumulator merged = CoverageMerge::MergeFiles(
+        inputs, threadCount, &failed);
+
+    for (auto& path : failed)
+        printf("Skipped unreadable file: %s\n", path.c_str());
+
+    CoverageFile::Builder builder = merged.Build(intersect);
+
+    FILE* fp = OpenOutput(output);
+    if (fp == nullptr)
+    {
+        printf("Unable to open output: %s\n", output);
+        return EXIT_FAILURE;
+    }
+
+    FileSink sink{ fp };
+    const bool written = builder.Write(sink);
+    if (fclose(fp) != 0 || !written)
+    {
+        printf("Failed to write output: %s\n", output);
+        return EXIT_FAILURE;
+    }
+
+    auto end = std::chrono::steady_clock::now();
+
+    CoverageFile::Reader reader;
+    const uint64_t blockCount = reader.Open(output) ? reader.GetBlockCount()
+                                                    : 0;
+
+    printf(
+        "Merged %u files (%s) into %llu blocks in %.3f s using %u threads\n",
+        merged.GetFileCount(), intersect ? "intersection" : "union",
+        (unsigned long long)blockCount,
+        std::chrono::duration<double>(end - start).count(), threadCount);
+
+    return failed.empty() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// A module loaded more than once has an entry per load, the blocks of all
+// entries with the path are combined.
+static void GetPathBlocks(
+    const CoverageFile::Reader& reader,
+    std::string_view path,
+    std::vector<CoverageFile::BlockRecord>& out)
+{
+    out.clear();
+
+    std::vector<CoverageFile::BlockRecord> blocks;
+    size_t entries = 0;
+    for (uint32_t i = 0; i < reader.GetModuleCount(); i++)
+    {
+        if (reader.GetModulePath(i) != path)
+            continue;
+
+        reader.GetBlocks(i, blocks);
+        out.insert(out.end(), blocks.begin(), blocks.end());
+        entries++;
+    }
+
+    if (entries > 1)
+    {
+        std::sort(
+            out.begin(), out.end(),
+            [](const CoverageFile::BlockRecord& a,
+               const CoverageFile::BlockRecord& b) {
+                return a.offset < b.offset;
+            });
+        out.erase(
+            std::unique(
+                out.begin(), out.end(),
+                [](const CoverageFile::BlockRecord& a,
+                   const CoverageFile::BlockRecord& b) {
+                    return a.offset == b.offset;
+                }),
+            out.end());
+    }
+}
+
+static int CommandDiff(int argc, const char* argv[])
+{
+    bool verbose = false;
+    const char* paths[2]{};
+    int pathCount = 0;
+
+    for (int i = 0; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-v") == 0)
+            verbose = true;
+        else if (pathCount < 2)
+            paths[pathCount++] = argv[i];
+    }
+
+    if (pathCount != 2)
+    {
+        printf("diff requires <base> and <new>\n");
+        return EXIT_FAILURE;
+    }
+
+    CoverageFile::Reader base;
+    CoverageFile::Reader next;
+    if (!OpenFile(base, paths[0]) || !OpenFile(next, paths[1]))
+        return EXIT_FAILURE;
+
+    std::unordered_map<std::string_view, uint32_t> baseModules;
+    for (uint32_t i = 0; i < base.GetModuleCount(); i++)
+        baseModules.emplace(base.GetModulePath(i), i);
+
+    std::vector<CoverageFile::BlockRecord> oldBlocks;
+    std::vector<CoverageFile::BlockRecord> newBlocks;
+
+    uint64_t totalNew = 0;
+    uint64_t totalLost = 0;
+
+    auto report = [&](std::string_view path) {
+        const std::string_view name = GetFileName(path);
+
+        uint64_t added = 0;
+        uint64_t lost = 0;
+
+        auto print = [&](char kind, uint32_t offset) {
+            if (verbose)
+            {
+                printf(
+                    "%c %.*s+0x%x\n", kind, (int)name.size(), name.data(),
+                    offset);
+            }
+        };
+
+        size_t a = 0;
+        size_t b = 0;
+        while (a < oldBlocks.size() || b < newBlocks.size())
+        {
+            if (b == newBlocks.size()
+                || (a < oldBlocks.size()
+                    && oldBlocks[a].offset < newBlocks[b].offset))
+            {
+                print('-', oldBlocks[a++].offset);
+                lost++;
+            }
+            else if (
+                a == oldBlocks.size()
+                || newBlocks[b].offset < oldBlocks[a].offset)
+            {
+                print('+', newBlocks[b++].offset);
+                added++;
+            }
+            else
+            {
+                a++;
+                b++;
+            }
+        }
+
+        if (added != 0 || lost != 0)
+        {
+            printf(
+                "%.*s: %llu new, %llu lost\n", (int)path.size(), path.data(),
+                (unsigned long long)added, (unsigned long long)lost);
+        }
+
+        totalNew += added;
+        totalLost += lost;
+    };
+
+    std::unordered_set<std::string_view> reported;
+    for (uint32_t i = 0; i < next.GetModuleCount(); i++)
+    {
+        const std::string_view path = next.GetModulePath(i);
+        if (!reported.insert(path).second)
+            continue;
+
+        GetPathBlocks(next, path, newBlocks);
+
+        auto it = baseModules.find(path);
+        if (it != baseModules.end())
+        {
+            GetPathBlocks(base, path, oldBlocks);
+            baseModules.erase(it);
+        }
+        else
+        {
+            oldBlocks.clear();
+        }
+
+        report(path);
+    }
+
+    // Modules that are missing from the new run lost all their blocks.
+    newBlocks.clear();
+    for (uint32_t i = 0; i < base.GetModuleCount(); i++)
+    {
+        const std::string_view path = base.GetModulePath(i);
+        if (baseModules.erase(path) == 0)
+            continue;
+
+        GetPathBlocks(base, path, oldBlocks);
+        report(path);
+    }
+
+    printf(
+        "Total: %llu new, %llu lost\n", (unsigned long long)totalNew,
+        (unsigned long long)totalLost);
+
+    return EXIT_SUCCESS;
+}
+
+// Source line coverage of a drcov or coverage file, resolved from the debug
+// information of its modules.
+static int CommandLcov(int argc, const char* argv[])
+{
+    const char* input = nullptr;
+    std::string output;
+
+    for (int i = 0; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            output = argv[++i];
+        else
+            input = argv[i];
+    }
+
+    if (input == nullptr)
+    {
+        printf("lcov requires an input file\n");
+        return EXIT_FAILURE;
+    }
+    if (output.empty())
+        output = std::string(input) + ".info";
+
+    return Lcov::Write(input, output.c_str()) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Prints the growth of a shared coverage map until interrupted or until
+// count samples have been printed.
+static int CommandWatch(int argc, const char* argv[])
+{
+    const char* name = argv[0];
+    const int interval = argc > 1 ? atoi(argv[1]) : 1000;
+    const int count = argc > 2 ? atoi(argv[2]) : 0;
+
+    SharedCoverage::Segment segment;
+    if (!segment.Open(name))
+    {
+        printf("Unable to open shared coverage: %s\n", name);
+        return EXIT_FAILURE;
+    }
+
+    const SharedCoverage::Header* header = segment.GetHeader();
+    printf(
+        "Watching %s, %llu bits\n", name,
+        (unsigned long long)header->mapBits);
+
+    uint64_t last = 0;
+    for (int i = 0; count == 0 || i < count; i++)
+    {
+        if (i != 0)
+        {
+            std::this_thread::sleep_for(
+                std::chrono::milliseconds(interval > 0 ? interval : 1000));
+        }
+
+        const uint64_t covered = SharedMemory::AtomicLoad(
+            &header->coveredBlocks);
+        const uint64_t processes = SharedMemory::AtomicLoad(
+            &header->processes);
+
+        printf(
+            "%llu blocks (+%llu), %llu processes\n",
+            (unsigned long long)covered, (unsigned long long)(covered - last),
+            (unsigned long long)processes);
+        fflush(stdout);
+
+        last = covered;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// Prints the blocks an instrumented process discovers as they arrive, stops
+// after count events if given.
+static int CommandEvents(int argc, const char* argv[])
+{
+    const char* name = argv[0];
+    const uint64_t count = argc > 1 ? strtoull(argv[1], nullptr, 10) : 0;
+
+    EventQueue::Queue queue;
+    if (!queue.Open(name))
+    {
+        printf("Unable to open event queue: %s\n", name);
+        return EXIT_FAILURE;
+    }
+
+    uint32_t producer = queue.GetProducerId();
+    printf("Reading %s from process %u\n", name, producer);
+
+    uint64_t received = 0;
+    uint64_t lost = queue.GetLostCount();
+
+    EventQueue::Event event;
+    while (count == 0 || received < count)
+    {
+        if (!queue.Pop(event))
+        {
+            if (queue.GetLostCount() != lost)
+            {
+                lost = queue.GetLostCount();
+                printf("%llu events lost\n", (unsigned long long)lost);
+            }
+
+            // A new producer reset the ring.
+            if (queue.GetProducerId() != producer)
+            {
+                if (!queue.Open(name))
+                    return EXIT_FAILURE;
+                producer = queue.GetProducerId();
+                lost = 0;
+                printf("Reading %s from process %u\n", name, producer);
+            }
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+
+        const char* tag = (event.flags & EventQueue::NewInSharedMap) != 0
+                              ? " new"
+                              : "";
+
+        if (event.module == EventQueue::NoModule)
+        {
+            printf(
+                "0x%llx%s\n", (unsigned long long)event.offset, tag);
+        }
+        else
+        {
+            const std::string_view path = queue.GetModule(event.module).path;
+            const std::string_view file = GetFileName(path);
+            printf(
+                "%.*s+0x%llx%s\n", (int)file.size(), file.data(),
+                (unsigned long long)event.offset, tag);
+        }
+        fflush(stdout);
+
+        received++;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// Sends one command to the control channel of a running process.
+static int CommandControl(int argc, const char* argv[])
+{
+    if (argc < 2)
+    {
+        printf("Missing command for %s\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    std::string reply;
+    if (!ControlChannel::Send(argv[0], argv[1], reply))
+    {
+        printf("No process is serving %s\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("%s\n", reply.c_str());
+    return reply.compare(0, 5, "error") == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void PrintUsage()
+{
+    printf("Usage: CovTool <command> <args>\n");
+    printf("  info <file>    Header and module table\n");
+    printf("  dump <file>    Every block as module+offset [hits]\n");
+    printf("  merge [-i] [-j threads] -o <output> <files or dirs...>\n");
+    printf("                 Union of all blocks, -i keeps only the blocks\n");
+    printf("                 found in every file. Hit counts are summed.\n");
+    printf("  diff [-v] <base> <new>\n");
+    printf("                 New and lost blocks per module, -v lists them\n");
+    printf("  lcov [-o output] <file>\n");
+    printf("                 Source lines of a drcov or coverage file from\n");
+    printf("                 the debug information of its modules\n");
+    printf("  watch <name> [interval ms] [count]\n");
+    printf("                 Live block count of a COVCANE_SHM segment\n");
+    printf("  events <name> [count]\n");
+    printf("                 Blocks pushed to a COVCANE_EVENTS queue\n");
+    printf("  control <name> detach|attach|status\n");
+    printf("                 Toggles a process serving COVCANE_CONTROL\n");
+}
+
+int main(int argc, const char* argv[])
+{
+    if (argc < 3)
+    {
+        PrintUsage();
+        return EXIT_FAILURE;
+    }
+
+    const char* command = argv[1];
+    if (strcmp(command, "info") == 0)
+        return CommandInfo(argv[2]);
+    if (strcmp(command, "dump") == 0)
+        return CommandDump(argv[2]);
+    if (strcmp(command, "merge") == 0)
+        return CommandMerge(argc - 2, argv + 2);
+    if (strcmp(command, "diff") == 0)
+        return CommandDiff(argc - 2, argv + 2);
+    if (strcmp(command, "lcov") == 0)
+        return CommandLcov(argc - 2, argv + 2);
+    if (strcmp(command, "watch") == 0)
+        return CommandWatch(argc - 2, argv + 2);
+    if (strcmp(command, "events") == 0)
+        return CommandEvents(argc - 2, argv + 2);
+    if (strcmp(command, "control") == 0)
+        return CommandControl(argc - 2, argv + 2);
+
+    printf("Unknown command: %s\n", command);
+    PrintUsage();
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,769 @@
+#include "SourceLines.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <unordered_map>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <dbghelp.h>
+#else
+#include <elf.h>
+#endif
+
+namespace CovCane {
+
+// Source files by path, shared by every unit of the module.
+struct FileIndex
+{
+    SourceLines::Table* table;
+    std::unordered_map<std::string, uint32_t> indices;
+
+    uint32_t Get(const std::string& path)
+    {
+        auto it = indices.find(path);
+        if (it != indices.end())
+            return it->second;
+
+        const uint32_t index = static_cast<uint32_t>(table->files.size());
+        table->files.push_back(path);
+        indices.emplace(path, index);
+        return index;
+    }
+};
+
+// The end of a run of code sorts before a line starting at the same offset.
+static void SortRecords(SourceLines::Table& table)
+{
+    std::stable_sort(
+        table.records.begin(), table.records.end(),
+        [](const SourceLines::Record& a, const SourceLines::Record& b) {
+            if (a.offset != b.offset)
+                return a.offset < b.offset;
+            return a.line == 0 && b.line != 0;
+        });
+}
+
+#ifdef _WIN32
+
+static BOOL CALLBACK OnLine(PSRCCODEINFO info, PVOID user)
+{
+    auto& files = *static_cast<FileIndex*>(user);
+
+    files.table->records.push_back(
+        { info->Address - info->ModBase, files.Get(info->FileName),
+          static_cast<uint32_t>(info->LineNumber) });
+    return TRUE;
+}
+
+bool SourceLines::Load(const char* path, Table& table)
+{
+    const HANDLE process = GetCurrentProcess();
+
+    static bool initialized = false;
+    if (!initialized)
+    {
+        SymSetOptions(SYMOPT_LOAD_LINES | SYMOPT_UNDNAME);
+        if (!SymInitialize(process, nullptr, FALSE))
+        {
+            printf("SymInitialize failed: 0x%08X\n", GetLastError());
+            return false;
+        }
+        initialized = true;
+    }
+
+    // Loaded at its preferred base, the records become image relative like
+    // the block offsets.
+    const DWORD64 base = SymLoadModuleEx(
+        process, nullptr, path, nullptr, 0, 0, nullptr, 0);
+    if (base == 0)
+    {
+        printf("Unable to load symbols of %s: 0x%08X\n", path, GetLastError());
+        return false;
+    }
+
+    FileIndex files{ &table, {} };
+    const BOOL res = SymEnumLines(
+        process, base, nullptr, nullptr, OnLine, &files);
+    SymUnloadModule64(process, base);
+
+    if (!res || table.records.empty())
+    {
+        printf("No source lines for %s\n", path);
+        return false;
+    }
+
+    SortRecords(table);
+    return true;
+}
+
+#else
+
+// Forms and content types used by DWARF 5 line table headers.
+constexpr uint64_t FormBlock = 0x09;
+constexpr uint64_t FormData1 = 0x0b;
+constexpr uint64_t FormData2 = 0x05;
+constexpr uint64_t FormData4 = 0x06;
+constexpr uint64_t FormData8 = 0x07;
+constexpr uint64_t FormData16 = 0x1e;
+constexpr uint64_t FormLineStrp = 0x1f;
+constexpr uint64_t FormString = 0x08;
+constexpr uint64_t FormStrp = 0x0e;
+constexpr uint64_t FormUdata = 0x0f;
+constexpr uint64_t ContentPath = 0x1;
+constexpr uint64_t ContentDirectoryIndex = 0x2;
+
+struct Section
+{
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+};
+
+struct DebugSections
+{
+    Section line;
+    Section lineStr;
+    Section str;
+    std::string debugLink;
+};
+
+struct ElfLayout
+{
+    // Lowest loaded page, the runtime records block offsets relative to it.
+    uint64_t base = UINT64_MAX;
+    std::vector<std::pair<uint64_t, uint64_t>> code;
+};
+
+// Bounds checked reads, a truncated section reads as zeros and sets the
+// failed flag.
+class Cursor
+{
+public:
+    Cursor(const uint8_t* data, size_t size) : _data(data), _size(size) {}
+
+    bool AtEnd() const
+    {
+        return _pos >= _size;
+    }
+
+    bool Failed() const
+    {
+        return _failed;
+    }
+
+    size_t GetPos() const
+    {
+        return _pos;
+    }
+
+    void Seek(size_t pos)
+    {
+        _pos = std::min(pos, _size);
+    }
+
+    void Skip(uint64_t len)
+    {
+        if (len > _size - _pos)
+        {
+            _failed = true;
+            _pos = _size;
+            return;
+        }
+        _pos += static_cast<size_t>(len);
+    }
+
+    uint64_t ReadUnsigned(size_t len)
+    {
+        if (len > _size - _pos)
+        {
+            _failed = true;
+            _pos = _size;
+            return 0;
+        }
+
+        uint64_t value = 0;
+        for (size_t i = 0; i < len; i++)
+            value |= uint64_t(_data[_pos + i]) << (i * 8);
+        _pos += len;
+        return value;
+    }
+
+    uint64_t ReadUleb()
+    {
+        uint64_t value = 0;
+        for (unsigned shift = 0; _pos < _size; shift += 7)
+        {
+            const uint8_t byte = _data[_pos++];
+            if (shift < 64)
+                value |= uint64_t(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0)
+                return value;
+        }
+        _failed = true;
+        return value;
+    }
+
+    int64_t ReadSleb()
+    {
+        int64_t value = 0;
+        unsigned shift = 0;
+        while (_pos < _size)
+        {
+            const uint8_t byte = _data[_pos++];
+            if (shift < 64)
+                value |= int64_t(byte & 0x7f) << shift;
+            shift += 7;
+            if ((byte & 0x80) == 0)
+            {
+                if (shift < 64 && (byte & 0x40) != 0)
+                    value |= -(int64_t(1) << shift);
+                return value;
+            }
+        }
+        _failed = true;
+        return value;
+    }
+
+    std::string ReadString()
+    {
+        const void* end = memchr(_data + _pos, 0, _size - _pos);
+        if (end == nullptr)
+        {
+            _failed = true;
+            _pos = _size;
+            return std::string();
+        }
+
+        const size_t len = static_cast<const uint8_t*>(end) - (_data + _pos);
+        std::string res(reinterpret_cast<const char*>(_data + _pos), len);
+        _pos += len + 1;
+        return res;
+    }
+
+private:
+    const uint8_t* _data;
+    size_t _size;
+    size_t _pos = 0;
+    bool _failed = false;
+};
+
+static bool ReadFile(const std::string& path, std::vector<uint8_t>& out)
+{
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (fp == nullptr)
+        return false;
+
+    bool res = fseek(fp, 0, SEEK_END) == 0;
+    const long size = res ? ftell(fp) : -1;
+    if (size < 0 || fseek(fp, 0, SEEK_SET) != 0)
+        res = false;
+
+    if (res)
+    {
+        out.resize(static_cast<size_t>(size));
+        res = fread(out.data(), 1, out.size(), fp) == out.size();
+    }
+
+    fclose(fp);
+    return res;
+}
+
+static std::string StringAt(const Section& section, uint64_t offset)
+{
+    if (offset >= section.size)
+        return std::string();
+
+    const char* str = reinterpret_cast<const char*>(section.data + offset);
+    return std::string(str, strnlen(str, section.size - offset));
+}
+
+template<typename Ehdr, typename Phdr, typename Shdr>
+static bool ReadElf(
+    const char* path,
+    const std::vector<uint8_t>& file,
+    ElfLayout* layout,
+    DebugSections& sections)
+{
+    if (file.size() < sizeof(Ehdr))
+        return false;
+
+    Ehdr ehdr;
+    memcpy(&ehdr, file.data(), sizeof(ehdr));
+
+    if (layout != nullptr)
+    {
+        for (unsigned i = 0; i < ehdr.e_phnum; i++)
+        {
+            const uint64_t pos = ehdr.e_phoff + uint64_t(i) * sizeof(Phdr);
+            if (pos + sizeof(Phdr) > file.size())
+                return false;
+
+            Phdr phdr;
+            memcpy(&phdr, file.data() + pos, sizeof(phdr));
+            if (phdr.p_type != PT_LOAD)
+                continue;
+
+            layout->base = std::min<uint64_t>(
+                layout->base, phdr.p_vaddr & ~uint64_t(0xfff));
+            if ((phdr.p_flags & PF_X) != 0)
+            {
+                layout->code.emplace_back(
+                    phdr.p_vaddr, phdr.p_vaddr + phdr.p_memsz);
+            }
+        }
+    }
+
+    std::vector<Shdr> shdrs(ehdr.e_shnum);
+    for (unsigned i = 0; i < ehdr.e_shnum; i++)
+    {
+        const uint64_t pos = ehdr.e_shoff + uint64_t(i) * sizeof(Shdr);
+        if (pos + sizeof(Shdr) > file.size())
+            return false;
+        memcpy(&shdrs[i], file.data() + pos, sizeof(Shdr));
+    }
+    if (ehdr.e_shstrndx >= shdrs.size())
+        return layout != nullptr;
+
+    const Shdr& names = shdrs[ehdr.e_shstrndx];
+    for (auto& shdr : shdrs)
+    {
+        if (shdr.sh_type == SHT_NOBITS || shdr.sh_offset > file.size()
+            || shdr.sh_size > file.size() - shdr.sh_offset
+            || shdr.sh_name >= names.sh_size)
+        {
+            continue;
+        }
+
+        const Section data{ file.data() + shdr.sh_offset, shdr.sh_size };
+        const std::string name = StringAt(
+            { file.data() + names.sh_offset, names.sh_size }, shdr.sh_name);
+
+        Section* target = nullptr;
+        if (name == ".debug_line")
+            target = &sections.line;
+        else if (name == ".debug_line_str")
+            target = &sections.lineStr;
+        else if (name == ".debug_str")
+            target = &sections.str;
+        else if (name == ".gnu_debuglink")
+            sections.debugLink = StringAt(data, 0);
+
+        if (target == nullptr)
+            continue;
+
+        if ((shdr.sh_flags & SHF_COMPRESSED) != 0)
+        {
+            printf("Compressed %s is not supported: %s\n", name.c_str(), path);
+            continue;
+        }
+        *target = data;
+    }
+
+    return true;
+}
+
+static bool ReadElf(
+    const char* path,
+    const std::vector<uint8_t>& file,
+    ElfLayout* layout,
+    DebugSections& sections)
+{
+    if (file.size() < EI_NIDENT || memcmp(file.data(), ELFMAG, SELFMAG) != 0)
+        return false;
+
+    if (file[EI_CLASS] == ELFCLASS64)
+    {
+        return ReadElf<Elf64_Ehdr, Elf64_Phdr, Elf64_Shdr>(
+            path, file, layout, sections);
+    }
+    return ReadElf<Elf32_Ehdr, Elf32_Phdr, Elf32_Shdr>(
+        path, file, layout, sections);
+}
+
+// Reads one attribute of a DWARF 5 directory or file entry.
+static bool ReadForm(
+    Cursor& cur,
+    uint64_t form,
+    size_t offsetSize,
+    const DebugSections& sections,
+    std::string& str,
+    uint64_t& value)
+{
+    switch (form)
+    {
+        case FormString:
+            str = cur.ReadString();
+            return true;
+        case FormLineStrp:
+            str = StringAt(sections.lineStr, cur.ReadUnsigned(offsetSize));
+            return true;
+        case FormStrp:
+            str = StringAt(sections.str, cur.ReadUnsigned(offsetSize));
+            return true;
+        case FormUdata:
+            value = cur.ReadUleb();
+            return true;
+        case FormData1:
+            value = cur.ReadUnsigned(1);
+            return true;
+        case FormData2:
+            value = cur.ReadUnsigned(2);
+            return true;
+        case FormData4:
+            value = cur.ReadUnsigned(4);
+            return true;
+        case FormData8:
+            value = cur.ReadUnsigned(8);
+            return true;
+        case FormData16:
+            cur.Skip(16);
+            return true;
+        case FormBlock:
+            cur.Skip(cur.ReadUleb());
+            return true;
+    }
+    return false;
+}
+
+struct EntryFormat
+{
+    uint64_t content;
+    uint64_t form;
+};
+
+// Directory or file table of a DWARF 5 header as path and directory index.
+static bool ReadEntries(
+    Cursor& cur,
+    size_t offsetSize,
+    const DebugSections& sections,
+    std::vector<std::pair<std::string, uint64_t>>& out)
+{
+    std::vector<EntryFormat> formats(cur.ReadUnsigned(1));
+    for (auto& format : formats)
+    {
+        format.content = cur.ReadUleb();
+        format.form = cur.ReadUleb();
+    }
+
+    const uint64_t count = cur.ReadUleb();
+    for (uint64_t i = 0; i < count && !cur.Failed(); i++)
+    {
+        auto& entry = out.emplace_back();
+        for (auto& format : formats)
+        {
+            std::string str;
+            uint64_t value = 0;
+            if (!ReadForm(cur, format.form, offsetSize, sections, str, value))
+                return false;
+
+            if (format.content == ContentPath)
+                entry.first = std::move(str);
+            else if (format.content == ContentDirectoryIndex)
+                entry.second = value;
+        }
+    }
+
+    return !cur.Failed();
+}
+
+static std::string JoinPath(const std::string& dir, const std::string& path)
+{
+    if (dir.empty() || path.empty() || path[0] == '/')
+        return path;
+    if (dir.back() == '/')
+        return dir + path;
+    return dir + "/" + path;
+}
+
+// Runs the line number program of every unit, rows outside of the code
+// segments belong to discarded functions.
+static void ReadLineTable(
+    const DebugSections& sections,
+    const ElfLayout& layout,
+    SourceLines::Table& table)
+{
+    FileIndex files{ &table, {} };
+    Cursor cur(sections.line.data, sections.line.size);
+
+    auto inCode = [&](uint64_t address) {
+        for (auto& segment : layout.code)
+        {
+            if (address >= segment.first && address < segment.second)
+                return true;
+        }
+        return false;
+    };
+
+    while (!cur.AtEnd() && !cur.Failed())
+    {
+        size_t offsetSize = 4;
+        uint64_t unitLength = cur.ReadUnsigned(4);
+        if (unitLength == 0xffffffff)
+        {
+            offsetSize = 8;
+            unitLength = cur.ReadUnsigned(8);
+        }
+        const size_t unitEnd = cur.GetPos()
+                               + static_cast<size_t>(std::min<uint64_t>(
+                                   unitLength, sections.line.size));
+
+        const uint16_t version = static_cast<uint16_t>(cur.ReadUnsigned(2));
+        if (version < 2 || version > 5)
+        {
+            cur.Seek(unitEnd);
+            continue;
+        }
+        if (version >= 5)
+            cur.Skip(2);
+
+        const uint64_t headerLength = cur.ReadUnsigned(offsetSize);
+        const size_t programStart = cur.GetPos()
+                                    + static_cast<size_t>(headerLength);
+
+        const uint8_t minInstLength = static_cast<uint8_t>(
+            cur.ReadUnsigned(1));
+        if (version >= 4)
+            cur.Skip(1);
+        // default_is_stmt, every row counts.
+        cur.Skip(1);
+        const int8_t lineBase = static_cast<int8_t>(cur.ReadUnsigned(1));
+        const uint8_t lineRange = static_cast<uint8_t>(cur.ReadUnsigned(1));
+        const uint8_t opcodeBase = static_cast<uint8_t>(cur.ReadUnsigned(1));
+
+        std::vector<uint8_t> opcodeLengths(opcodeBase > 0 ? opcodeBase - 1 : 0);
+        for (auto& len : opcodeLengths)
+            len = static_cast<uint8_t>(cur.ReadUnsigned(1));
+
+        // Index into the table files of the unit's file register, DWARF 5
+        // counts from zero and entry zero is the unit itself.
+        std::vector<uint32_t> unitFiles;
+        if (version >= 5)
+        {
+            std::vector<std::pair<std::string, uint64_t>> dirs;
+            std::vector<std::pair<std::string, uint64_t>> names;
+            if (!ReadEntries(cur, offsetSize, sections, dirs)
+                || !ReadEntries(cur, offsetSize, sections, names))
+            {
+                cur.Seek(unitEnd);
+                continue;
+            }
+
+            const std::string compDir = dirs.empty() ? std::string()
+                                                     : dirs[0].first;
+            for (auto& [name, dirIndex] : names)
+            {
+                std::string dir = dirIndex < dirs.size() ? dirs[dirIndex].first
+                                                         : std::string();
+                if (dirIndex != 0)
+                    dir = JoinPath(compDir, dir);
+                unitFiles.push_back(files.Get(JoinPath(dir, name)));
+            }
+        }
+        else
+        {
+            // Directory zero is the compilation directory, which only the
+            // unit's debug info names.
+            std::vector<std::string> dirs(1);
+            for (;;)
+            {
+                std::string dir = cur.ReadString();
+                if (dir.empty() || cur.Failed())
+                    break;
+                dirs.push_back(std::move(dir));
+            }
+
+            unitFiles.push_back(UINT32_MAX);
+            for (;;)
+            {
+                const std::string name = cur.ReadString();
+                if (name.empty() || cur.Failed())
+                    break;
+                const uint64_t dirIndex = cur.ReadUleb();
+                cur.ReadUleb();
+                cur.ReadUleb();
+
+                const std::string dir = dirIndex < dirs.size() ? dirs[dirIndex]
+                                                               : std::string();
+                unitFiles.push_back(files.Get(JoinPath(dir, name)));
+            }
+        }
+
+        if (cur.Failed() || lineRange == 0)
+            return;
+        cur.Seek(programStart);
+
+        uint64_t address = 0;
+        uint64_t file = 1;
+        int64_t line = 1;
+        bool sequenceInCode = false;
+
+        auto emit = [&]() {
+            if (!inCode(address) || address < layout.base
+                || file >= unitFiles.size() || unitFiles[file] == UINT32_MAX
+                || line <= 0)
+            {
+                return;
+            }
+            table.records.push_back(
+                { address - layout.base, unitFiles[file],
+                  static_cast<uint32_t>(line) });
+            sequenceInCode = true;
+        };
+
+        while (cur.GetPos() < unitEnd && !cur.Failed())
+        {
+            const uint8_t opcode = static_cast<uint8_t>(cur.ReadUnsigned(1));
+
+            if (opcode >= opcodeBase)
+            {
+                const uint8_t adjusted = opcode - opcodeBase;
+                address += (adjusted / lineRange) * minInstLength;
+                line += lineBase + adjusted % lineRange;
+                emit();
+                continue;
+            }
+
+            switch (opcode)
+            {
+                case 0:
+                {
+                    const uint64_t len = cur.ReadUleb();
+                    const size_t next = cur.GetPos() + static_cast<size_t>(len);
+                    const uint8_t sub = static_cast<uint8_t>(
+                        cur.ReadUnsigned(1));
+                    if (sub == 1)
+                    {
+                        // DW_LNE_end_sequence, the address is one past the
+                        // last instruction.
+                        if (sequenceInCode)
+                        {
+                            table.records.push_back(
+                                { address - layout.base, 0, 0 });
+                        }
+                        address = 0;
+                        file = 1;
+                        line = 1;
+                        sequenceInCode = false;
+                    }
+                    else if (sub == 2 && len > 1)
+                    {
+                        // DW_LNE_set_address
+                        const uint64_t size = std::min<uint64_t>(len - 1, 8);
+                        address = cur.ReadUnsigned(static_cast<size_t>(size));
+                    }
+                    cur.Seek(next);
+                    break;
+                }
+                case 1:
+                    // DW_LNS_copy
+                    emit();
+                    break;
+                case 2:
+                    // DW_LNS_advance_pc
+                    address += cur.ReadUleb() * minInstLength;
+                    break;
+                case 3:
+                    // DW_LNS_advance_line
+                    line += cur.ReadSleb();
+                    break;
+                case 4:
+                    // DW_LNS_set_file
+                    file = cur.ReadUleb();
+                    break;
+                case 8:
+                    // DW_LNS_const_add_pc
+                    address += ((255 - opcodeBase) / lineRange)
+                               * minInstLength;
+                    break;
+                case 9:
+                    // DW_LNS_fixed_advance_pc
+                    address += cur.ReadUnsigned(2);
+                    break;
+                default:
+                    // Operands of the remaining standard opcodes are
+                    // skipped by their declared count.
+                    for (uint8_t i = 0; i < opcodeLengths[opcode - 1]; i++)
+                        cur.ReadUleb();
+                    break;
+            }
+        }
+
+        cur.Seek(unitEnd);
+    }
+}
+
+// Separate debug files are searched next to the module, in its .debug
+// directory and below /usr/lib/debug, like gdb does.
+static bool LoadDebugLink(
+    const std::string& path, const std::string& link, DebugSections& sections,
+    std::vector<uint8_t>& file)
+{
+    const size_t slash = path.find_last_of('/');
+    const std::string dir = slash != std::string::npos ? path.substr(0, slash)
+                                                       : std::string(".");
+
+    const std::string candidates[] = {
+        dir + "/" + link,
+        dir + "/.debug/" + link,
+        "/usr/lib/debug" + dir + "/" + link,
+    };
+
+    for (auto& candidate : candidates)
+    {
+        if (candidate == path || !ReadFile(candidate, file))
+            continue;
+
+        DebugSections debug;
+        if (ReadElf(candidate.c_str(), file, nullptr, debug)
+            && debug.line.data != nullptr)
+        {
+            sections = debug;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool SourceLines::Load(const char* path, Table& table)
+{
+    std::vector<uint8_t> file;
+    if (!ReadFile(path, file))
+    {
+        printf("Unable to read %s\n", path);
+        return false;
+    }
+
+    ElfLayout layout;
+    DebugSections sections;
+    if (!ReadElf(path, file, &layout, sections) || layout.code.empty())
+    {
+        printf("Not an ELF file with code: %s\n", path);
+        return false;
+    }
+
+    // The sections point into the file they came from.
+    std::vector<uint8_t> debugFile;
+    if (sections.line.data == nullptr
+        && (sections.debugLink.empty()
+            || !LoadDebugLink(path, sections.debugLink, sections, debugFile)))
+    {
+        printf("No source lines for %s\n", path);
+        return false;
+    }
+
+    ReadLineTable(sections, layout, table);
+    if (table.records.empty())
+    {
+        printf("No source lines for %s\n", path);
+        return false;
+    }
+
+    SortRecords(table);
+    return true;
+}
+
+#endif
+
+} // namespace CovCane
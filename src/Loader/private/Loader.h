@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#ifdef _WIN32
+
+// Loads CovCane.dll from the loader's directory into a suspended process.
+bool InjectLibrary(HANDLE hProc, bool quiet = false);
+
+#else
+
+// libCovCane.so from the loader's directory.
+std::string GetDefaultRuntimePath();
+
+// Copies the environment with the runtime added in front of LD_PRELOAD.
+// COVCANE_COVERAGE_FILE and COVCANE_LOG are replaced by the ones given.
+std::vector<std::string> BuildEnvironment(
+    const std::string& runtimePath, const char* coverageFile,
+    const char* logFile = nullptr);
+
+#endif
+
+// Runs a command template for every file of a corpus on parallel children
+// and merges their coverage, see PrintBatchUsage.
+int RunBatch(int argc, const char* argv[]);
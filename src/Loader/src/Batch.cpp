@@ -0,0 +1,665 @@
+#include "Loader.h"
+#include "CovCane/CoverageFile.h"
+#include "CovCane/CoverageMerge.h"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+using namespace CovCane;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+struct BatchOptions
+{
+    const char* corpus = nullptr;
+    const char* output = nullptr;
+    unsigned jobs = 0;
+    // Zero disables the timeout.
+    uint32_t timeoutMs = 10000;
+    std::string runtimePath;
+    std::vector<std::string> command;
+};
+
+struct Run
+{
+#ifdef _WIN32
+    HANDLE process = nullptr;
+#else
+    pid_t pid = 0;
+#endif
+    bool active = false;
+    bool timedOut = false;
+    size_t input = 0;
+    // Every slot reuses its own file, it is merged and removed after a run.
+    std::string coverageFile;
+    // Runtime log of the slot, kept only for runs that crashed or timed out.
+    std::string logFile;
+    Clock::time_point deadline;
+};
+
+enum class Outcome
+{
+    Success,
+    Failure,
+    Crash,
+    Timeout,
+};
+
+struct FinishedRun
+{
+    size_t slot;
+    Outcome outcome;
+};
+
+struct FileSink
+{
+    FILE* file;
+
+    void Write(const void* data, size_t len)
+    {
+        fwrite(data, 1, len, file);
+    }
+};
+
+} // namespace
+
+static void PrintBatchUsage()
+{
+    printf("Usage: Loader batch -i <corpus dir> -o <merged coverage> "
+           "[-j <jobs>] [-t <timeout ms>] [-l <runtime>] -- <program> "
+           "[args...]\n"
+           "       @@ in the arguments is replaced by the input, without it "
+           "the input is passed on stdin.\n");
+}
+
+// Replaces every @@ with the input.
+static std::vector<std::string> ExpandCommand(
+    const std::vector<std::string>& command,
+    const std::string& input,
+    bool& usesStdin)
+{
+    usesStdin = true;
+
+    std::vector<std::string> args;
+    args.reserve(command.size());
+    for (auto& arg : command)
+    {
+        std::string expanded = arg;
+        for (size_t pos = expanded.find("@@"); pos != std::string::npos;
+             pos = expanded.find("@@", pos + input.size()))
+        {
+            expanded.replace(pos, 2, input);
+            usesStdin = false;
+        }
+        args.push_back(std::move(expanded));
+    }
+    return args;
+}
+
+static Clock::time_point GetNextDeadline(const std::vector<Run>& runs)
+{
+    Clock::time_point deadline = Clock::time_point::max();
+    for (auto& run : runs)
+    {
+        if (run.active && !run.timedOut)
+            deadline = std::min(deadline, run.deadline);
+    }
+    return deadline;
+}
+
+#ifdef _WIN32
+
+// Quotes an argument so CommandLineToArgvW splits it back unchanged.
+static void AppendArgument(std::string& commandLine, const std::string& arg)
+{
+    if (!commandLine.empty())
+        commandLine += ' ';
+
+    if (!arg.empty() && arg.find_first_of(" \t\"") == std::string::npos)
+    {
+        commandLine += arg;
+        return;
+    }
+
+    commandLine += '"';
+    size_t backslashes = 0;
+    for (char c : arg)
+    {
+        if (c == '\\')
+        {
+            backslashes++;
+            continue;
+        }
+        commandLine.append(c == '"' ? backslashes * 2 + 1 : backslashes, '\\');
+        backslashes = 0;
+        commandLine += c;
+    }
+    commandLine.append(backslashes * 2, '\\');
+    commandLine += '"';
+}
+
+// Environment block of the loader with COVCANE_COVERAGE_FILE and
+// COVCANE_LOG replaced.
+static std::vector<char> BuildEnvironmentBlock(
+    const std::string& coverageFile, const std::string& logFile)
+{
+    std::vector<char> block;
+
+    char* env = GetEnvironmentStringsA();
+    for (const char* var = env; *var != '\0'; var += strlen(var) + 1)
+    {
+        if (_strnicmp(var, "COVCANE_COVERAGE_FILE=", 22) == 0
+            || _strnicmp(var, "COVCANE_LOG=", 12) == 0)
+            continue;
+        block.insert(block.end(), var, var + strlen(var) + 1);
+    }
+    FreeEnvironmentStringsA(env);
+
+    for (const std::string& entry :
+         { "COVCANE_COVERAGE_FILE=" + coverageFile, "COVCANE_LOG=" + logFile })
+    {
+        block.insert(
+            block.end(), entry.c_str(), entry.c_str() + entry.size() + 1);
+    }
+    block.push_back('\0');
+
+    return block;
+}
+
+static bool StartRun(
+    const BatchOptions& opts, const std::string& input, Run& run)
+{
+    bool usesStdin = false;
+    const std::vector<std::string> args = ExpandCommand(
+        opts.command, input, usesStdin);
+
+    std::string commandLine;
+    for (auto& arg : args)
+    {
+        AppendArgument(commandLine, arg);
+    }
+
+    std::vector<char> env = BuildEnvironmentBlock(
+        run.coverageFile, run.logFile);
+
+    STARTUPINFOA si{};
+    si.cb = sizeof(si);
+
+    HANDLE inputFile = INVALID_HANDLE_VALUE;
+    if (usesStdin)
+    {
+        SECURITY_ATTRIBUTES sa{ sizeof(sa), nullptr, TRUE };
+        inputFile = CreateFileA(
+            input.c_str(), GENERIC_READ, FILE_SHARE_READ, &sa, OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (inputFile == INVALID_HANDLE_VALUE)
+        {
+            printf("Unable to open input: %s\n", input.c_str());
+            return false;
+        }
+
+        si.dwFlags = STARTF_USESTDHANDLES;
+        si.hStdInput = inputFile;
+        si.hStdOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+        si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+    }
+
+    PROCESS_INFORMATION pi{};
+    const BOOL created = CreateProcessA(
+        nullptr, commandLine.data(), nullptr, nullptr, usesStdin,
+        CREATE_SUSPENDED, env.data(), nullptr, &si, &pi);
+
+    if (inputFile != INVALID_HANDLE_VALUE)
+        CloseHandle(inputFile);
+
+    if (created == FALSE)
+    {
+        printf("CreateProcess failed (%d).\n", GetLastError());
+        return false;
+    }
+
+    if (!InjectLibrary(pi.hProcess, true)
+        || ResumeThread(pi.hThread) == static_cast<DWORD>(-1))
+    {
+        TerminateProcess(pi.hProcess, EXIT_FAILURE);
+        CloseHandle(pi.hProcess);
+        CloseHandle(pi.hThread);
+        return false;
+    }
+
+    CloseHandle(pi.hThread);
+    run.process = pi.hProcess;
+    return true;
+}
+
+// Waits until a run finishes or the next deadline passes, runs past their
+// deadline are terminated.
+static void WaitForRuns(
+    std::vector<Run>& runs, std::vector<FinishedRun>& finished)
+{
+    HANDLE handles[MAXIMUM_WAIT_OBJECTS];
+    size_t slots[MAXIMUM_WAIT_OBJECTS];
+    DWORD count = 0;
+    for (size_t i = 0; i < runs.size(); i++)
+    {
+        if (!runs[i].active)
+            continue;
+        handles[count] = runs[i].process;
+        slots[count] = i;
+        count++;
+    }
+
+    DWORD timeout = INFINITE;
+    const Clock::time_point deadline = GetNextDeadline(runs);
+    if (deadline != Clock::time_point::max())
+    {
+        const auto now = Clock::now();
+        timeout = deadline <= now
+                      ? 0
+                      : static_cast<DWORD>(
+                          std::chrono::duration_cast<std::chrono::milliseconds>(
+                              deadline - now)
+                              .count()
+                          + 1);
+    }
+
+    const DWORD res = WaitForMultipleObjects(count, handles, FALSE, timeout);
+    if (res >= WAIT_OBJECT_0 && res < WAIT_OBJECT_0 + count)
+    {
+        const size_t slot = slots[res - WAIT_OBJECT_0];
+        Run& run = runs[slot];
+
+        DWORD exitCode = 0;
+        GetExitCodeProcess(run.process, &exitCode);
+        CloseHandle(run.process);
+        run.process = nullptr;
+
+        // Unhandled exceptions end the process with their NTSTATUS code.
+        Outcome outcome = Outcome::Success;
+        if (run.timedOut)
+            outcome = Outcome::Timeout;
+        else if (exitCode >= 0xC0000000)
+            outcome = Outcome::Crash;
+        else if (exitCode != 0)
+            outcome = Outcome::Failure;
+
+        finished.push_back({ slot, outcome });
+    }
+
+    const auto now = Clock::now();
+    for (auto& run : runs)
+    {
+        if (run.active && !run.timedOut && run.deadline <= now)
+        {
+            TerminateProcess(run.process, WAIT_TIMEOUT);
+            run.timedOut = true;
+        }
+    }
+}
+
+#else
+
+static bool StartRun(
+    const BatchOptions& opts, const std::string& input, Run& run)
+{
+    bool usesStdin = false;
+    const std::vector<std::string> args = ExpandCommand(
+        opts.command, input, usesStdin);
+
+    std::vector<char*> argv;
+    for (auto& arg : args)
+    {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    const std::vector<std::string> env = BuildEnvironment(
+        opts.runtimePath, run.coverageFile.c_str(), run.logFile.c_str());
+
+    std::vector<char*> envp;
+    for (auto& var : env)
+    {
+        envp.push_back(const_cast<char*>(var.c_str()));
+    }
+    envp.push_back(nullptr);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (usesStdin)
+    {
+        posix_spawn_file_actions_addopen(
+            &actions, STDIN_FILENO, input.c_str(), O_RDONLY, 0);
+    }
+
+    // The loader blocks SIGCHLD, the child starts with an empty mask.
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+    const int err = posix_spawnp(
+        &run.pid, argv[0], &actions, &attr, argv.data(), envp.data());
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (err != 0)
+    {
+        printf("posix_spawnp(%s) failed: %s\n", argv[0], strerror(err));
+        return false;
+    }
+    return true;
+}
+
+// Waits until a run finishes or the next deadline passes, runs past their
+// deadline are killed. SIGCHLD is blocked, so an exit between two waits
+// stays pending and is never missed.
+static void WaitForRuns(
+    std::vector<Run>& runs, std::vector<FinishedRun>& finished)
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+
+    const Clock::time_point deadline = GetNextDeadline(runs);
+    if (deadline == Clock::time_point::max())
+    {
+        sigwaitinfo(&set, nullptr);
+    }
+    else
+    {
+        const auto now = Clock::now();
+        const auto remaining = deadline > now ? deadline - now
+                                              : Clock::duration::zero();
+        const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            remaining)
+                            .count();
+
+        timespec ts{};
+        ts.tv_sec = static_cast<time_t>(ns / 1000000000);
+        ts.tv_nsec = static_cast<long>(ns % 1000000000);
+        sigtimedwait(&set, nullptr, &ts);
+    }
+
+    int status = 0;
+    pid_t pid = 0;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+        for (size_t i = 0; i < runs.size(); i++)
+        {
+            Run& run = runs[i];
+            if (!run.active || run.pid != pid)
+                continue;
+
+            Outcome outcome = Outcome::Success;
+            if (run.timedOut)
+                outcome = Outcome::Timeout;
+            else if (WIFSIGNALED(status))
+                outcome = Outcome::Crash;
+            else if (WEXITSTATUS(status) != 0)
+                outcome = Outcome::Failure;
+
+            finished.push_back({ i, outcome });
+            break;
+        }
+    }
+
+    const auto now = Clock::now();
+    for (auto& run : runs)
+    {
+        if (run.active && !run.timedOut && run.deadline <= now)
+        {
+            kill(run.pid, SIGKILL);
+            run.timedOut = true;
+        }
+    }
+}
+
+#endif
+
+static bool ParseBatchOptions(int argc, const char* argv[], BatchOptions& opts)
+{
+    int i = 0;
+    for (; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--") == 0)
+        {
+            i++;
+            break;
+        }
+        if (i + 1 >= argc)
+            return false;
+
+        if (strcmp(argv[i], "-i") == 0)
+            opts.corpus = argv[++i];
+        else if (strcmp(argv[i], "-o") == 0)
+            opts.output = argv[++i];
+        else if (strcmp(argv[i], "-j") == 0)
+            opts.jobs = static_cast<unsigned>(atoi(argv[++i]));
+        else if (strcmp(argv[i], "-t") == 0)
+            opts.timeoutMs = static_cast<uint32_t>(atoi(argv[++i]));
+        else if (strcmp(argv[i], "-l") == 0)
+            opts.runtimePath = argv[++i];
+        else
+            return false;
+    }
+
+    for (; i < argc; i++)
+    {
+        opts.command.push_back(argv[i]);
+    }
+
+    return opts.corpus != nullptr && opts.output != nullptr
+           && !opts.command.empty();
+}
+
+int RunBatch(int argc, const char* argv[])
+{
+    BatchOptions opts;
+    if (!ParseBatchOptions(argc, argv, opts))
+    {
+        PrintBatchUsage();
+        return EXIT_FAILURE;
+    }
+
+    std::vector<std::string> inputs;
+    {
+        namespace fs = std::filesystem;
+
+        std::error_code ec;
+        for (auto& entry : fs::directory_iterator(opts.corpus, ec))
+        {
+            if (entry.is_regular_file(ec))
+                inputs.push_back(entry.path().string());
+        }
+        if (ec)
+        {
+            printf("Unable to read corpus: %s\n", opts.corpus);
+            return EXIT_FAILURE;
+        }
+        std::sort(inputs.begin(), inputs.end());
+    }
+
+    if (opts.jobs == 0)
+        opts.jobs = std::max(1u, std::thread::hardware_concurrency());
+#ifdef _WIN32
+    opts.jobs = std::min<unsigned>(opts.jobs, MAXIMUM_WAIT_OBJECTS);
+#else
+    if (opts.runtimePath.empty())
+        opts.runtimePath = GetDefaultRuntimePath();
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, nullptr);
+#endif
+
+    std::vector<Run> runs(std::min<size_t>(opts.jobs, inputs.size()));
+    for (size_t i = 0; i < runs.size(); i++)
+    {
+        const std::string slot = std::string(opts.output) + ".run"
+                                 + std::to_string(i);
+        runs[i].coverageFile = slot + ".cov";
+        runs[i].logFile = slot + ".log";
+    }
+
+    auto start = Clock::now();
+
+    CoverageMerge::Accumulator merged;
+    CoverageFile::Reader reader;
+    std::vector<FinishedRun> finished;
+
+    size_t next = 0;
+    size_t active = 0;
+    size_t failed = 0;
+    size_t crashed = 0;
+    size_t timedOut = 0;
+    size_t missing = 0;
+    size_t notStarted = 0;
+
+    while (next < inputs.size() || active != 0)
+    {
+        for (auto& run : runs)
+        {
+            if (run.active || next >= inputs.size())
+                continue;
+
+            run.input = next++;
+
+            // A file left by an earlier run must not be merged again.
+            remove(run.coverageFile.c_str());
+
+            if (!StartRun(opts, inputs[run.input], run))
+            {
+                notStarted++;
+                continue;
+            }
+
+            run.active = true;
+            run.timedOut = false;
+            run.deadline = opts.timeoutMs != 0
+                               ? Clock::now()
+                                     + std::chrono::milliseconds(opts.timeoutMs)
+                               : Clock::time_point::max();
+            active++;
+        }
+
+        if (active == 0)
+            continue;
+
+        finished.clear();
+        WaitForRuns(runs, finished);
+
+        for (auto& done : finished)
+        {
+            Run& run = runs[done.slot];
+            run.active = false;
+            active--;
+
+            const std::string& input = inputs[run.input];
+            switch (done.outcome)
+            {
+                case Outcome::Success:
+                    break;
+                case Outcome::Failure:
+                    failed++;
+                    break;
+                case Outcome::Crash:
+                    crashed++;
+                    printf("Crash: %s\n", input.c_str());
+                    break;
+                case Outcome::Timeout:
+                    timedOut++;
+                    printf("Timeout: %s\n", input.c_str());
+                    break;
+            }
+
+            // The log of a crash or timeout is kept under the input's index
+            // before the slot reuses it.
+            if (done.outcome == Outcome::Crash
+                || done.outcome == Outcome::Timeout)
+            {
+                const std::string log = std::string(opts.output) + ".input"
+                                        + std::to_string(run.input) + ".log";
+                remove(log.c_str());
+                if (rename(run.logFile.c_str(), log.c_str()) == 0)
+                    printf("Log: %s\n", log.c_str());
+            }
+            else
+            {
+                remove(run.logFile.c_str());
+            }
+
+            // The runtime writes the file at shutdown, killed and crashed
+            // runs usually leave none.
+            if (reader.Open(run.coverageFile.c_str()))
+            {
+                merged.Add(reader);
+                reader.Close();
+            }
+            else
+            {
+                missing++;
+            }
+            remove(run.coverageFile.c_str());
+        }
+    }
+
+    const double elapsed = std::chrono::duration<double>(Clock::now() - start)
+                               .count();
+
+    CoverageFile::Builder builder = merged.Build(false);
+
+    FILE* fp = nullptr;
+#ifdef _WIN32
+    fopen_s(&fp, opts.output, "wb");
+#else
+    fp = fopen(opts.output, "wb");
+#endif
+    if (fp == nullptr)
+    {
+        printf("Unable to open output: %s\n", opts.output);
+        return EXIT_FAILURE;
+    }
+
+    FileSink sink{ fp };
+    const bool written = builder.Write(sink);
+    if (fclose(fp) != 0 || !written)
+    {
+        printf("Failed to write output: %s\n", opts.output);
+        return EXIT_FAILURE;
+    }
+
+    const uint64_t blockCount = reader.Open(opts.output)
+                                    ? reader.GetBlockCount()
+                                    : 0;
+
+    printf(
+        "Ran %zu inputs in %.3f s (%.1f/s) using %zu jobs: %zu failed, %zu "
+        "crashed, %zu timed out, %zu not started\n",
+        inputs.size(), elapsed, elapsed > 0.0 ? inputs.size() / elapsed : 0.0,
+        runs.size(), failed, crashed, timedOut, notStarted);
+    printf(
+        "Merged %u coverage files into %llu blocks, %zu runs left none: %s\n",
+        merged.GetFileCount(), (unsigned long long)blockCount, missing,
+        opts.output);
+
+    return EXIT_SUCCESS;
+}
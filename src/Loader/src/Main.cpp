@@ -1,9 +1,25 @@
+#include "Loader.h"
+
 #include <iostream>
+#include <string.h>
 #include <string>
 
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <errno.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+extern char** environ;
+#endif
 
-static bool InjectLibrary(HANDLE hProc)
+#ifdef _WIN32
+
+bool InjectLibrary(HANDLE hProc, bool quiet)
 {
     // FIXME: This will not work if the child process is not large address
     // aware.
@@ -52,13 +68,17 @@ static bool InjectLibrary(HANDLE hProc)
     WaitForSingleObject(hThread, INFINITE);
     CloseHandle(hThread);
 
-    printf("Successfully injected dll: %s\n", dllPath);
+    if (!quiet)
+        printf("Successfully injected dll: %s\n", dllPath);
 
     return true;
 }
 
 int main(int argc, const char* argv[])
 {
+    if (argc > 1 && strcmp(argv[1], "batch") == 0)
+        return RunBatch(argc - 2, argv + 2);
+
     if (argc <= 1)
     {
         printf("Missing argument: <process>\n");
@@ -118,4 +138,171 @@ int main(int argc, const char* argv[])
     CloseHandle(pi.hThread);
 
     return exitCode;
-}
\ No newline at end of file
+}
+
+#else
+
+std::string GetDefaultRuntimePath()
+{
+    char exePath[4096]{};
+    if (readlink("/proc/self/exe", exePath, sizeof(exePath) - 1) == -1)
+        return "libCovCane.so";
+
+    char* slash = strrchr(exePath, '/');
+    if (slash != nullptr)
+        *slash = '\0';
+    return std::string(exePath) + "/libCovCane.so";
+}
+
+// The COVCANE_ variables reach the child unchanged.
+std::vector<std::string> BuildEnvironment(
+    const std::string& runtimePath, const char* coverageFile,
+    const char* logFile)
+{
+    std::vector<std::string> env;
+    std::string preload = runtimePath;
+
+    for (char** var = environ; *var != nullptr; var++)
+    {
+        if (strncmp(*var, "LD_PRELOAD=", 11) == 0)
+        {
+            if ((*var)[11] != '\0')
+                preload += std::string(":") + (*var + 11);
+            continue;
+        }
+        if (coverageFile != nullptr
+            && strncmp(*var, "COVCANE_COVERAGE_FILE=", 22) == 0)
+            continue;
+        if (logFile != nullptr && strncmp(*var, "COVCANE_LOG=", 12) == 0)
+            continue;
+        env.emplace_back(*var);
+    }
+
+    env.push_back("LD_PRELOAD=" + preload);
+    if (coverageFile != nullptr)
+        env.push_back(std::string("COVCANE_COVERAGE_FILE=") + coverageFile);
+    if (logFile != nullptr)
+        env.push_back(std::string("COVCANE_LOG=") + logFile);
+
+    return env;
+}
+
+static void PrintUsage()
+{
+    printf("Usage: Loader [-o <coverage file>] [-l <runtime>] [-q] "
+           "<program> [args...]\n"
+           "       Loader batch ...\n");
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1 && strcmp(argv[1], "batch") == 0)
+        return RunBatch(argc - 2, const_cast<const char**>(argv + 2));
+
+    const char* coverageFile = nullptr;
+    std::string runtimePath;
+    bool quiet = false;
+
+    int argi = 1;
+    for (; argi < argc && argv[argi][0] == '-'; argi++)
+    {
+        const std::string opt = argv[argi];
+        if (opt == "-q")
+            quiet = true;
+        else if (opt == "-o" && argi + 1 < argc)
+            coverageFile = argv[++argi];
+        else if (opt == "-l" && argi + 1 < argc)
+            runtimePath = argv[++argi];
+        else if (opt == "--")
+        {
+            argi++;
+            break;
+        }
+        else
+        {
+            PrintUsage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argi >= argc)
+    {
+        printf("Missing argument: <process>\n");
+        PrintUsage();
+        return EXIT_FAILURE;
+    }
+
+    if (runtimePath.empty())
+        runtimePath = GetDefaultRuntimePath();
+
+    const std::vector<std::string> env = BuildEnvironment(
+        runtimePath, coverageFile);
+
+    std::vector<char*> envp;
+    envp.reserve(env.size() + 1);
+    for (auto& var : env)
+    {
+        envp.push_back(const_cast<char*>(var.c_str()));
+    }
+    envp.push_back(nullptr);
+
+    // posix_spawn uses vfork semantics, the runtime initializes from its
+    // constructor before main and nothing else runs in between.
+    pid_t pid = 0;
+    const int err = posix_spawnp(
+        &pid, argv[argi], nullptr, nullptr, argv + argi, envp.data());
+    if (err != 0)
+    {
+        printf("posix_spawnp(%s) failed: %s\n", argv[argi], strerror(err));
+        return EXIT_FAILURE;
+    }
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) == -1)
+    {
+        if (errno != EINTR)
+        {
+            printf("waitpid failed: %s\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Shells report a signal as 128 + signal number.
+    int exitCode = EXIT_FAILURE;
+    if (WIFEXITED(status))
+    {
+        exitCode = WEXITSTATUS(status);
+        if (!quiet)
+            fprintf(stderr, "Process %d exited with %d\n", pid, exitCode);
+    }
+    else if (WIFSIGNALED(status))
+    {
+        exitCode = 128 + WTERMSIG(status);
+        if (!quiet)
+        {
+            fprintf(
+                stderr, "Process %d terminated by signal %d\n", pid,
+                WTERMSIG(status));
+        }
+    }
+
+    if (!quiet)
+    {
+        if (coverageFile == nullptr)
+            coverageFile = getenv("COVCANE_COVERAGE_FILE");
+        if (coverageFile != nullptr)
+            fprintf(stderr, "Coverage: %s\n", coverageFile);
+
+        const char* exportDir = getenv("COVCANE_EXPORT_DIR");
+        if (getenv("COVCANE_EXPORT") != nullptr)
+        {
+            fprintf(
+                stderr, "Exported coverage: %s\n",
+                exportDir != nullptr ? exportDir : ".");
+        }
+    }
+
+    return exitCode;
+}
+
+#endif
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "Test.h"
+
+namespace CovCane::Tests {
+
+// Measures the cost of a call and return, run it with and without
+// COVCANE_CONTEXT to get the overhead of the call stack hash.
+class TestCallContext final : public Test
+{
+public:
+    int Run() const override;
+};
+
+} // namespace CovCane::Tests
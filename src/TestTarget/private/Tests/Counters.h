@@ -0,0 +1,17 @@
+#pragma once
+
+#include "Test.h"
+
+namespace CovCane::Tests {
+
+// Measures the block throughput with 1, 4 and 16 threads, run it once per
+// COVCANE_COUNTER_MODE to compare the counter update strategies. With
+// COVCANE_PROFILE the recorded hits are read back, atomic and per-thread
+// counters fail the test unless they counted every call.
+class TestCounterThroughput final : public Test
+{
+public:
+    int Run() const override;
+};
+
+} // namespace CovCane::Tests
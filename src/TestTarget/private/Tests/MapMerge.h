@@ -0,0 +1,15 @@
+#pragma once
+
+#include "Test.h"
+
+namespace CovCane::Tests {
+
+// Validates the AVX2 merge kernel against the scalar one and reports the
+// merge time for map sizes from 64 KiB to 4 MiB.
+class TestMapMerge final : public Test
+{
+public:
+    int Run() const override;
+};
+
+} // namespace CovCane::Tests
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "Test.h"
+
+namespace CovCane::Tests {
+
+// Compares the dirty range reset with a plain memset of the whole map for
+// map sizes from 64 KiB to 16 MiB.
+class TestMapReset final : public Test
+{
+public:
+    int Run() const override;
+};
+
+} // namespace CovCane::Tests
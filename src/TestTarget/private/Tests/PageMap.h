@@ -0,0 +1,15 @@
+#pragma once
+
+#include "Test.h"
+
+namespace CovCane::Tests {
+
+// Compares the linear section scan the fault handler used with the page
+// bitmap lookup for up to hundreds of modules.
+class TestPageMapLookup final : public Test
+{
+public:
+    int Run() const override;
+};
+
+} // namespace CovCane::Tests
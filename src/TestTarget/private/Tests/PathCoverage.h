@@ -0,0 +1,15 @@
+#pragma once
+
+#include "Test.h"
+
+namespace CovCane::Tests {
+
+// Measures the cost of a block on a data dependent path, run it with and
+// without COVCANE_NGRAM to compare path coverage with plain block coverage.
+class TestPathThroughput final : public Test
+{
+public:
+    int Run() const override;
+};
+
+} // namespace CovCane::Tests
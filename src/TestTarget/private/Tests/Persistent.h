@@ -0,0 +1,15 @@
+#pragma once
+
+#include "Test.h"
+
+namespace CovCane::Tests {
+
+// Fuzzes a small parser through the persistent loop of the runtime and
+// reports executions per second, runs the loop natively without CovCane.
+class TestPersistentLoop final : public Test
+{
+public:
+    int Run() const override;
+};
+
+} // namespace CovCane::Tests
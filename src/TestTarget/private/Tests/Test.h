@@ -5,6 +5,18 @@
 #include <cstdio>
 #include <utility>
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+#ifdef _MSC_VER
+#define TEST_NOINLINE __declspec(noinline)
+#else
+#define TEST_NOINLINE __attribute__((noinline))
+#endif
+
 namespace CovCane::Tests {
 
 // Interface
@@ -14,4 +26,32 @@ public:
     virtual int Run() const = 0;
 };
 
+// Copies the environment variable into buf, or fallback when it is not set.
+template<size_t N>
+const char* GetEnvOr(const char* name, const char* fallback, char (&buf)[N])
+{
+#ifdef _MSC_VER
+    size_t len = 0;
+    if (getenv_s(&len, buf, N, name) != 0 || len == 0)
+        snprintf(buf, N, "%s", fallback);
+#else
+    const char* env = getenv(name);
+    snprintf(buf, N, "%s", env != nullptr ? env : fallback);
+#endif
+    return buf;
+}
+
+// Runtime API function or nullptr when the process is not instrumented.
+template<typename T> T ResolveExport(const char* name)
+{
+#ifdef _WIN32
+    HMODULE mod = GetModuleHandleA("CovCane.dll");
+    if (mod == nullptr)
+        return nullptr;
+    return reinterpret_cast<T>(GetProcAddress(mod, name));
+#else
+    return reinterpret_cast<T>(dlsym(RTLD_DEFAULT, name));
+#endif
+}
+
 } // namespace CovCane::Tests
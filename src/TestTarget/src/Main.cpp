@@ -1,9 +1,17 @@
 #include <iostream>
+#include <memory>
 #include <vector>
 #include <chrono>
 
 #include "Tests/CppExceptions.h"
 #include "Tests/LongJmp.h"
+#include "Tests/Counters.h"
+#include "Tests/MapMerge.h"
+#include "Tests/MapReset.h"
+#include "Tests/Persistent.h"
+#include "Tests/CallContext.h"
+#include "Tests/PathCoverage.h"
+#include "Tests/PageMap.h"
 
 namespace CovCane::Tests {
 
@@ -31,6 +39,13 @@ TestCases LoadTests()
         ADD_TEST(TestCppExceptionPrimitiveFloat);
         ADD_TEST(TestCppExceptionPrimitiveDouble);
         ADD_TEST(TestLongJmp);
+        ADD_TEST(TestCounterThroughput);
+        ADD_TEST(TestMapMerge);
+        ADD_TEST(TestMapReset);
+        ADD_TEST(TestPersistentLoop);
+        ADD_TEST(TestCallContext);
+        ADD_TEST(TestPathThroughput);
+        ADD_TEST(TestPageMapLookup);
     }
 #undef ADD_TEST
 
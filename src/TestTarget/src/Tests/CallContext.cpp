@@ -0,0 +1,53 @@
+#include "Tests/CallContext.h"
+
+#include <chrono>
+
+namespace CovCane::Tests {
+
+constexpr uint32_t Iterations = 1000000;
+
+TEST_NOINLINE uint64_t ContextLeaf(uint64_t state)
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+// Nested calls so the hash sees more than one frame.
+TEST_NOINLINE uint64_t ContextInner(uint64_t state)
+{
+    return ContextLeaf(state) + 1;
+}
+
+TEST_NOINLINE uint64_t ContextOuter(uint64_t state)
+{
+    return ContextInner(state) ^ 0x55;
+}
+
+int TestCallContext::Run() const
+{
+    char mode[32];
+    GetEnvOr("COVCANE_CONTEXT", "off", mode);
+
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (uint32_t i = 0; i < Iterations; i++)
+    {
+        state = ContextOuter(state);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    // Every iteration performs three calls and three returns.
+    const double elapsed = std::chrono::duration<double>(end - start).count();
+    const double calls = 3.0 * Iterations;
+
+    printf(
+        "     context %-4s %8.2f ns/call (%llx)\n", mode,
+        elapsed * 1e9 / calls, (unsigned long long)state);
+
+    return EXIT_SUCCESS;
+}
+
+} // namespace CovCane::Tests
@@ -0,0 +1,141 @@
+#include "Tests/Counters.h"
+#include "CovCane.h"
+#include "CovCane/CoverageFile.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+namespace CovCane::Tests {
+
+constexpr uint32_t IterationsPerThread = 100000;
+
+TEST_NOINLINE uint64_t CounterStep(uint64_t state)
+{
+    // Simple xorshift so the call can not be folded away.
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+static uint64_t CounterWorker(uint64_t seed)
+{
+    uint64_t state = seed;
+    for (uint32_t i = 0; i < IterationsPerThread; i++)
+    {
+        state = CounterStep(state);
+    }
+    return state;
+}
+
+static double MeasureThreads(size_t threadCount)
+{
+    std::vector<std::thread> threads;
+    std::atomic<uint64_t> sink{ 0 };
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < threadCount; i++)
+    {
+        threads.emplace_back(
+            [&sink, i]() { sink += CounterWorker(0x9E3779B97F4A7C15ull + i); });
+    }
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    const double elapsed = std::chrono::duration<double>(end - start).count();
+    const double calls = double(threadCount) * IterationsPerThread;
+
+    return elapsed > 0.0 ? calls / elapsed : 0.0;
+}
+
+// Hit count of the block at the entry of CounterStep, read back through a
+// coverage export. Returns false if the process is not instrumented or does
+// not profile.
+static bool ReadStepHits(uint64_t& hits)
+{
+    auto exportCoverage = ResolveExport<CovCane_ExportCoverage_t>(
+        "CovCane_ExportCoverage");
+    if (exportCoverage == nullptr)
+        return false;
+
+    const char* path = "CovCane.counters.cov";
+    if (exportCoverage("cov", path) == 0)
+        return false;
+
+    CoverageFile::Reader reader;
+    if (!reader.Open(path) || !reader.HasHitCounts())
+    {
+        reader.Close();
+        std::remove(path);
+        return false;
+    }
+
+    bool found = false;
+    const uintptr_t step = reinterpret_cast<uintptr_t>(&CounterStep);
+    for (uint32_t i = 0; i < reader.GetModuleCount(); i++)
+    {
+        const CoverageFile::ModuleEntry& mod = reader.GetModule(i);
+        if (step < mod.base || step - mod.base >= mod.size)
+            continue;
+
+        const uint32_t offset = static_cast<uint32_t>(step - mod.base);
+        reader.ForEachBlock(i, [&](uint32_t blockOffset, uint64_t count) {
+            if (blockOffset == offset)
+            {
+                hits = count;
+                found = true;
+            }
+        });
+    }
+
+    reader.Close();
+    std::remove(path);
+    return found;
+}
+
+int TestCounterThroughput::Run() const
+{
+    char mode[32];
+    GetEnvOr("COVCANE_COUNTER_MODE", "racy", mode);
+
+    // Racy increments may be lost, the other modes must count every call.
+    const bool exact = strcmp(mode, "racy") != 0;
+
+    int res = EXIT_SUCCESS;
+    for (size_t threadCount : { 1, 4, 16 })
+    {
+        uint64_t before = 0;
+        const bool counted = ReadStepHits(before);
+
+        const double callsPerSec = MeasureThreads(threadCount);
+
+        uint64_t after = 0;
+        if (!counted || !ReadStepHits(after))
+        {
+            printf(
+                "     %-6s %2zu threads: %12.0f calls/s\n", mode,
+                threadCount, callsPerSec);
+            continue;
+        }
+
+        const uint64_t expected = uint64_t(threadCount) * IterationsPerThread;
+        const uint64_t hits = after - before;
+        printf(
+            "     %-6s %2zu threads: %12.0f calls/s, %llu of %llu hits\n",
+            mode, threadCount, callsPerSec, (unsigned long long)hits,
+            (unsigned long long)expected);
+
+        if (exact && hits != expected)
+            res = EXIT_FAILURE;
+    }
+
+    return res;
+}
+
+} // namespace CovCane::Tests
@@ -0,0 +1,90 @@
+#include "Tests/MapMerge.h"
+#include "CoverageMap.h"
+
+#include <chrono>
+#include <random>
+#include <vector>
+
+namespace CovCane::Tests {
+
+using MergeFn = void (*)(
+    uint8_t* dst, const uint8_t* src, size_t len, CoverageMap::MergeOp op);
+
+// Number of thread maps merged per measurement.
+constexpr size_t MapCount = 8;
+
+static std::vector<uint8_t> CreateMap(size_t size, std::mt19937& rng)
+{
+    std::vector<uint8_t> map(size);
+
+    // Roughly one in eight entries hit, similar to a warmed up target.
+    for (auto& entry : map)
+    {
+        if ((rng() & 7) == 0)
+            entry = static_cast<uint8_t>(rng());
+    }
+    return map;
+}
+
+static double MeasureMerge(
+    MergeFn fn,
+    std::vector<uint8_t>& dst,
+    const std::vector<std::vector<uint8_t>>& maps,
+    CoverageMap::MergeOp op)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+    for (auto& map : maps)
+    {
+        fn(dst.data(), map.data(), dst.size(), op);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    return std::chrono::duration<double, std::micro>(end - start).count()
+           / maps.size();
+}
+
+int TestMapMerge::Run() const
+{
+    std::mt19937 rng(0xC0C0CA4E);
+
+    const bool hasAvx2 = CoverageMap::HasAvx2();
+
+    for (size_t size = 64 * 1024; size <= 4 * 1024 * 1024; size *= 4)
+    {
+        std::vector<std::vector<uint8_t>> maps;
+        for (size_t i = 0; i < MapCount; i++)
+        {
+            maps.push_back(CreateMap(size, rng));
+        }
+
+        for (auto op : { CoverageMap::MergeOp::Or,
+                         CoverageMap::MergeOp::SaturatingAdd })
+        {
+            std::vector<uint8_t> scalar(size);
+            std::vector<uint8_t> simd(size);
+
+            const double scalarUs = MeasureMerge(
+                CoverageMap::MergeScalar, scalar, maps, op);
+
+            double simdUs = 0.0;
+            if (hasAvx2)
+            {
+                simdUs = MeasureMerge(CoverageMap::MergeAvx2, simd, maps, op);
+                if (scalar != simd)
+                {
+                    printf("     AVX2 merge result differs from scalar\n");
+                    return EXIT_FAILURE;
+                }
+            }
+
+            printf(
+                "     %5zu KiB %-3s scalar: %9.1f us/map, avx2: %9.1f us/map\n",
+                size / 1024, op == CoverageMap::MergeOp::Or ? "or" : "add",
+                scalarUs, simdUs);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+} // namespace CovCane::Tests
@@ -0,0 +1,81 @@
+#include "Tests/MapReset.h"
+#include "CoverageMap.h"
+
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <vector>
+
+namespace CovCane::Tests {
+
+constexpr size_t Iterations = 200;
+
+// Entries touched by one simulated input.
+constexpr size_t HitsPerIteration = 2000;
+
+template<typename F> static double MeasureUs(F&& f)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+    f();
+    auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double, std::micro>(end - start).count();
+}
+
+static void SimulateInput(
+    uint8_t* map, size_t mapSize, const std::vector<uint32_t>& indices)
+{
+    for (uint32_t index : indices)
+    {
+        map[index]++;
+        CoverageMap::MarkDirty(map, mapSize, index);
+    }
+}
+
+int TestMapReset::Run() const
+{
+    std::mt19937 rng(0xC0C0CA4E);
+
+    for (size_t mapSize = 64 * 1024; mapSize <= 16 * 1024 * 1024;
+         mapSize *= 4)
+    {
+        std::vector<uint8_t> map(CoverageMap::GetAllocationSize(mapSize));
+
+        std::vector<uint32_t> indices(HitsPerIteration);
+        for (auto& index : indices)
+        {
+            index = static_cast<uint32_t>(rng() & (mapSize - 1));
+        }
+
+        double memsetUs = 0.0;
+        double dirtyUs = 0.0;
+        for (size_t i = 0; i < Iterations; i++)
+        {
+            SimulateInput(map.data(), mapSize, indices);
+            memsetUs += MeasureUs([&]() {
+                memset(map.data(), 0, map.size());
+            });
+
+            SimulateInput(map.data(), mapSize, indices);
+            dirtyUs += MeasureUs([&]() {
+                CoverageMap::Reset(map.data(), mapSize);
+            });
+        }
+
+        for (uint8_t entry : map)
+        {
+            if (entry != 0)
+            {
+                printf("     Dirty reset left entries behind\n");
+                return EXIT_FAILURE;
+            }
+        }
+
+        printf(
+            "     %6zu KiB memset: %9.2f us, dirty reset: %9.2f us\n",
+            mapSize / 1024, memsetUs / Iterations, dirtyUs / Iterations);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+} // namespace CovCane::Tests
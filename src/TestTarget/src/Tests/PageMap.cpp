@@ -0,0 +1,119 @@
+#include "Tests/PageMap.h"
+#include "PageMap.h"
+
+#include <chrono>
+#include <random>
+#include <vector>
+
+namespace CovCane::Tests {
+
+using Range = std::pair<uintptr_t, uintptr_t>;
+
+constexpr size_t LookupCount = 1 << 20;
+
+// Modules are laid out like shared libraries, a few MB apart near the top
+// of the address space with a code section of 64KB to 1MB each.
+static std::vector<Range> CreateSections(size_t count, std::mt19937_64& rng)
+{
+    std::vector<Range> sections;
+    uintptr_t base = 0x7FF800000000ull;
+    for (size_t i = 0; i < count; i++)
+    {
+        const uintptr_t size = (1 + rng() % 16) * 0x10000;
+        sections.emplace_back(base + 0x1000, base + 0x1000 + size);
+        base += 0x400000 + (rng() % 64) * 0x10000;
+    }
+    return sections;
+}
+
+// Half of the addresses hit a section, the rest fall between them.
+static std::vector<uintptr_t> CreateLookups(
+    const std::vector<Range>& sections, std::mt19937_64& rng)
+{
+    std::vector<uintptr_t> lookups(LookupCount);
+    for (auto& addr : lookups)
+    {
+        const Range& section = sections[rng() % sections.size()];
+        if (rng() & 1)
+            addr = section.first + rng() % (section.second - section.first);
+        else
+            addr = section.second + 0x10000 + rng() % 0x100000;
+    }
+    return lookups;
+}
+
+TEST_NOINLINE bool LinearContains(
+    const std::vector<Range>& sections, uintptr_t addr)
+{
+    for (auto& pair : sections)
+    {
+        if (addr >= pair.first && addr < pair.second)
+            return true;
+    }
+    return false;
+}
+
+template<typename Fn>
+static double Measure(
+    const std::vector<uintptr_t>& lookups, Fn&& fn, size_t& hits)
+{
+    hits = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (uintptr_t addr : lookups)
+    {
+        hits += fn(addr) ? 1 : 0;
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    const double elapsed = std::chrono::duration<double>(end - start).count();
+    return elapsed * 1e9 / double(lookups.size());
+}
+
+int TestPageMapLookup::Run() const
+{
+    std::mt19937_64 rng(0x9E3779B97F4A7C15ull);
+
+    for (size_t moduleCount : { 1, 16, 128, 512 })
+    {
+        const std::vector<Range> sections = CreateSections(moduleCount, rng);
+        const std::vector<uintptr_t> lookups = CreateLookups(sections, rng);
+
+        PageMap pages;
+        for (auto& section : sections)
+        {
+            if (!pages.Add(section.first, section.second))
+            {
+                printf("Unable to add section %p\n", (void*)section.first);
+                return EXIT_FAILURE;
+            }
+        }
+
+        size_t linearHits = 0;
+        const double linearNs = Measure(
+            lookups,
+            [&](uintptr_t addr) { return LinearContains(sections, addr); },
+            linearHits);
+
+        size_t pageHits = 0;
+        const double pageNs = Measure(
+            lookups, [&](uintptr_t addr) { return pages.Contains(addr); },
+            pageHits);
+
+        // Sections are page aligned, both have to agree on every address.
+        if (linearHits != pageHits)
+        {
+            printf(
+                "Lookup mismatch with %zu modules: %zu vs %zu\n", moduleCount,
+                linearHits, pageHits);
+            return EXIT_FAILURE;
+        }
+
+        printf(
+            "     %3zu modules: linear %7.2f ns, page map %5.2f ns\n",
+            moduleCount, linearNs, pageNs);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+} // namespace CovCane::Tests
@@ -0,0 +1,69 @@
+#include "Tests/PathCoverage.h"
+
+#include <chrono>
+
+namespace CovCane::Tests {
+
+constexpr uint32_t Iterations = 1000000;
+
+// Every case is its own block, the order they run in depends on the state
+// so the path hash sees many different windows.
+TEST_NOINLINE uint64_t PathStep(uint64_t state)
+{
+    switch (state & 7)
+    {
+        case 0:
+            state += 0x9E3779B97F4A7C15ull;
+            break;
+        case 1:
+            state ^= state >> 29;
+            break;
+        case 2:
+            state *= 0xBF58476D1CE4E5B9ull;
+            break;
+        case 3:
+            state ^= state << 11;
+            break;
+        case 4:
+            state -= 0x94D049BB133111EBull;
+            break;
+        case 5:
+            state ^= state >> 31;
+            break;
+        case 6:
+            state = (state << 7) | (state >> 57);
+            break;
+        default:
+            state += 1;
+            break;
+    }
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+int TestPathThroughput::Run() const
+{
+    char mode[32];
+    GetEnvOr("COVCANE_NGRAM", "off", mode);
+
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (uint32_t i = 0; i < Iterations; i++)
+    {
+        state = PathStep(state);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    const double elapsed = std::chrono::duration<double>(end - start).count();
+
+    printf(
+        "     ngram %-4s %8.2f ns/iteration (%llx)\n", mode,
+        elapsed * 1e9 / Iterations, (unsigned long long)state);
+
+    return EXIT_SUCCESS;
+}
+
+} // namespace CovCane::Tests
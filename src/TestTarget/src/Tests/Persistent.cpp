@@ -0,0 +1,122 @@
+#include "Tests/Persistent.h"
+#include "CovCane.h"
+
+#include <chrono>
+#include <cstring>
+#include <vector>
+
+namespace CovCane::Tests {
+
+constexpr uint64_t Iterations = 100000;
+
+// Toy record parser with enough branches to produce varying coverage.
+TEST_NOINLINE int ParseRecord(const uint8_t* data, size_t size)
+{
+    if (size < 4)
+        return 0;
+    if (data[0] != 'C')
+        return 1;
+    if (data[1] != 'C')
+        return 2;
+
+    int checksum = 0;
+    for (size_t i = 2; i < size; i++)
+    {
+        switch (data[i] & 3)
+        {
+            case 0:
+                checksum += data[i];
+                break;
+            case 1:
+                checksum ^= data[i];
+                break;
+            case 2:
+                checksum -= data[i];
+                break;
+            default:
+                checksum = (checksum << 1) | 1;
+                break;
+        }
+    }
+    return checksum == 0x1337 ? 3 : 4;
+}
+
+struct Mutator
+{
+    uint64_t state = 0x2545F4914F6CDD1Dull;
+    uint8_t buffer[32]{ 'C', 'C', 0, 0 };
+
+    uint32_t next()
+    {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return static_cast<uint32_t>(state);
+    }
+};
+
+static int NextInput(void* user, const uint8_t** data, size_t* size)
+{
+    auto* mutator = static_cast<Mutator*>(user);
+
+    // Flip a few bytes of the previous input.
+    for (int i = 0; i < 3; i++)
+    {
+        const uint32_t rnd = mutator->next();
+        mutator->buffer[rnd % sizeof(mutator->buffer)] ^= uint8_t(rnd >> 8);
+    }
+
+    *data = mutator->buffer;
+    *size = 4 + mutator->next() % (sizeof(mutator->buffer) - 4);
+    return 1;
+}
+
+int TestPersistentLoop::Run() const
+{
+    auto setTarget = ResolveExport<CovCane_SetPersistentTarget_t>(
+        "CovCane_SetPersistentTarget");
+    auto runPersistent = ResolveExport<CovCane_RunPersistent_t>(
+        "CovCane_RunPersistent");
+
+    Mutator mutator;
+
+    if (setTarget == nullptr || runPersistent == nullptr)
+    {
+        // Not instrumented, measure the plain loop as reference.
+        auto start = std::chrono::high_resolution_clock::now();
+        for (uint64_t i = 0; i < Iterations; i++)
+        {
+            const uint8_t* data;
+            size_t size;
+            NextInput(&mutator, &data, &size);
+            ParseRecord(data, size);
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+
+        const double elapsed = std::chrono::duration<double>(end - start)
+                                   .count();
+        printf(
+            "     native: %.0f exec/s\n",
+            elapsed > 0.0 ? Iterations / elapsed : 0.0);
+        return EXIT_SUCCESS;
+    }
+
+    setTarget(ParseRecord);
+
+    CovCane_PersistentStats stats{};
+    if (runPersistent(NextInput, nullptr, &mutator, Iterations, &stats) == 0)
+        return EXIT_FAILURE;
+
+    if (stats.executions != Iterations)
+        return EXIT_FAILURE;
+
+    printf(
+        "     persistent: %.0f exec/s, %llu inputs with new coverage\n",
+        stats.elapsedSeconds > 0.0 ? stats.executions / stats.elapsedSeconds
+                                   : 0.0,
+        (unsigned long long)stats.newCoverage);
+
+    return EXIT_SUCCESS;
+}
+
+} // namespace CovCane::Tests
@@ -0,0 +1,92 @@
+#pragma once
+
+// Public interface of the CovCane runtime. Instrumented processes can either
+// link against it or resolve the exports at runtime, see the typedefs below.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+#define COVCANE_EXTERN extern "C"
+#else
+#define COVCANE_EXTERN
+#endif
+
+#if !defined(_WIN32)
+#define COVCANE_API COVCANE_EXTERN __attribute__((visibility("default")))
+#elif defined(COVCANE_EXPORTS)
+#define COVCANE_API COVCANE_EXTERN __declspec(dllexport)
+#else
+#define COVCANE_API COVCANE_EXTERN __declspec(dllimport)
+#endif
+
+// Writes the hot block report, requires COVCANE_PROFILE to be set. Passing
+// nullptr uses the configured output. Returns non-zero on success.
+COVCANE_API int CovCane_WriteProfile(const char* outputFile);
+typedef int (*CovCane_WriteProfile_t)(const char* outputFile);
+
+// Writes the covered blocks as "drcov", "sancov" or "cov". For sancov the
+// output is a directory receiving one file per module. Returns non-zero on
+// success.
+COVCANE_API int CovCane_ExportCoverage(const char* format, const char* output);
+typedef int (*CovCane_ExportCoverage_t)(
+    const char* format, const char* output);
+
+// Size of the coverage map in bytes, zero unless COVCANE_MAP is set.
+COVCANE_API size_t CovCane_GetCoverageMapSize(void);
+typedef size_t (*CovCane_GetCoverageMapSize_t)(void);
+
+// Merges the maps of all live threads into out, len must match the map size.
+COVCANE_API int CovCane_SnapshotCoverageMap(uint8_t* out, size_t len);
+typedef int (*CovCane_SnapshotCoverageMap_t)(uint8_t* out, size_t len);
+
+// Clears the coverage map entries touched since the last reset.
+COVCANE_API void CovCane_ResetCoverageMap(void);
+typedef void (*CovCane_ResetCoverageMap_t)(void);
+
+// Function driven by the persistent loop, same shape as a libFuzzer target.
+typedef int (*CovCane_PersistentTarget)(const uint8_t* data, size_t size);
+
+// Produces the next input, returning zero ends the loop.
+typedef int (*CovCane_InputCallback)(
+    void* user, const uint8_t** data, size_t* size);
+
+// Called after every execution with the number of map entries that reached a
+// new hit count bucket, may be nullptr.
+typedef void (*CovCane_ResultCallback)(
+    void* user, const uint8_t* data, size_t size, int result, size_t newEntries);
+
+typedef struct CovCane_PersistentStats
+{
+    uint64_t executions;
+    uint64_t newCoverage;
+    double elapsedSeconds;
+} CovCane_PersistentStats;
+
+// Marks the function that CovCane_RunPersistent calls.
+COVCANE_API void CovCane_SetPersistentTarget(CovCane_PersistentTarget target);
+typedef void (*CovCane_SetPersistentTarget_t)(CovCane_PersistentTarget target);
+
+// Calls the target with every input until the callback or maxIterations
+// stops it, the coverage map of the calling thread is reset between the
+// iterations while the translated code stays cached. Zero maxIterations
+// runs until the input callback stops. Returns non-zero on success.
+COVCANE_API int CovCane_RunPersistent(
+    CovCane_InputCallback nextInput,
+    CovCane_ResultCallback onResult,
+    void* user,
+    uint64_t maxIterations,
+    CovCane_PersistentStats* stats);
+typedef int (*CovCane_RunPersistent_t)(
+    CovCane_InputCallback nextInput,
+    CovCane_ResultCallback onResult,
+    void* user,
+    uint64_t maxIterations,
+    CovCane_PersistentStats* stats);
+
+// Starts the fork server at a point chosen by the target, everything
+// translated up to here is inherited by the children. Returns non-zero in
+// every forked child and zero when no driver is listening, the server
+// process itself never returns.
+COVCANE_API int CovCane_StartForkServer(void);
+typedef int (*CovCane_StartForkServer_t)(void);
@@ -0,0 +1,118 @@
+#pragma once
+
+// Local channel that controls a running instrumented process, a named pipe on
+// Windows and an abstract unix socket on Linux. A client connects, sends one
+// command line and reads one reply line:
+//   detach   restore native execution, translated code stays cached
+//   attach   instrument again, reusing the cached translations
+//   status   "attached" or "detached"
+// Replies to detach and attach start with "ok" or "error".
+
+#include <algorithm>
+#include <stddef.h>
+#include <string.h>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace CovCane::ControlChannel {
+
+// Longest command or reply including the line feed.
+constexpr size_t MaxLine = 256;
+
+// Milliseconds a client waits for the process to answer.
+constexpr unsigned Timeout = 5000;
+
+#ifdef _WIN32
+
+inline std::string GetPipeName(const char* name)
+{
+    return std::string("\\\\.\\pipe\\CovCane.") + name;
+}
+
+#else
+
+// Abstract sockets have no file to clean up after the process exits, the
+// name starts with a null byte. The server checks the credentials of every
+// client instead of file permissions.
+inline socklen_t GetAddress(const char* name, sockaddr_un& addr)
+{
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    const std::string path = std::string("CovCane.") + name;
+    const size_t len = std::min(path.size(), sizeof(addr.sun_path) - 1);
+    memcpy(addr.sun_path + 1, path.data(), len);
+
+    return static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + 1 + len);
+}
+
+#endif
+
+// Sends a command to the process serving the channel name and returns its
+// reply without the line feed.
+inline bool Send(const char* name, const char* command, std::string& reply)
+{
+    std::string line = command;
+    line += '\n';
+
+    char buf[MaxLine]{};
+
+#ifdef _WIN32
+    DWORD len = 0;
+    if (CallNamedPipeA(
+            GetPipeName(name).c_str(), line.data(),
+            static_cast<DWORD>(line.size()), buf, sizeof(buf) - 1, &len,
+            Timeout)
+        == FALSE)
+    {
+        return false;
+    }
+#else
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return false;
+
+    timeval timeout{ Timeout / 1000, (Timeout % 1000) * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    sockaddr_un addr;
+    const socklen_t addrLen = GetAddress(name, addr);
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), addrLen) != 0
+        || send(fd, line.data(), line.size(), MSG_NOSIGNAL)
+               != static_cast<ssize_t>(line.size()))
+    {
+        close(fd);
+        return false;
+    }
+
+    size_t len = 0;
+    while (len < sizeof(buf) - 1)
+    {
+        const ssize_t res = recv(fd, buf + len, sizeof(buf) - 1 - len, 0);
+        if (res <= 0)
+            break;
+        len += static_cast<size_t>(res);
+        if (buf[len - 1] == '\n')
+            break;
+    }
+    close(fd);
+#endif
+
+    reply.assign(buf, len);
+    while (!reply.empty() && (reply.back() == '\n' || reply.back() == '\r'))
+        reply.pop_back();
+    return !reply.empty();
+}
+
+} // namespace CovCane::ControlChannel
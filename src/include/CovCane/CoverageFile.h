@@ -0,0 +1,591 @@
+#pragma once
+
+// Binary coverage file, written by the runtime and read by CovTool. All
+// sections are 8 byte aligned little endian structures so a mapped file can
+// be used in place:
+//
+//   Header
+//   ModuleEntry[moduleCount]
+//   strings             module paths, not null terminated
+//   per module:
+//     Chunk[]           absolute offset of every ChunkSize'th block
+//     deltas            LEB128 gaps between the sorted block offsets
+//     uint64_t[]        hit counts, only with HasHitCounts
+//
+// The chunk index allows a lookup to decode at most ChunkSize deltas.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace CovCane::CoverageFile {
+
+constexpr uint32_t Magic = 0x564F4343; // "CCOV"
+constexpr uint16_t Version = 1;
+constexpr uint32_t ChunkSize = 128;
+
+enum Flags : uint16_t
+{
+    HasHitCounts = 1 << 0,
+};
+
+struct Header
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;
+    uint32_t moduleCount;
+    uint32_t reserved;
+    uint64_t blockCount;
+    uint64_t moduleTableOffset;
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+    uint64_t fileSize;
+};
+
+struct ModuleEntry
+{
+    uint64_t base;
+    uint64_t size;
+    uint64_t pathOffset;
+    uint32_t pathLength;
+    uint32_t reserved;
+    uint64_t blockCount;
+    uint64_t chunksOffset;
+    uint64_t deltasOffset;
+    uint64_t deltasSize;
+    uint64_t hitsOffset;
+};
+
+struct Chunk
+{
+    uint32_t firstOffset;
+    // Position in the delta stream of the block following firstOffset.
+    uint32_t deltaPos;
+};
+
+static_assert(sizeof(Header) == 56);
+static_assert(sizeof(ModuleEntry) == 72);
+static_assert(sizeof(Chunk) == 8);
+
+inline void EncodeVarint(std::vector<uint8_t>& out, uint32_t val)
+{
+    while (val >= 0x80)
+    {
+        out.push_back(static_cast<uint8_t>(val | 0x80));
+        val >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(val));
+}
+
+// Returns false if the value runs past end.
+inline bool DecodeVarint(
+    const uint8_t*& cur, const uint8_t* end, uint32_t& val)
+{
+    val = 0;
+    for (uint32_t shift = 0; shift < 35; shift += 7)
+    {
+        if (cur == end)
+            return false;
+
+        const uint8_t byte = *cur++;
+        val |= static_cast<uint32_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+            return true;
+    }
+    return false;
+}
+
+constexpr uint64_t AlignUp(uint64_t val)
+{
+    return (val + 7) & ~uint64_t(7);
+}
+
+struct BlockRecord
+{
+    uint32_t offset;
+    uint64_t hits;
+};
+
+// Collects blocks per module and serializes them, sink only needs
+// Write(const void* data, size_t len).
+class Builder
+{
+    struct Module
+    {
+        std::string path;
+        uint64_t base;
+        uint64_t size;
+        std::vector<BlockRecord> blocks;
+    };
+
+    std::vector<Module> _modules;
+    bool _hitCounts;
+
+public:
+    explicit Builder(bool hitCounts)
+        : _hitCounts(hitCounts)
+    {
+    }
+
+    uint32_t AddModule(std::string_view path, uint64_t base, uint64_t size)
+    {
+        Module& mod = _modules.emplace_back();
+        mod.path = path;
+        mod.base = base;
+        mod.size = size;
+        return static_cast<uint32_t>(_modules.size() - 1);
+    }
+
+    void AddBlock(uint32_t module, uint32_t offset, uint64_t hits)
+    {
+        _modules[module].blocks.push_back({ offset, hits });
+    }
+
+    // Replaces the blocks of a module, they do not need to be sorted.
+    void SetBlocks(uint32_t module, std::vector<BlockRecord>&& blocks)
+    {
+        _modules[module].blocks = std::move(blocks);
+    }
+
+    template<typename Sink> bool Write(Sink& sink)
+    {
+        struct Encoded
+        {
+            std::vector<Chunk> chunks;
+            std::vector<uint8_t> deltas;
+            std::vector<uint64_t> hits;
+        };
+
+        std::vector<Encoded> encoded(_modules.size());
+        std::vector<ModuleEntry> entries(_modules.size());
+
+        Header header{};
+        header.magic = Magic;
+        header.version = Version;
+        header.flags = _hitCounts ? uint16_t(HasHitCounts) : uint16_t(0);
+        header.moduleCount = static_cast<uint32_t>(_modules.size());
+        header.moduleTableOffset = sizeof(Header);
+        header.stringsOffset = header.moduleTableOffset
+                               + _modules.size() * sizeof(ModuleEntry);
+
+        for (size_t i = 0; i < _modules.size(); i++)
+        {
+            entries[i].pathOffset = header.stringsSize;
+            entries[i].pathLength = static_cast<uint32_t>(
+                _modules[i].path.size());
+            header.stringsSize += _modules[i].path.size();
+        }
+
+        uint64_t pos = AlignUp(header.stringsOffset + header.stringsSize);
+
+        for (size_t i = 0; i < _modules.size(); i++)
+        {
+            Module& mod = _modules[i];
+            Encoded& enc = encoded[i];
+            ModuleEntry& entry = entries[i];
+
+            SortBlocks(mod.blocks);
+
+            uint32_t prev = 0;
+            for (size_t n = 0; n < mod.blocks.size(); n++)
+            {
+                const uint32_t offset = mod.blocks[n].offset;
+                if (n % ChunkSize == 0)
+                {
+                    enc.chunks.push_back(
+                        { offset, static_cast<uint32_t>(enc.deltas.size()) });
+                }
+                else
+                {
+                    EncodeVarint(enc.deltas, offset - prev);
+                }
+                prev = offset;
+
+                if (_hitCounts)
+                    enc.hits.push_back(mod.blocks[n].hits);
+            }
+
+            entry.base = mod.base;
+            entry.size = mod.size;
+            entry.blockCount = mod.blocks.size();
+
+            entry.chunksOffset = pos;
+            pos += enc.chunks.size() * sizeof(Chunk);
+
+            entry.deltasOffset = pos;
+            entry.deltasSize = enc.deltas.size();
+            pos = AlignUp(pos + enc.deltas.size());
+
+            if (_hitCounts)
+            {
+                entry.hitsOffset = pos;
+                pos += enc.hits.size() * sizeof(uint64_t);
+            }
+
+            header.blockCount += mod.blocks.size();
+        }
+
+        header.fileSize = pos;
+
+        static const uint8_t padding[8]{};
+        uint64_t written = 0;
+        auto put = [&](const void* data, size_t len) {
+            if (len == 0)
+                return;
+            sink.Write(data, len);
+            written += len;
+        };
+        auto pad = [&]() { put(padding, AlignUp(written) - written); };
+
+        put(&header, sizeof(header));
+        put(entries.data(), entries.size() * sizeof(ModuleEntry));
+        for (auto& mod : _modules)
+            put(mod.path.data(), mod.path.size());
+        pad();
+
+        for (auto& enc : encoded)
+        {
+            put(enc.chunks.data(), enc.chunks.size() * sizeof(Chunk));
+            put(enc.deltas.data(), enc.deltas.size());
+            pad();
+            put(enc.hits.data(), enc.hits.size() * sizeof(uint64_t));
+        }
+
+        return written == header.fileSize;
+    }
+
+private:
+    // Sorts by offset and folds duplicates into one record.
+    static void SortBlocks(std::vector<BlockRecord>& blocks)
+    {
+        std::sort(
+            blocks.begin(), blocks.end(),
+            [](const BlockRecord& a, const BlockRecord& b) {
+                return a.offset < b.offset;
+            });
+
+        size_t out = 0;
+        for (size_t i = 0; i < blocks.size(); i++)
+        {
+            if (out != 0 && blocks[out - 1].offset == blocks[i].offset)
+                blocks[out - 1].hits += blocks[i].hits;
+            else
+                blocks[out++] = blocks[i];
+        }
+        blocks.resize(out);
+    }
+};
+
+// Read only view of a mapped coverage file.
+class Reader
+{
+    const uint8_t* _data = nullptr;
+    size_t _size = 0;
+#ifdef _WIN32
+    HANDLE _file = INVALID_HANDLE_VALUE;
+    HANDLE _mapping = nullptr;
+#else
+    int _fd = -1;
+#endif
+
+public:
+    Reader() = default;
+    Reader(const Reader&) = delete;
+    Reader& operator=(const Reader&) = delete;
+    ~Reader()
+    {
+        Close();
+    }
+
+    // Maps the file and validates the layout, the blocks are only decoded
+    // on access.
+    bool Open(const char* path)
+    {
+        Close();
+        if (!Map(path) || !Validate())
+        {
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    void Close()
+    {
+#ifdef _WIN32
+        if (_data != nullptr)
+            UnmapViewOfFile(_data);
+        if (_mapping != nullptr)
+            CloseHandle(_mapping);
+        if (_file != INVALID_HANDLE_VALUE)
+            CloseHandle(_file);
+        _mapping = nullptr;
+        _file = INVALID_HANDLE_VALUE;
+#else
+        if (_data != nullptr)
+            munmap(const_cast<uint8_t*>(_data), _size);
+        if (_fd != -1)
+            close(_fd);
+        _fd = -1;
+#endif
+        _data = nullptr;
+        _size = 0;
+    }
+
+    const Header& GetHeader() const
+    {
+        return *reinterpret_cast<const Header*>(_data);
+    }
+
+    uint32_t GetModuleCount() const
+    {
+        return GetHeader().moduleCount;
+    }
+
+    uint64_t GetBlockCount() const
+    {
+        return GetHeader().blockCount;
+    }
+
+    bool HasHitCounts() const
+    {
+        return (GetHeader().flags & CoverageFile::HasHitCounts) != 0;
+    }
+
+    const ModuleEntry& GetModule(uint32_t index) const
+    {
+        return GetModules()[index];
+    }
+
+    std::string_view GetModulePath(uint32_t index) const
+    {
+        const ModuleEntry& mod = GetModule(index);
+        const char* strings = reinterpret_cast<const char*>(
+            _data + GetHeader().stringsOffset);
+        return std::string_view(strings + mod.pathOffset, mod.pathLength);
+    }
+
+    // Hit counts in block order, nullptr without HasHitCounts.
+    const uint64_t* GetHitCounts(uint32_t index) const
+    {
+        if (!HasHitCounts())
+            return nullptr;
+        return reinterpret_cast<const uint64_t*>(
+            _data + GetModule(index).hitsOffset);
+    }
+
+    // Invokes fn(offset, hits) for every block of the module in ascending
+    // offset order, hits is zero without HasHitCounts.
+    template<typename F> void ForEachBlock(uint32_t index, F&& fn) const
+    {
+        const ModuleEntry& mod = GetModule(index);
+        const Chunk* chunks = GetChunks(mod);
+        const uint64_t* hits = GetHitCounts(index);
+
+        const uint8_t* deltas = _data + mod.deltasOffset;
+        const uint8_t* cur = deltas;
+        const uint8_t* end = deltas + mod.deltasSize;
+
+        uint32_t offset = 0;
+        for (uint64_t n = 0; n < mod.blockCount; n++)
+        {
+            if (n % ChunkSize == 0)
+            {
+                offset = chunks[n / ChunkSize].firstOffset;
+            }
+            else
+            {
+                uint32_t delta = 0;
+                if (!DecodeVarint(cur, end, delta))
+                    return;
+                offset += delta;
+            }
+            fn(offset, hits != nullptr ? hits[n] : 0);
+        }
+    }
+
+    // Decodes the blocks of a module into out.
+    void GetBlocks(uint32_t index, std::vector<BlockRecord>& out) const
+    {
+        out.clear();
+        out.reserve(static_cast<size_t>(GetModule(index).blockCount));
+        ForEachBlock(index, [&](uint32_t offset, uint64_t hits) {
+            out.push_back({ offset, hits });
+        });
+    }
+
+    bool Contains(uint32_t index, uint32_t offset) const
+    {
+        const ModuleEntry& mod = GetModule(index);
+        if (mod.blockCount == 0)
+            return false;
+
+        const Chunk* chunks = GetChunks(mod);
+        const Chunk* chunksEnd = chunks + GetChunkCount(mod);
+
+        // Last chunk starting at or before offset.
+        const Chunk* chunk = std::upper_bound(
+            chunks, chunksEnd, offset,
+            [](uint32_t val, const Chunk& c) { return val < c.firstOffset; });
+        if (chunk == chunks)
+            return false;
+        --chunk;
+
+        const uint64_t first = uint64_t(chunk - chunks) * ChunkSize;
+        const uint64_t count = mod.blockCount - first < ChunkSize
+                                   ? mod.blockCount - first
+                                   : ChunkSize;
+
+        const uint8_t* cur = _data + mod.deltasOffset + chunk->deltaPos;
+        const uint8_t* end = _data + mod.deltasOffset + mod.deltasSize;
+
+        uint32_t val = chunk->firstOffset;
+        for (uint64_t n = 1; n < count && val < offset; n++)
+        {
+            uint32_t delta = 0;
+            if (!DecodeVarint(cur, end, delta))
+                return false;
+            val += delta;
+        }
+        return val == offset;
+    }
+
+private:
+    const ModuleEntry* GetModules() const
+    {
+        return reinterpret_cast<const ModuleEntry*>(
+            _data + GetHeader().moduleTableOffset);
+    }
+
+    static uint64_t GetChunkCount(const ModuleEntry& mod)
+    {
+        // Rounded up without the addition, which could overflow.
+        return mod.blockCount / ChunkSize + (mod.blockCount % ChunkSize != 0);
+    }
+
+    const Chunk* GetChunks(const ModuleEntry& mod) const
+    {
+        return reinterpret_cast<const Chunk*>(_data + mod.chunksOffset);
+    }
+
+    bool InBounds(uint64_t offset, uint64_t len) const
+    {
+        return offset <= _size && len <= _size - offset;
+    }
+
+    bool Validate() const
+    {
+        if (_size < sizeof(Header))
+            return false;
+
+        const Header& header = GetHeader();
+        if (header.magic != Magic || header.version != Version
+            || header.fileSize != _size)
+            return false;
+
+        if (header.moduleTableOffset % 8 != 0
+            || !InBounds(
+                header.moduleTableOffset,
+                uint64_t(header.moduleCount) * sizeof(ModuleEntry))
+            || !InBounds(header.stringsOffset, header.stringsSize))
+            return false;
+
+        uint64_t blockCount = 0;
+        for (uint32_t i = 0; i < header.moduleCount; i++)
+        {
+            const ModuleEntry& mod = GetModule(i);
+            if (uint64_t(mod.pathOffset) + mod.pathLength > header.stringsSize)
+                return false;
+
+            if (!InBounds(mod.deltasOffset, mod.deltasSize))
+                return false;
+
+            // Every block but the first of a chunk takes at least one delta
+            // byte, which bounds the sizes derived from the count.
+            if (mod.blockCount > mod.deltasSize + GetChunkCount(mod))
+                return false;
+
+            if (mod.chunksOffset % 8 != 0
+                || !InBounds(
+                    mod.chunksOffset, GetChunkCount(mod) * sizeof(Chunk)))
+                return false;
+
+            if (HasHitCounts()
+                && (mod.hitsOffset % 8 != 0
+                    || !InBounds(
+                        mod.hitsOffset, mod.blockCount * sizeof(uint64_t))))
+                return false;
+
+            const Chunk* chunks = GetChunks(mod);
+            for (uint64_t n = 0; n < GetChunkCount(mod); n++)
+            {
+                if (chunks[n].deltaPos > mod.deltasSize)
+                    return false;
+            }
+
+            blockCount += mod.blockCount;
+        }
+
+        return blockCount == header.blockCount;
+    }
+
+    bool Map(const char* path)
+    {
+#ifdef _WIN32
+        _file = CreateFileA(
+            path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (_file == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER size{};
+        if (!GetFileSizeEx(_file, &size) || size.QuadPart == 0)
+            return false;
+        _size = static_cast<size_t>(size.QuadPart);
+
+        _mapping = CreateFileMappingA(
+            _file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (_mapping == nullptr)
+            return false;
+
+        _data = static_cast<const uint8_t*>(
+            MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0));
+        return _data != nullptr;
+#else
+        _fd = open(path, O_RDONLY);
+        if (_fd == -1)
+            return false;
+
+        struct stat st = {};
+        if (fstat(_fd, &st) != 0 || st.st_size == 0)
+            return false;
+        _size = static_cast<size_t>(st.st_size);
+
+        void* data = mmap(nullptr, _size, PROT_READ, MAP_SHARED, _fd, 0);
+        if (data == MAP_FAILED)
+            return false;
+
+        _data = static_cast<const uint8_t*>(data);
+        return true;
+#endif
+    }
+};
+
+} // namespace CovCane::CoverageFile
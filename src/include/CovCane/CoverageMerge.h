@@ -0,0 +1,315 @@
+#pragma once
+
+// Merging of coverage files, modules are matched by path and blocks by
+// their module relative offset.
+
+#include "CoverageFile.h"
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace CovCane::CoverageMerge {
+
+struct MergedBlock
+{
+    uint32_t offset;
+    // Number of merged files that contain the block.
+    uint32_t files;
+    uint64_t hits;
+};
+
+struct Module
+{
+    std::string path;
+    uint64_t base;
+    uint64_t size;
+    // Sorted by offset.
+    std::vector<MergedBlock> blocks;
+};
+
+class Accumulator
+{
+    std::vector<Module> _modules;
+    std::unordered_map<std::string, size_t> _index;
+    std::vector<MergedBlock> _scratch;
+    std::vector<MergedBlock> _merged;
+    std::vector<std::pair<size_t, uint32_t>> _entries;
+    uint32_t _files = 0;
+    bool _hitCounts = false;
+
+public:
+    uint32_t GetFileCount() const
+    {
+        return _files;
+    }
+
+    bool HasHitCounts() const
+    {
+        return _hitCounts;
+    }
+
+    const std::vector<Module>& GetModules() const
+    {
+        return _modules;
+    }
+
+    void Add(const CoverageFile::Reader& reader)
+    {
+        // A module loaded more than once has an entry per load, a block
+        // counts once for the file however many of them contain it.
+        _entries.clear();
+        for (uint32_t i = 0; i < reader.GetModuleCount(); i++)
+        {
+            const CoverageFile::ModuleEntry& entry = reader.GetModule(i);
+            _entries.push_back(
+                { GetModuleIndex(
+                      reader.GetModulePath(i), entry.base, entry.size),
+                  i });
+        }
+        std::stable_sort(
+            _entries.begin(), _entries.end(),
+            [](const auto& a, const auto& b) { return a.first < b.first; });
+
+        for (size_t first = 0; first < _entries.size();)
+        {
+            const size_t index = _entries[first].first;
+            size_t last = first;
+
+            _scratch.clear();
+            for (; last < _entries.size() && _entries[last].first == index;
+                 last++)
+            {
+                reader.ForEachBlock(
+                    _entries[last].second,
+                    [this](uint32_t offset, uint64_t hits) {
+                        _scratch.push_back({ offset, 1, hits });
+                    });
+            }
+            if (last - first > 1)
+                CombineLoads(_scratch);
+
+            MergeInto(_modules[index].blocks, _scratch);
+            first = last;
+        }
+
+        _files++;
+        _hitCounts |= reader.HasHitCounts();
+    }
+
+    void Add(Accumulator&& other)
+    {
+        for (auto& src : other._modules)
+        {
+            Module& mod = GetModule(src.path, src.base, src.size);
+            if (mod.blocks.empty())
+                mod.blocks = std::move(src.blocks);
+            else
+                MergeInto(mod.blocks, src.blocks);
+        }
+
+        _files += other._files;
+        _hitCounts |= other._hitCounts;
+    }
+
+    // With intersect only the blocks found in every merged file are kept,
+    // hit counts are summed either way.
+    CoverageFile::Builder Build(bool intersect) const
+    {
+        CoverageFile::Builder builder(_hitCounts);
+        for (auto& mod : _modules)
+        {
+            const uint32_t id = builder.AddModule(mod.path, mod.base, mod.size);
+
+            std::vector<CoverageFile::BlockRecord> records;
+            records.reserve(mod.blocks.size());
+            for (auto& block : mod.blocks)
+            {
+                if (intersect && block.files != _files)
+                    continue;
+                records.push_back({ block.offset, block.hits });
+            }
+            builder.SetBlocks(id, std::move(records));
+        }
+        return builder;
+    }
+
+private:
+    Module& GetModule(std::string_view path, uint64_t base, uint64_t size)
+    {
+        return _modules[GetModuleIndex(path, base, size)];
+    }
+
+    size_t GetModuleIndex(std::string_view path, uint64_t base, uint64_t size)
+    {
+        auto it = _index.find(std::string(path));
+        if (it != _index.end())
+            return it->second;
+
+        _index.emplace(std::string(path), _modules.size());
+
+        Module& mod = _modules.emplace_back();
+        mod.path = path;
+        mod.base = base;
+        mod.size = size;
+        return _modules.size() - 1;
+    }
+
+    // Sorts the blocks of several loads of one module and sums the hits of
+    // the same offset into a single block.
+    static void CombineLoads(std::vector<MergedBlock>& blocks)
+    {
+        std::sort(
+            blocks.begin(), blocks.end(),
+            [](const MergedBlock& a, const MergedBlock& b) {
+                return a.offset < b.offset;
+            });
+
+        size_t out = 0;
+        for (size_t i = 0; i < blocks.size(); i++)
+        {
+            if (out != 0 && blocks[out - 1].offset == blocks[i].offset)
+                blocks[out - 1].hits += blocks[i].hits;
+            else
+                blocks[out++] = blocks[i];
+        }
+        blocks.resize(out);
+    }
+
+    // Merges the sorted src into the sorted dst. Runs of the same target
+    // mostly hit blocks dst already has, those are updated in place and
+    // only the new blocks are inserted.
+    void MergeInto(
+        std::vector<MergedBlock>& dst, const std::vector<MergedBlock>& src)
+    {
+        std::vector<MergedBlock>& added = _merged;
+        added.clear();
+
+        size_t a = 0;
+        for (auto& block : src)
+        {
+            a = Gallop(dst, a, block.offset);
+            if (a < dst.size() && dst[a].offset == block.offset)
+            {
+                dst[a].files += block.files;
+                dst[a].hits += block.hits;
+                a++;
+            }
+            else
+            {
+                added.push_back(block);
+            }
+        }
+
+        if (added.empty())
+            return;
+
+        // Merge from the back so every block moves at most once.
+        size_t readA = dst.size();
+        size_t readB = added.size();
+        dst.resize(dst.size() + added.size());
+
+        size_t write = dst.size();
+        while (readB != 0)
+        {
+            if (readA != 0 && dst[readA - 1].offset > added[readB - 1].offset)
+                dst[--write] = dst[--readA];
+            else
+                dst[--write] = added[--readB];
+        }
+    }
+
+    // First index at or after start whose offset is not below offset,
+    // doubles the step so both dense and sparse inputs stay cheap.
+    static size_t Gallop(
+        const std::vector<MergedBlock>& blocks, size_t start, uint32_t offset)
+    {
+        size_t lo = start;
+        size_t step = 1;
+        size_t hi = start;
+        while (hi < blocks.size() && blocks[hi].offset < offset)
+        {
+            lo = hi + 1;
+            hi += step;
+            step *= 2;
+        }
+        if (hi > blocks.size())
+            hi = blocks.size();
+
+        while (lo < hi)
+        {
+            const size_t mid = lo + (hi - lo) / 2;
+            if (blocks[mid].offset < offset)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+};
+
+// Merges the files on up to threadCount threads, every thread accumulates
+// the files it picks and the partial results are combined pairwise.
+// Files that fail to open are skipped and appended to failed.
+inline Accumulator MergeFiles(
+    const std::vector<std::string>& paths,
+    unsigned threadCount,
+    std::vector<std::string>* failed = nullptr)
+{
+    if (threadCount == 0)
+        threadCount = 1;
+    if (threadCount > paths.size())
+        threadCount = paths.size() != 0 ? unsigned(paths.size()) : 1;
+
+    std::vector<Accumulator> partial(threadCount);
+    std::vector<std::vector<std::string>> failures(threadCount);
+    std::atomic<size_t> next{ 0 };
+
+    auto worker = [&](unsigned idx) {
+        CoverageFile::Reader reader;
+        for (;;)
+        {
+            const size_t i = next.fetch_add(1);
+            if (i >= paths.size())
+                break;
+
+            if (reader.Open(paths[i].c_str()))
+                partial[idx].Add(reader);
+            else
+                failures[idx].push_back(paths[i]);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < threadCount; i++)
+        threads.emplace_back(worker, i);
+    worker(0);
+    for (auto& t : threads)
+        t.join();
+
+    for (size_t step = 1; step < partial.size(); step *= 2)
+    {
+        threads.clear();
+        for (size_t i = step; i < partial.size(); i += step * 2)
+        {
+            threads.emplace_back([&partial, i, step]() {
+                partial[i - step].Add(std::move(partial[i]));
+            });
+        }
+        for (auto& t : threads)
+            t.join();
+    }
+
+    if (failed != nullptr)
+    {
+        for (auto& list : failures)
+            failed->insert(failed->end(), list.begin(), list.end());
+    }
+
+    return std::move(partial[0]);
+}
+
+} // namespace CovCane::CoverageMerge
@@ -0,0 +1,274 @@
+#pragma once
+
+// Single producer, single consumer ring of coverage events in a named shared
+// memory segment. The instrumented process pushes an event for every block
+// it translates, a consumer such as a fuzzer reads them as they arrive.
+// Pushing never waits, when the ring is full the event is counted as lost.
+//
+//   Header
+//   ModuleEntry[MaxModules]
+//   Event[capacity]
+
+#include "SharedMemory.h"
+
+#include <string.h>
+#include <string_view>
+
+namespace CovCane::EventQueue {
+
+constexpr uint32_t Version = 1;
+constexpr uint32_t MaxModules = 256;
+constexpr uint32_t NoModule = 0xFFFFFFFF;
+
+enum EventFlags : uint32_t
+{
+    // The block was not yet set in the shared coverage map.
+    NewInSharedMap = 1 << 0,
+};
+
+struct Event
+{
+    // Index into the module table or NoModule.
+    uint32_t module;
+    uint32_t flags;
+    // Module relative offset, the address for blocks outside of modules.
+    uint64_t offset;
+};
+
+static_assert(sizeof(Event) == 16);
+
+struct ModuleEntry
+{
+    uint64_t base;
+    uint64_t size;
+    char path[240];
+};
+
+static_assert(sizeof(ModuleEntry) == 256);
+
+// Producer and consumer indices are on their own cache lines.
+struct Header
+{
+    uint32_t state;
+    uint32_t version;
+    // Number of events in the ring, a power of two.
+    uint32_t capacity;
+    // Process id of the producer.
+    uint32_t pid;
+    uint64_t moduleCount;
+    uint64_t reserved0[5];
+
+    // Written by the producer.
+    uint64_t head;
+    uint64_t lost;
+    uint64_t reserved1[6];
+
+    // Written by the consumer.
+    uint64_t tail;
+    uint64_t reserved2[7];
+};
+
+static_assert(sizeof(Header) == 192);
+
+class Queue
+{
+    SharedMemory::View _view;
+    Header* _header = nullptr;
+    ModuleEntry* _modules = nullptr;
+    Event* _events = nullptr;
+    uint64_t _mask = 0;
+    // Last seen index of the other side, saves touching its cache line.
+    uint64_t _cached = 0;
+
+public:
+    static size_t GetSegmentSize(uint32_t capacity)
+    {
+        return sizeof(Header) + sizeof(ModuleEntry) * MaxModules
+               + sizeof(Event) * size_t(capacity);
+    }
+
+    // Creates the ring as the producer, an existing ring of the same name
+    // is reset. capacity has to be a power of two.
+    bool Create(const char* name, uint32_t capacity)
+    {
+        Close();
+
+        if (capacity == 0 || (capacity & (capacity - 1)) != 0)
+            return false;
+
+        const size_t size = GetSegmentSize(capacity);
+        if (!_view.Create(name, size) || _view.GetSize() < size)
+        {
+            // A ring left behind by an earlier run can be too small.
+            _view.Close();
+            SharedMemory::View::Unlink(name);
+            if (!_view.Create(name, size) || _view.GetSize() < size)
+            {
+                Close();
+                return false;
+            }
+        }
+
+        _header = static_cast<Header*>(_view.GetData());
+        SharedMemory::StoreState(&_header->state, SharedMemory::Initializing);
+
+        _header->version = Version;
+        _header->capacity = capacity;
+        _header->pid = SharedMemory::GetProcessId();
+        _header->moduleCount = 0;
+        _header->head = 0;
+        _header->lost = 0;
+        _header->tail = 0;
+
+        SharedMemory::StoreState(&_header->state, SharedMemory::Ready);
+
+        Setup();
+        return true;
+    }
+
+    // Opens the ring of a running producer as the consumer, events pushed
+    // before are still read.
+    bool Open(const char* name)
+    {
+        Close();
+
+        if (!_view.Open(name))
+            return false;
+
+        _header = static_cast<Header*>(_view.GetData());
+        if (_view.GetSize() < sizeof(Header)
+            || !SharedMemory::WaitReady(&_header->state)
+            || _header->version != Version || _header->capacity == 0
+            || (_header->capacity & (_header->capacity - 1)) != 0
+            || GetSegmentSize(_header->capacity) > _view.GetSize())
+        {
+            Close();
+            return false;
+        }
+
+        Setup();
+        _cached = _header->tail;
+        return true;
+    }
+
+    void Close()
+    {
+        _view.Close();
+        _header = nullptr;
+        _modules = nullptr;
+        _events = nullptr;
+        _mask = 0;
+        _cached = 0;
+    }
+
+    static void Unlink(const char* name)
+    {
+        SharedMemory::View::Unlink(name);
+    }
+
+    bool IsOpen() const
+    {
+        return _header != nullptr;
+    }
+
+    const Header* GetHeader() const
+    {
+        return _header;
+    }
+
+    // Producer side.
+
+    // Publishes a module, events pushed afterwards may refer to the
+    // returned index. Returns NoModule once the table is full.
+    uint32_t AddModule(uint64_t base, uint64_t size, std::string_view path)
+    {
+        const uint64_t index = _header->moduleCount;
+        if (index >= MaxModules)
+            return NoModule;
+
+        ModuleEntry& entry = _modules[index];
+        entry.base = base;
+        entry.size = size;
+
+        // Keep the end of long paths, the file name matters most.
+        if (path.size() >= sizeof(entry.path))
+            path = path.substr(path.size() - (sizeof(entry.path) - 1));
+        memcpy(entry.path, path.data(), path.size());
+        entry.path[path.size()] = '\0';
+
+        SharedMemory::StoreRelease(&_header->moduleCount, index + 1);
+        return static_cast<uint32_t>(index);
+    }
+
+    // Returns false and counts the event as lost if the ring is full.
+    bool Push(const Event& event)
+    {
+        const uint64_t head = _header->head;
+        if (head - _cached > _mask)
+        {
+            _cached = SharedMemory::LoadAcquire(&_header->tail);
+            if (head - _cached > _mask)
+            {
+                SharedMemory::StoreRelease(
+                    &_header->lost, _header->lost + 1);
+                return false;
+            }
+        }
+
+        _events[head & _mask] = event;
+        SharedMemory::StoreRelease(&_header->head, head + 1);
+        return true;
+    }
+
+    // Consumer side.
+
+    bool Pop(Event& event)
+    {
+        const uint64_t tail = _header->tail;
+        if (tail == _cached)
+        {
+            _cached = SharedMemory::LoadAcquire(&_header->head);
+            if (tail == _cached)
+                return false;
+        }
+
+        event = _events[tail & _mask];
+        SharedMemory::StoreRelease(&_header->tail, tail + 1);
+        return true;
+    }
+
+    // A restarted producer resets the ring, consumers reopen it when the
+    // process id changes.
+    uint32_t GetProducerId() const
+    {
+        return SharedMemory::LoadState(&_header->pid);
+    }
+
+    uint64_t GetLostCount() const
+    {
+        return SharedMemory::LoadAcquire(&_header->lost);
+    }
+
+    uint32_t GetModuleCount() const
+    {
+        return static_cast<uint32_t>(
+            SharedMemory::LoadAcquire(&_header->moduleCount));
+    }
+
+    // Valid for every module index found in a popped event.
+    const ModuleEntry& GetModule(uint32_t index) const
+    {
+        return _modules[index];
+    }
+
+private:
+    void Setup()
+    {
+        _modules = reinterpret_cast<ModuleEntry*>(_header + 1);
+        _events = reinterpret_cast<Event*>(_modules + MaxModules);
+        _mask = _header->capacity - 1;
+        _cached = 0;
+    }
+};
+
+} // namespace CovCane::EventQueue
@@ -0,0 +1,188 @@
+#pragma once
+
+// Coverage bitmap in a named shared memory segment, every instrumented
+// process attached to the same name sets the bits of the blocks it
+// discovers. Bits are addressed by a key derived from the module name and
+// the module relative offset, so processes with different load addresses
+// agree on them.
+//
+//   Header
+//   uint64_t[mapBits / 64]
+
+#include "SharedMemory.h"
+
+#include <string_view>
+
+namespace CovCane::SharedCoverage {
+
+constexpr uint32_t Version = 1;
+
+struct Header
+{
+    uint32_t state;
+    uint32_t version;
+    // Number of bits in the map, a power of two.
+    uint64_t mapBits;
+    // Bits set so far, only ever grows.
+    uint64_t coveredBlocks;
+    // Processes that attached since the segment was created.
+    uint64_t processes;
+    uint64_t reserved[4];
+};
+
+static_assert(sizeof(Header) == 64);
+
+// FNV-1a of the lower case file name, the directory is ignored.
+inline uint64_t HashModuleName(std::string_view path)
+{
+    const size_t slash = path.find_last_of("\\/");
+    if (slash != std::string_view::npos)
+        path = path.substr(slash + 1);
+
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (char c : path)
+    {
+        if (c >= 'A' && c <= 'Z')
+            c = static_cast<char>(c - 'A' + 'a');
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 0x100000001B3ull;
+    }
+    return hash;
+}
+
+// Stable key of a block, the low bits index the map.
+inline uint64_t GetBlockKey(uint64_t moduleHash, uint64_t offset)
+{
+    // splitmix64 finalizer, spreads nearby offsets over the map.
+    uint64_t x = moduleHash ^ (offset * 0x9E3779B97F4A7C15ull);
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+// Mapped view of a segment.
+class Segment
+{
+    SharedMemory::View _view;
+    Header* _header = nullptr;
+
+public:
+    static size_t GetSegmentSize(uint64_t mapBits)
+    {
+        return sizeof(Header) + static_cast<size_t>(mapBits / 8);
+    }
+
+    // Opens the segment or creates it with mapBits bits, an existing
+    // segment keeps the size it was created with.
+    bool Create(const char* name, uint64_t mapBits)
+    {
+        Close();
+
+        if (!_view.Create(name, GetSegmentSize(mapBits)))
+            return false;
+        _header = static_cast<Header*>(_view.GetData());
+
+        // The first process to attach writes the header.
+        if (SharedMemory::CompareExchange(
+                &_header->state, SharedMemory::Uninitialized,
+                SharedMemory::Initializing))
+        {
+            _header->version = Version;
+            _header->mapBits = mapBits;
+            SharedMemory::StoreState(&_header->state, SharedMemory::Ready);
+        }
+
+        if (!Validate())
+        {
+            Close();
+            return false;
+        }
+
+        SharedMemory::AtomicIncrement(&_header->processes);
+        return true;
+    }
+
+    // Opens an existing segment.
+    bool Open(const char* name)
+    {
+        Close();
+
+        if (!_view.Open(name))
+            return false;
+        _header = static_cast<Header*>(_view.GetData());
+
+        if (!Validate())
+        {
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    void Close()
+    {
+        _view.Close();
+        _header = nullptr;
+    }
+
+    static void Unlink(const char* name)
+    {
+        SharedMemory::View::Unlink(name);
+    }
+
+    bool IsOpen() const
+    {
+        return _header != nullptr;
+    }
+
+    Header* GetHeader() const
+    {
+        return _header;
+    }
+
+    uint64_t* GetBits() const
+    {
+        return reinterpret_cast<uint64_t*>(_header + 1);
+    }
+
+    // Sets the bit of the key, returns true if this call set it first.
+    bool Mark(uint64_t key)
+    {
+        const uint64_t index = key & (_header->mapBits - 1);
+        const uint64_t mask = 1ull << (index % 64);
+
+        uint64_t* word = GetBits() + index / 64;
+
+        // Plain read first, the bit is usually set by an earlier process.
+        if ((SharedMemory::AtomicLoad(word) & mask) != 0)
+            return false;
+        if ((SharedMemory::AtomicOr(word, mask) & mask) != 0)
+            return false;
+
+        SharedMemory::AtomicIncrement(&_header->coveredBlocks);
+        return true;
+    }
+
+    bool IsMarked(uint64_t key) const
+    {
+        const uint64_t index = key & (_header->mapBits - 1);
+        const uint64_t word = SharedMemory::AtomicLoad(GetBits() + index / 64);
+        return (word & (1ull << (index % 64))) != 0;
+    }
+
+private:
+    bool Validate() const
+    {
+        // Another process may still be writing the header.
+        if (_view.GetSize() < sizeof(Header)
+            || !SharedMemory::WaitReady(&_header->state))
+            return false;
+
+        const uint64_t mapBits = _header->mapBits;
+        return _header->version == Version && mapBits >= 64
+               && (mapBits & (mapBits - 1)) == 0
+               && GetSegmentSize(mapBits) <= _view.GetSize();
+    }
+};
+
+} // namespace CovCane::SharedCoverage
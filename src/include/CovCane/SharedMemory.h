@@ -0,0 +1,308 @@
+#pragma once
+
+// Named shared memory and the atomic operations used on it, shared by the
+// segments in SharedCoverage.h and EventQueue.h.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <intrin.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace CovCane::SharedMemory {
+
+// Ready is written last by the process initializing a segment.
+enum State : uint32_t
+{
+    Uninitialized = 0,
+    Initializing = 1,
+    Ready = 2,
+};
+
+inline uint64_t AtomicOr(uint64_t* dst, uint64_t val)
+{
+#ifdef _MSC_VER
+    return static_cast<uint64_t>(_InterlockedOr64(
+        reinterpret_cast<volatile int64_t*>(dst), static_cast<int64_t>(val)));
+#else
+    return __atomic_fetch_or(dst, val, __ATOMIC_RELAXED);
+#endif
+}
+
+inline void AtomicIncrement(uint64_t* dst)
+{
+#ifdef _MSC_VER
+    _InterlockedIncrement64(reinterpret_cast<volatile int64_t*>(dst));
+#else
+    __atomic_fetch_add(dst, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+// Volatile accesses are acquire and release with MSVC on x86 and x64.
+inline uint64_t AtomicLoad(const uint64_t* src)
+{
+#ifdef _MSC_VER
+    return *reinterpret_cast<const volatile uint64_t*>(src);
+#else
+    return __atomic_load_n(src, __ATOMIC_RELAXED);
+#endif
+}
+
+inline uint64_t LoadAcquire(const uint64_t* src)
+{
+#ifdef _MSC_VER
+    return *reinterpret_cast<const volatile uint64_t*>(src);
+#else
+    return __atomic_load_n(src, __ATOMIC_ACQUIRE);
+#endif
+}
+
+inline void StoreRelease(uint64_t* dst, uint64_t val)
+{
+#ifdef _MSC_VER
+    *reinterpret_cast<volatile uint64_t*>(dst) = val;
+#else
+    __atomic_store_n(dst, val, __ATOMIC_RELEASE);
+#endif
+}
+
+inline bool CompareExchange(uint32_t* dst, uint32_t expected, uint32_t val)
+{
+#ifdef _MSC_VER
+    return _InterlockedCompareExchange(
+               reinterpret_cast<volatile long*>(dst), long(val),
+               long(expected))
+           == long(expected);
+#else
+    return __atomic_compare_exchange_n(
+        dst, &expected, val, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+#endif
+}
+
+inline uint32_t LoadState(const uint32_t* src)
+{
+#ifdef _MSC_VER
+    return *reinterpret_cast<const volatile uint32_t*>(src);
+#else
+    return __atomic_load_n(src, __ATOMIC_ACQUIRE);
+#endif
+}
+
+inline void StoreState(uint32_t* dst, uint32_t val)
+{
+#ifdef _MSC_VER
+    _InterlockedExchange(reinterpret_cast<volatile long*>(dst), long(val));
+#else
+    __atomic_store_n(dst, val, __ATOMIC_RELEASE);
+#endif
+}
+
+inline void Sleep(uint32_t ms)
+{
+#ifdef _WIN32
+    ::Sleep(ms);
+#else
+    usleep(ms * 1000);
+#endif
+}
+
+// Waits up to a second for another process to finish the initialization.
+inline bool WaitReady(const uint32_t* state)
+{
+    for (int i = 0; i < 1000; i++)
+    {
+        if (LoadState(state) == Ready)
+            return true;
+        Sleep(1);
+    }
+    return LoadState(state) == Ready;
+}
+
+inline uint32_t GetProcessId()
+{
+#ifdef _WIN32
+    return static_cast<uint32_t>(GetCurrentProcessId());
+#else
+    return static_cast<uint32_t>(getpid());
+#endif
+}
+
+// Mapped view of a named segment.
+class View
+{
+    void* _data = nullptr;
+    size_t _size = 0;
+#ifdef _WIN32
+    HANDLE _mapping = nullptr;
+#endif
+
+public:
+    View() = default;
+    View(const View&) = delete;
+    View& operator=(const View&) = delete;
+    ~View()
+    {
+        Close();
+    }
+
+    static std::string GetObjectName(const char* name)
+    {
+#ifdef _WIN32
+        return std::string("Local\\CovCane.") + name;
+#else
+        return std::string("/CovCane.") + name;
+#endif
+    }
+
+    // Opens the segment or creates it with size bytes, an existing segment
+    // keeps the size it was created with.
+    bool Create(const char* name, size_t size)
+    {
+        Close();
+
+        const std::string objectName = GetObjectName(name);
+
+#ifdef _WIN32
+        _mapping = CreateFileMappingA(
+            INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+            static_cast<DWORD>(uint64_t(size) >> 32),
+            static_cast<DWORD>(size), objectName.c_str());
+        if (_mapping == nullptr)
+            return false;
+#else
+        const int fd = shm_open(objectName.c_str(), O_RDWR | O_CREAT, 0600);
+        if (fd == -1)
+            return false;
+
+        // Only the first process sizes it, a live mapping must not change.
+        struct stat st = {};
+        if (fstat(fd, &st) != 0
+            || (st.st_size == 0 && ftruncate(fd, off_t(size)) != 0))
+        {
+            close(fd);
+            return false;
+        }
+        close(fd);
+#endif
+
+        if (!Map(objectName))
+        {
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    // Opens an existing segment.
+    bool Open(const char* name)
+    {
+        Close();
+
+        const std::string objectName = GetObjectName(name);
+
+#ifdef _WIN32
+        _mapping = OpenFileMappingA(
+            FILE_MAP_READ | FILE_MAP_WRITE, FALSE, objectName.c_str());
+        if (_mapping == nullptr)
+            return false;
+#endif
+
+        if (!Map(objectName))
+        {
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    void Close()
+    {
+#ifdef _WIN32
+        if (_data != nullptr)
+            UnmapViewOfFile(_data);
+        if (_mapping != nullptr)
+            CloseHandle(_mapping);
+        _mapping = nullptr;
+#else
+        if (_data != nullptr)
+            munmap(_data, _size);
+#endif
+        _data = nullptr;
+        _size = 0;
+    }
+
+    // Removes the name, processes that have it mapped keep their view.
+    static void Unlink(const char* name)
+    {
+#ifndef _WIN32
+        shm_unlink(GetObjectName(name).c_str());
+#else
+        (void)name;
+#endif
+    }
+
+    bool IsOpen() const
+    {
+        return _data != nullptr;
+    }
+
+    void* GetData() const
+    {
+        return _data;
+    }
+
+    size_t GetSize() const
+    {
+        return _size;
+    }
+
+private:
+    bool Map(const std::string& objectName)
+    {
+#ifdef _WIN32
+        (void)objectName;
+        _data = MapViewOfFile(_mapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, 0);
+        if (_data == nullptr)
+            return false;
+
+        MEMORY_BASIC_INFORMATION mbi{};
+        VirtualQuery(_data, &mbi, sizeof(mbi));
+        _size = mbi.RegionSize;
+        return true;
+#else
+        const int fd = shm_open(objectName.c_str(), O_RDWR, 0600);
+        if (fd == -1)
+            return false;
+
+        struct stat st = {};
+        if (fstat(fd, &st) != 0 || st.st_size == 0)
+        {
+            close(fd);
+            return false;
+        }
+        _size = static_cast<size_t>(st.st_size);
+
+        void* view = mmap(
+            nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (view == MAP_FAILED)
+            return false;
+
+        _data = view;
+        return true;
+#endif
+    }
+};
+
+} // namespace CovCane::SharedMemory